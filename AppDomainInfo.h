@@ -7,19 +7,132 @@
 //#import "SimpleHostRuntime.tlb" no_namespace named_guids
 struct ISimpleHostDomainManager;
 
+// What the host did to the snippet running in a domain, because it went past its deadline.
+// Same values as the managed SnippetTimeoutAction
+const LONG SnippetTimeoutAction_None = 0;
+const LONG SnippetTimeoutAction_Abort = 1;
+const LONG SnippetTimeoutAction_Unload = 2;
+
+// Allocation rate over a sliding window of ALLOCATION_RATE_BUCKETS * ALLOCATION_RATE_BUCKET_MS
+// (2 seconds): bytes are added to the bucket of the current tick; buckets older than the
+// window are cleared lazily, when we move past them
+const int ALLOCATION_RATE_BUCKETS = 8;
+const ULONGLONG ALLOCATION_RATE_BUCKET_MS = 250;
+
+struct AllocationRate {
+   ULONGLONG lastBucket; // GetTickCount64 / ALLOCATION_RATE_BUCKET_MS of the last Add
+   LONGLONG buckets[ALLOCATION_RATE_BUCKETS];
+
+   void Reset() {
+      lastBucket = 0;
+      ZeroMemory(buckets, sizeof(buckets));
+   }
+
+   void Add(ULONGLONG now, LONGLONG bytes) {
+      ULONGLONG bucket = now / ALLOCATION_RATE_BUCKET_MS;
+      if (bucket >= lastBucket + ALLOCATION_RATE_BUCKETS) {
+         ZeroMemory(buckets, sizeof(buckets));
+      }
+      else {
+         for (ULONGLONG b = lastBucket + 1; b <= bucket; ++b)
+            buckets[b % ALLOCATION_RATE_BUCKETS] = 0;
+      }
+      if (bucket > lastBucket)
+         lastBucket = bucket;
+      buckets[lastBucket % ALLOCATION_RATE_BUCKETS] += bytes;
+   }
+
+   LONGLONG BytesPerSecond(ULONGLONG now) const {
+      ULONGLONG bucket = now / ALLOCATION_RATE_BUCKET_MS;
+      LONGLONG bytes = 0;
+      // Buckets after lastBucket are empty (not cleared yet)
+      for (ULONGLONG i = 0; i < ALLOCATION_RATE_BUCKETS && i <= bucket; ++i) {
+         if (bucket - i <= lastBucket)
+            bytes += buckets[(bucket - i) % ALLOCATION_RATE_BUCKETS];
+      }
+      return bytes * 1000 / (ALLOCATION_RATE_BUCKETS * ALLOCATION_RATE_BUCKET_MS);
+   }
+};
+
 struct AppDomainInfo {
+
+   // An empty slot (see FlatTable)
+   AppDomainInfo() : AppDomainInfo(0, NULL) { }
    
    AppDomainInfo(DWORD threadId, ISimpleHostDomainManager* manager) 
       : mainThreadId(threadId), appDomainManager(manager) { 
       threadsInAppDomain = 1; // The "main" thread
       bytesInAppDomain = 0;
+      peakBytesInAppDomain = 0;
+      allocsInAppDomain = 0;
+      peakThreadsInAppDomain = 1;
+      totalBytesAllocated = 0;
+      totalAllocs = 0;
+      liveBytes = 0;
+      reservedBytes = 0;
+      allocationRate.Reset();
+      workItemsQueued = 0;
+      workItemsPending = 0;
+      ioBytes = 0;
+      ioOperations = 0;
+      snippetTimeoutAction = SnippetTimeoutAction_None;
+      snippetRun = 0;
+      snippetRunning = false;
+      snippetAbortInProgress = false;
+      cpuTimeBase = 0;
+      cpuTimeExitedThreads = 0;
+      waitTimeBase = 0;
+      waitTimeExitedThreads = 0;
+      gcTime = 0;
+#ifdef THROTTLE_DOMAIN_IO
+      ioWindowStart = 0;
+      ioWindowBytes = 0;
+#endif //THROTTLE_DOMAIN_IO
    }
 
    DWORD mainThreadId;
    ISimpleHostDomainManager* appDomainManager;
    LONG threadsInAppDomain;
    LONG bytesInAppDomain;
+   LONG peakBytesInAppDomain;
    LONG allocsInAppDomain;
+   LONG peakThreadsInAppDomain;
+   // Since the domain was created (ResetCountersForAppDomain does not touch them):
+   // allocated, and still allocated, through the host
+   LONGLONG totalBytesAllocated;
+   LONG totalAllocs;
+   LONGLONG liveBytes;
+   // Address space reserved through VirtualAlloc (committed bytes are in bytesInAppDomain)
+   LONGLONG reservedBytes;
+   AllocationRate allocationRate;
+   // Threadpool work items queued on behalf of this domain (total, and not yet completed)
+   LONG workItemsQueued;
+   LONG workItemsPending;
+   // Completed I/O on handles bound by threads of this domain
+   LONGLONG ioBytes;
+   LONG ioOperations;
+   LONG snippetTimeoutAction;
+   // Incremented by each SnippetStarted, and used as the deadline timer cookie: an expiry
+   // for an older run, or delivered after SnippetEnded, is stale and must be ignored
+   LONG snippetRun;
+   bool snippetRunning;
+   // Set while the deadline enforcer is aborting the snippet (SnippetEnded waits for it)
+   bool snippetAbortInProgress;
+   // CPU time (microseconds) the live threads had already used at the last reset, and
+   // CPU time of the threads that left the domain since then
+   LONGLONG cpuTimeBase;
+   LONGLONG cpuTimeExitedThreads;
+   // Time spent in host waits and sleeps (microseconds) by the live threads at the last
+   // reset, and by the threads that left the domain since then
+   LONGLONG waitTimeBase;
+   LONGLONG waitTimeExitedThreads;
+   // Time the domain threads were stopped by GC suspensions (microseconds)
+   LONGLONG gcTime;
+#ifdef THROTTLE_DOMAIN_IO
+   // Bytes completed in the current one-second window
+   ULONGLONG ioWindowStart;
+   LONGLONG ioWindowBytes;
+#endif //THROTTLE_DOMAIN_IO
 };
 
 #endif //SH_APPDOMAIN_INFO_H_INCLUDED
@@ -0,0 +1,107 @@
+
+#include "AssemblyImage.h"
+
+#include <new>
+
+SHAssemblyImage::SHAssemblyImage(LPCWSTR name) : m_name(name) {
+   m_cRef = 1;
+   m_hFile = INVALID_HANDLE_VALUE;
+   m_hMapping = NULL;
+   m_pData = NULL;
+   m_pBuffer = NULL;
+   m_size = 0;
+   ZeroMemory(&m_lastWriteTime, sizeof(FILETIME));
+}
+
+SHAssemblyImage::~SHAssemblyImage() {
+   if (m_pData)
+      ::UnmapViewOfFile(m_pData);
+   if (m_hMapping)
+      ::CloseHandle(m_hMapping);
+   if (m_hFile != INVALID_HANDLE_VALUE)
+      ::CloseHandle(m_hFile);
+   if (m_pBuffer)
+      delete[] m_pBuffer;
+}
+
+// Returns an image with a reference count of 1
+HRESULT SHAssemblyImage::MapFile(LPCWSTR fileName, SHAssemblyImage** ppImage) {
+   if (!ppImage)
+      return E_POINTER;
+   *ppImage = NULL;
+
+   SHAssemblyImage* image = new SHAssemblyImage(fileName);
+
+   image->m_hFile = ::CreateFile(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (image->m_hFile == INVALID_HANDLE_VALUE) {
+      HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+      delete image;
+      return hr;
+   }
+
+   LARGE_INTEGER size;
+   if (!::GetFileSizeEx(image->m_hFile, &size)) {
+      HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+      delete image;
+      return hr;
+   }
+   image->m_size = size.QuadPart;
+   ::GetFileTime(image->m_hFile, NULL, NULL, &image->m_lastWriteTime);
+
+   // An empty file cannot be mapped; it is a valid (empty) image anyway
+   if (image->m_size > 0) {
+      image->m_hMapping = ::CreateFileMapping(image->m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (image->m_hMapping == NULL) {
+         HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+         delete image;
+         return hr;
+      }
+
+      image->m_pData = (const BYTE*)::MapViewOfFile(image->m_hMapping, FILE_MAP_READ, 0, 0, 0);
+      if (image->m_pData == NULL) {
+         HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+         delete image;
+         return hr;
+      }
+   }
+
+   *ppImage = image;
+   return S_OK;
+}
+
+// Returns an image with a reference count of 1, holding a copy of data
+HRESULT SHAssemblyImage::FromBuffer(LPCWSTR name, const BYTE* data, ULONG size, SHAssemblyImage** ppImage) {
+   if (!ppImage)
+      return E_POINTER;
+   *ppImage = NULL;
+   if (!data && size > 0)
+      return E_INVALIDARG;
+
+   SHAssemblyImage* image = new SHAssemblyImage(name);
+   if (size > 0) {
+      image->m_pBuffer = new (std::nothrow) BYTE[size];
+      if (!image->m_pBuffer) {
+         delete image;
+         return E_OUTOFMEMORY;
+      }
+      memcpy(image->m_pBuffer, data, size);
+   }
+   image->m_pData = image->m_pBuffer;
+   image->m_size = size;
+   ::GetSystemTimeAsFileTime(&image->m_lastWriteTime);
+
+   *ppImage = image;
+   return S_OK;
+}
+
+DWORD SHAssemblyImage::AddRef() {
+   return InterlockedIncrement(&m_cRef);
+}
+
+DWORD SHAssemblyImage::Release() {
+   ULONG cRef = InterlockedDecrement(&m_cRef);
+   if (cRef == 0) {
+      delete this;
+   }
+   return cRef;
+}
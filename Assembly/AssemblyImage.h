@@ -0,0 +1,47 @@
+#ifndef SH_ASSEMBLY_IMAGE_H_INCLUDED
+#define SH_ASSEMBLY_IMAGE_H_INCLUDED
+
+#define WIN32_LEAN_AND_MEAN		// Exclude rarely-used stuff from Windows headers
+
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT _WIN32_WINNT_WINXP
+#endif
+
+#include <windows.h>
+#include <string>
+
+// The bytes of an assembly (or PDB) file, mapped read-only in memory, or an assembly
+// image handed to us directly (and copied in a private buffer).
+// Refcounted: every stream reading from it holds a reference, so the memory lives
+// as long as the CLR keeps a stream around.
+class SHAssemblyImage {
+private:
+   volatile LONG m_cRef;
+   HANDLE m_hFile;
+   HANDLE m_hMapping;
+   const BYTE* m_pData;
+   BYTE* m_pBuffer;
+   ULONGLONG m_size;
+   FILETIME m_lastWriteTime;
+   std::wstring m_name;
+
+   SHAssemblyImage(LPCWSTR name);
+
+public:
+   ~SHAssemblyImage();
+
+   static HRESULT MapFile(LPCWSTR fileName, SHAssemblyImage** ppImage);
+   static HRESULT FromBuffer(LPCWSTR name, const BYTE* data, ULONG size, SHAssemblyImage** ppImage);
+
+   DWORD AddRef();
+   DWORD Release();
+
+   const BYTE* Data() const { return m_pData; }
+   ULONGLONG Size() const { return m_size; }
+   const FILETIME& LastWriteTime() const { return m_lastWriteTime; }
+   const std::wstring& Name() const { return m_name; }
+   // Only before the image is shared: the name is read without locks
+   void SetName(const std::wstring& name) { m_name = name; }
+};
+
+#endif //SH_ASSEMBLY_IMAGE_H_INCLUDED
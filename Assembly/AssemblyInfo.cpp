@@ -1,6 +1,71 @@
-
 #include "AssemblyInfo.h"
 
+#include <algorithm>
+#include <cwctype>
+#include <vector>
+
 AssemblyInfo::AssemblyInfo(const std::wstring& fullName, const std::wstring& loadPath, const std::wstring& debugInfoPath) 
-   : FullName(fullName), AssemblyLoadPath(loadPath), AssemblyDebugInfoPath(debugInfoPath) { }
+   : FullName(fullName), AssemblyLoadPath(loadPath), AssemblyDebugInfoPath(debugInfoPath),
+     Identity(NormalizeAssemblyIdentity(fullName.c_str())) { }
+
+static std::wstring TrimAndLower(const std::wstring& s) {
+   size_t begin = s.find_first_not_of(L" \t");
+   if (begin == std::wstring::npos)
+      return std::wstring();
+   size_t end = s.find_last_not_of(L" \t");
+
+   std::wstring result = s.substr(begin, end - begin + 1);
+   for (size_t i = 0; i < result.size(); ++i)
+      result[i] = (wchar_t)towlower(result[i]);
+   return result;
+}
+
+// Binding identities from the CLR may quote values (Version="1.0.0.0")
+static std::wstring Unquote(const std::wstring& s) {
+   if (s.size() >= 2 && s[0] == L'"' && s[s.size() - 1] == L'"')
+      return s.substr(1, s.size() - 2);
+   return s;
+}
+
+std::wstring NormalizeAssemblyIdentity(const wchar_t* displayName) {
+   // Split on commas; a backslash escapes the next character (names may contain "\,")
+   std::vector<std::wstring> parts;
+   std::wstring current;
+   for (const wchar_t* p = displayName; *p; ++p) {
+      if (*p == L'\\' && *(p + 1)) {
+         current += *p;
+         current += *(++p);
+      }
+      else if (*p == L',') {
+         parts.push_back(current);
+         current.clear();
+      }
+      else {
+         current += *p;
+      }
+   }
+   parts.push_back(current);
+
+   std::wstring identity = Unquote(TrimAndLower(parts[0]));
+
+   std::vector<std::wstring> components;
+   for (size_t i = 1; i < parts.size(); ++i) {
+      std::wstring component;
+      size_t equals = parts[i].find(L'=');
+      if (equals == std::wstring::npos) {
+         component = TrimAndLower(parts[i]);
+      }
+      else {
+         component = TrimAndLower(parts[i].substr(0, equals)) + L"=" + Unquote(TrimAndLower(parts[i].substr(equals + 1)));
+      }
+      if (!component.empty())
+         components.push_back(component);
+   }
+   std::sort(components.begin(), components.end());
 
+   for (size_t i = 0; i < components.size(); ++i) {
+      identity += L',';
+      identity += components[i];
+   }
+   return identity;
+}
@@ -1,4 +1,3 @@
-
 #ifndef SH_ASSEMBLY_INFO_H_INCLUDED
 #define SH_ASSEMBLY_INFO_H_INCLUDED
 
@@ -12,8 +11,16 @@ public:
    std::wstring AssemblyLoadPath;
    // The (fully qualified) path to the assembly pdb
    std::wstring AssemblyDebugInfoPath;
+   // FullName in canonical form (see NormalizeAssemblyIdentity)
+   std::wstring Identity;
    
    AssemblyInfo(const std::wstring& fullName, const std::wstring& loadPath, const std::wstring& debugInfoPath);
 };
 
-#endif //SH_ASSEMBLY_INFO_H_INCLUDED
\ No newline at end of file
+// Canonical form of an assembly display name: lowercase, no spaces, the simple name
+// followed by the "key=value" components sorted by key.
+// Two display names that differ only in case, spacing or component order (which is
+// what the CLR considers the same identity) map to the same string.
+std::wstring NormalizeAssemblyIdentity(const wchar_t* displayName);
+
+#endif //SH_ASSEMBLY_INFO_H_INCLUDED
@@ -5,13 +5,59 @@
 
 #include "../Logger.h"
 
-SHAssemblyManager::SHAssemblyManager(const std::list<AssemblyInfo>& hostAssemblies) {
+// The framework assemblies snippets (and our host assemblies) may use. Partial names: any
+// version with that public key token is loaded from the GAC. Everything else goes to our store.
+// The list must be closed under references: when a framework assembly is bound, its own
+// references are bound the same way, and a GAC assembly missing from here would be asked to our
+// store (which does not have it) instead of coming straight from the GAC.
+static LPCWSTR FrameworkAssemblies[] = {
+   L"mscorlib, PublicKeyToken=b77a5c561934e089",
+   L"System, PublicKeyToken=b77a5c561934e089",
+   L"System.Core, PublicKeyToken=b77a5c561934e089",
+   L"System.Xml, PublicKeyToken=b77a5c561934e089",
+   L"System.Xml.Linq, PublicKeyToken=b77a5c561934e089",
+   L"System.Data, PublicKeyToken=b77a5c561934e089",
+   L"System.Data.DataSetExtensions, PublicKeyToken=b77a5c561934e089",
+   L"System.Numerics, PublicKeyToken=b77a5c561934e089",
+   L"System.Runtime.Serialization, PublicKeyToken=b77a5c561934e089",
+   L"System.Configuration, PublicKeyToken=b03f5f7f11d50a3a",
+   L"Microsoft.CSharp, PublicKeyToken=b03f5f7f11d50a3a",
+   L"System.Data.SqlServerCe, PublicKeyToken=89845dcd8080cc91",
+   // Referenced by the ones above (System.Data, System.Xml, System.Transactions..)
+   L"System.Transactions, PublicKeyToken=b77a5c561934e089",
+   L"System.EnterpriseServices, PublicKeyToken=b03f5f7f11d50a3a",
+   L"System.Runtime.Caching, PublicKeyToken=b03f5f7f11d50a3a",
+   L"System.Runtime.Remoting, PublicKeyToken=b77a5c561934e089",
+   L"System.DirectoryServices, PublicKeyToken=b03f5f7f11d50a3a",
+   L"System.Security, PublicKeyToken=b03f5f7f11d50a3a",
+   L"System.Data.SqlXml, PublicKeyToken=b77a5c561934e089",
+   L"System.Drawing, PublicKeyToken=b03f5f7f11d50a3a",
+   L"System.ServiceModel.Internals, PublicKeyToken=31bf3856ad364e35",
+   L"SMDiagnostics, PublicKeyToken=b77a5c561934e089"
+};
+
+SHAssemblyManager::SHAssemblyManager(const std::list<AssemblyInfo>& hostAssemblies, ICLRAssemblyIdentityManager* identityManager) {
    m_cRef = 0;
    m_hostAssemblies = hostAssemblies;
-   assemblyStore = NULL;
+   // Created upfront: the host registers assemblies in it before the CLR asks for it
+   assemblyStore = new SHAssemblyStore(&m_hostAssemblies, identityManager);
+   assemblyStore->AddRef();
+
+   nonHostStoreAssemblies = NULL;
+   if (identityManager) {
+      HRESULT hr = identityManager->GetCLRAssemblyReferenceList(FrameworkAssemblies, _countof(FrameworkAssemblies), &nonHostStoreAssemblies);
+      if (FAILED(hr)) {
+         Logger::Error("Cannot build the list of non-host store assemblies: 0x%x", hr);
+         nonHostStoreAssemblies = NULL;
+      }
+   }
 }
 
-SHAssemblyManager::~SHAssemblyManager() {}
+SHAssemblyManager::~SHAssemblyManager() {
+   assemblyStore->Release();
+   if (nonHostStoreAssemblies)
+      nonHostStoreAssemblies->Release();
+}
 
 // IUnknown functions
 
@@ -45,8 +91,13 @@ STDMETHODIMP SHAssemblyManager::QueryInterface(const IID &riid, void **ppvObject
 
 STDMETHODIMP SHAssemblyManager::GetNonHostStoreAssemblies(/* [out] */ ICLRAssemblyReferenceList **ppReferenceList) {
    Logger::Info("In AssemblyManager::GetNonHostStoreAssemblies");
-   // Tell the CLR to just try to load everything by itself from the GAC, as a first step...
-   *ppReferenceList = NULL;
+   // The assemblies in the list are loaded by the CLR from the GAC, without asking us; everything
+   // else is asked to our store first (ProvideAssembly).
+   // Without a list (NULL), the CLR looks in the GAC first for every assembly, and calls
+   // ProvideAssembly only for the ones it does not find there
+   if (nonHostStoreAssemblies)
+      nonHostStoreAssemblies->AddRef();
+   *ppReferenceList = nonHostStoreAssemblies;
    return S_OK;
 }
 
@@ -54,11 +105,7 @@ STDMETHODIMP SHAssemblyManager::GetAssemblyStore(/* [out] */ IHostAssemblyStore
    Logger::Info("In AssemblyManager::GetAssemblyStore");
 
    // ... if not, try to load it using our store
-
-   if (assemblyStore == NULL) {
-      assemblyStore = new SHAssemblyStore(&m_hostAssemblies);
-   }
-
+   assemblyStore->AddRef();
    *ppAssemblyStore = assemblyStore;
 
    // not something we are interested in?
@@ -7,17 +7,23 @@
 #include <list>
 #include "AssemblyInfo.h"
 
+class SHAssemblyStore;
+
 class SHAssemblyManager : public IHostAssemblyManager {
 
 private:
    volatile LONG m_cRef;
-   IHostAssemblyStore* assemblyStore;
+   SHAssemblyStore* assemblyStore;
    std::list<AssemblyInfo> m_hostAssemblies;
+   // Assemblies the CLR binds by itself (GAC), without asking our store
+   ICLRAssemblyReferenceList* nonHostStoreAssemblies;
 
 public:
-   SHAssemblyManager(const std::list<AssemblyInfo>&);
+   SHAssemblyManager(const std::list<AssemblyInfo>&, ICLRAssemblyIdentityManager* identityManager);
    ~SHAssemblyManager();
 
+   SHAssemblyStore* GetHostAssemblyStore() { return assemblyStore; }
+
    // IUnknown functions
    STDMETHODIMP_(DWORD) AddRef();
    STDMETHODIMP_(DWORD) Release();
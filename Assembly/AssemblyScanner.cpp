@@ -0,0 +1,60 @@
+
+#include "AssemblyScanner.h"
+#include "../Logger.h"
+
+static HRESULT GetIdentityFromFile(ICLRAssemblyIdentityManager* identityManager, const std::wstring& fileName, std::wstring& identity) {
+   WCHAR buffer[MAX_PATH];
+   DWORD bufferSize = MAX_PATH;
+   HRESULT hr = identityManager->GetBindingIdentityFromFile(fileName.c_str(), CLR_ASSEMBLY_IDENTITY_FLAGS_DEFAULT, buffer, &bufferSize);
+   if (hr == HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER)) {
+      std::wstring largeBuffer(bufferSize, L'\0');
+      hr = identityManager->GetBindingIdentityFromFile(fileName.c_str(), CLR_ASSEMBLY_IDENTITY_FLAGS_DEFAULT, &largeBuffer[0], &bufferSize);
+      if (SUCCEEDED(hr))
+         identity = largeBuffer.c_str();
+   }
+   else if (SUCCEEDED(hr)) {
+      identity = buffer;
+   }
+   return hr;
+}
+
+int ScanAssemblyDirectory(const std::wstring& directory, ICLRAssemblyIdentityManager* identityManager, std::list<AssemblyInfo>& assemblies) {
+   if (!identityManager)
+      return -1;
+
+   WIN32_FIND_DATA findData;
+   HANDLE hFind = ::FindFirstFile((directory + L"\\*.dll").c_str(), &findData);
+   if (hFind == INVALID_HANDLE_VALUE) {
+      DWORD error = GetLastError();
+      if (error == ERROR_FILE_NOT_FOUND)
+         return 0;
+      Logger::Error(L"Cannot scan %s: %d", directory.c_str(), error);
+      return -1;
+   }
+
+   int numAssemblies = 0;
+   do {
+      if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+         continue;
+
+      std::wstring loadPath = directory + L"\\" + findData.cFileName;
+      std::wstring identity;
+      HRESULT hr = GetIdentityFromFile(identityManager, loadPath, identity);
+      if (FAILED(hr)) {
+         // Native dlls, for example
+         Logger::Debug(L"Skipping %s: not an assembly (0x%x)", loadPath.c_str(), hr);
+         continue;
+      }
+
+      std::wstring debugInfoPath = loadPath.substr(0, loadPath.size() - 4) + L".pdb";
+      if (::GetFileAttributes(debugInfoPath.c_str()) == INVALID_FILE_ATTRIBUTES)
+         debugInfoPath.clear();
+
+      Logger::Info(L"Host assembly %s from %s", identity.c_str(), loadPath.c_str());
+      assemblies.push_back(AssemblyInfo(identity, loadPath, debugInfoPath));
+      ++numAssemblies;
+   } while (::FindNextFile(hFind, &findData));
+
+   ::FindClose(hFind);
+   return numAssemblies;
+}
@@ -0,0 +1,15 @@
+#ifndef SH_ASSEMBLY_SCANNER_H_INCLUDED
+#define SH_ASSEMBLY_SCANNER_H_INCLUDED
+
+#include "../Common.h"
+
+#include <list>
+#include "AssemblyInfo.h"
+
+// Adds an AssemblyInfo for every assembly (*.dll) in directory, reading its identity from
+// the assembly metadata; the PDB next to it, if any, becomes its debug info.
+// Files that are not assemblies are skipped. Returns how many assemblies were added, or -1 if
+// the directory cannot be read.
+int ScanAssemblyDirectory(const std::wstring& directory, ICLRAssemblyIdentityManager* identityManager, std::list<AssemblyInfo>& assemblies);
+
+#endif //SH_ASSEMBLY_SCANNER_H_INCLUDED
@@ -1,35 +1,301 @@
 
 
 #include "AssemblyStore.h"
-#include "FileStream.h"
+#include "AssemblyImage.h"
+#include "ImageStream.h"
 #include "../Logger.h"
+#include "../CrstLock.h"
 
-SHAssemblyStore::SHAssemblyStore(std::list<AssemblyInfo>* assemblies) {
+SHAssemblyStore::SHAssemblyStore(std::list<AssemblyInfo>* assemblies, ICLRAssemblyIdentityManager* identityManager) {
    hostAssemblies = assemblies;
    m_cRef = 0;
+
+   this->identityManager = identityManager;
+   if (identityManager)
+      identityManager->AddRef();
+
+   indexCrst = new CRITICAL_SECTION;
+   if (!indexCrst)
+      Logger::Critical("Failed to allocate critical sections");
+   InitializeCriticalSection(indexCrst);
+
+   bindStatisticsCrst = new CRITICAL_SECTION;
+   if (!bindStatisticsCrst)
+      Logger::Critical("Failed to allocate critical sections");
+   InitializeCriticalSection(bindStatisticsCrst);
+
+   ::QueryPerformanceFrequency(&ticksPerSecond);
+   for (int i = 0; i < BIND_HISTOGRAM_BUCKETS; ++i)
+      bindHistogram[i] = 0;
+
+   // WARNING WARNING! Ids cannot be "0" or the CLR will freak out (and will start to search for types in the wrong assemblies)
+   UINT64 id = 10000;
+   identityIndex.reserve(hostAssemblies->size());
+   for (auto it = hostAssemblies->begin(); it != hostAssemblies->end(); ++it, ++id) {
+      HostAssembly hostAssembly = { id, &(*it), NULL, NULL, registeredAssemblies.end() };
+      if (!identityIndex.insert(std::make_pair(it->Identity, hostAssembly)).second)
+         Logger::Error(L"Assembly %s is registered more than once; using the first one", it->FullName.c_str());
+   }
+   nextAssemblyId = id;
 }
 
 SHAssemblyStore::~SHAssemblyStore() {
+   for (auto it = identityIndex.begin(); it != identityIndex.end(); ++it) {
+      // Streams still around keep their own reference
+      if (it->second.image)
+         it->second.image->Release();
+      if (it->second.debugInfo)
+         it->second.debugInfo->Release();
+   }
+
+   if (identityManager)
+      identityManager->Release();
+
+   if (indexCrst)
+      DeleteCriticalSection(indexCrst);
+   if (bindStatisticsCrst)
+      DeleteCriticalSection(bindStatisticsCrst);
+}
+
+// That's ... unusual: there is no straightforward, supported way to create a stream
+// from a file in COM. We may implement it ourservels, or use a "surrogate"
+// There is "SHCreateStreamOnFile", which is implemented by the Shell. Not ideal.
+// There is "URLOpenBlockingStream" from IE, which is implemented in Urlmon. Maybe better
+// We map the file once (the CLR reads images in many small chunks), and serve
+// streams from memory.
+static HRESULT CreateStreamFromImage(SHAssemblyImage* image, IStream **ppStream) {
+   SHImageStream* imageStream = new SHImageStream(image);
+   imageStream->AddRef();
+   *ppStream = imageStream;
+   return S_OK;
 }
 
+// Called with indexCrst held. Returned images have a reference for the caller
+HRESULT SHAssemblyStore::GetImages(HostAssembly& hostAssembly, SHAssemblyImage** ppImage, SHAssemblyImage** ppDebugInfo) {
+   if (!hostAssembly.image) {
+      // First time someone asks for it: this is the only time we touch the file system
+      const AssemblyInfo* assemblyInfo = hostAssembly.info;
+      HRESULT hr = SHAssemblyImage::MapFile(assemblyInfo->AssemblyLoadPath.c_str(), &hostAssembly.image);
+      if (FAILED(hr))
+         return hr;
 
-HRESULT CreateStreamFromFile(LPCWSTR fileName, IStream **ppStream) {
-   // That's ... unusual: there is no straightforward, supported way to do that in COM.
-   // We may implement it ourservels, or use a "surrogate"
-   // There is "SHCreateStreamOnFile", which is implemented by the Shell. Not ideal.
-   // There is "URLOpenBlockingStream" from IE, which is implemented in Urlmon. Maybe better
-   SHFileStream* fileStream = new SHFileStream(fileName);
-   HRESULT hr = fileStream->OpenRead();
-   if (SUCCEEDED(hr)) {
-      *ppStream = fileStream;
+      if (!assemblyInfo->AssemblyDebugInfoPath.empty()) {
+         hr = SHAssemblyImage::MapFile(assemblyInfo->AssemblyDebugInfoPath.c_str(), &hostAssembly.debugInfo);
+         if (FAILED(hr)) {
+            // Just skip debug info, if not found
+            Logger::Error(L"Cannot load debug info from %s", assemblyInfo->AssemblyDebugInfoPath.c_str());
+            hostAssembly.debugInfo = NULL;
+         }
+      }
+   }
+
+   *ppImage = hostAssembly.image;
+   hostAssembly.image->AddRef();
+   *ppDebugInfo = hostAssembly.debugInfo;
+   if (hostAssembly.debugInfo)
+      hostAssembly.debugInfo->AddRef();
+   return S_OK;
+}
+
+HRESULT SHAssemblyStore::GetIdentity(SHAssemblyImage* image, std::wstring& identity) {
+   if (!identityManager)
+      return E_NOTIMPL;
+
+   IStream* stream;
+   CreateStreamFromImage(image, &stream);
+
+   WCHAR buffer[MAX_PATH];
+   DWORD bufferSize = MAX_PATH;
+   HRESULT hr = identityManager->GetBindingIdentityFromStream(stream, CLR_ASSEMBLY_IDENTITY_FLAGS_DEFAULT, buffer, &bufferSize);
+   if (hr == HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER)) {
+      std::wstring largeBuffer(bufferSize, L'\0');
+      stream->Seek(LARGE_INTEGER(), STREAM_SEEK_SET, NULL);
+      hr = identityManager->GetBindingIdentityFromStream(stream, CLR_ASSEMBLY_IDENTITY_FLAGS_DEFAULT, &largeBuffer[0], &bufferSize);
+      if (SUCCEEDED(hr))
+         identity = largeBuffer.c_str();
    }
+   else if (SUCCEEDED(hr)) {
+      identity = buffer;
+   }
+
+   stream->Release();
    return hr;
 }
 
-bool SHAssemblyStore::SameAssembly(const std::wstring& availableName, LPCWSTR requiredName) {
-   size_t requiredNameLen = wcslen(requiredName);
-   return requiredNameLen == availableName.size() &&
-      (_wcsnicmp(availableName.c_str(), requiredName, availableName.size()) == 0);
+// Called with indexCrst held
+void SHAssemblyStore::EvictRegisteredAssembly() {
+   auto it = identityIndex.find(registeredAssemblies.back());
+   if (it != identityIndex.end()) {
+      Logger::Debug(L"Evicting registered assembly %s", it->second.image->Name().c_str());
+      // Streams still around keep their own reference
+      it->second.image->Release();
+      identityIndex.erase(it);
+   }
+   registeredAssemblies.pop_back();
+}
+
+HRESULT SHAssemblyStore::RegisterAssembly(const BYTE* data, ULONG size, std::wstring& fullName) {
+   // Copy and parse outside the lock: binds from other domains can go on meanwhile
+   SHAssemblyImage* image;
+   HRESULT hr = SHAssemblyImage::FromBuffer(L"", data, size, &image);
+   if (FAILED(hr))
+      return hr;
+
+   hr = GetIdentity(image, fullName);
+   if (FAILED(hr)) {
+      Logger::Error("Cannot read the identity of the assembly to register: 0x%x", hr);
+      image->Release();
+      return hr;
+   }
+   image->SetName(fullName);
+   std::wstring identity = NormalizeAssemblyIdentity(fullName.c_str());
+
+   CrstLock lock(indexCrst);
+
+   auto it = identityIndex.find(identity);
+   if (it != identityIndex.end()) {
+      HostAssembly& existing = it->second;
+      bool sameImage = existing.info == NULL && existing.image->Size() == size &&
+         memcmp(existing.image->Data(), data, size) == 0;
+      image->Release();
+
+      if (!sameImage) {
+         Logger::Error(L"Cannot register %s: a different assembly with the same identity is already in the store", fullName.c_str());
+         return HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS);
+      }
+      registeredAssemblies.splice(registeredAssemblies.begin(), registeredAssemblies, existing.lruPosition);
+      return S_OK;
+   }
+
+   if (registeredAssemblies.size() >= MAX_REGISTERED_ASSEMBLIES)
+      EvictRegisteredAssembly();
+
+   registeredAssemblies.push_front(identity);
+   HostAssembly hostAssembly = { nextAssemblyId++, NULL, image, NULL, registeredAssemblies.begin() };
+   identityIndex.insert(std::make_pair(identity, hostAssembly));
+
+   Logger::Debug(L"Registered assembly %s (%d bytes)", fullName.c_str(), size);
+   return S_OK;
+}
+
+bool SHAssemblyStore::IsAssemblyRegistered(LPCWSTR fullName) {
+   std::wstring identity = NormalizeAssemblyIdentity(fullName);
+
+   CrstLock lock(indexCrst);
+   return identityIndex.find(identity) != identityIndex.end();
+}
+
+static void TouchPages(SHAssemblyImage* image, DWORD pageSize) {
+   const volatile BYTE* data = image->Data();
+   BYTE sum = 0;
+   for (ULONGLONG offset = 0; offset < image->Size(); offset += pageSize)
+      sum += data[offset];
+}
+
+void SHAssemblyStore::PrefetchAssemblies() {
+   for (auto it = hostAssemblies->begin(); it != hostAssemblies->end(); ++it) {
+      if (it->AssemblyLoadPath.empty())
+         continue;
+
+      PrefetchRequest* request = new PrefetchRequest();
+      request->store = this;
+      request->identity = it->Identity;
+      AddRef();
+      if (!::QueueUserWorkItem(PrefetchWorkItem, request, WT_EXECUTEDEFAULT)) {
+         Logger::Error("QueueUserWorkItem failed: %d", GetLastError());
+         delete request;
+         Release();
+      }
+   }
+}
+
+DWORD WINAPI SHAssemblyStore::PrefetchWorkItem(LPVOID param) {
+   PrefetchRequest* request = (PrefetchRequest*)param;
+   request->store->PrefetchAssembly(request->identity);
+   request->store->Release();
+   delete request;
+   return 0;
+}
+
+void SHAssemblyStore::PrefetchAssembly(const std::wstring& identity) {
+   const AssemblyInfo* assemblyInfo;
+   {
+      CrstLock lock(indexCrst);
+      auto it = identityIndex.find(identity);
+      // Host assemblies from the configuration are never evicted; still, someone may have bound it already
+      if (it == identityIndex.end() || it->second.image)
+         return;
+      assemblyInfo = it->second.info;
+   }
+
+   // Map outside the lock: binds go on meanwhile
+   SHAssemblyImage* image;
+   SHAssemblyImage* debugInfo = NULL;
+   HRESULT hr = SHAssemblyImage::MapFile(assemblyInfo->AssemblyLoadPath.c_str(), &image);
+   if (FAILED(hr)) {
+      Logger::Error(L"Cannot prefetch %s: 0x%x", assemblyInfo->AssemblyLoadPath.c_str(), hr);
+      return;
+   }
+   if (!assemblyInfo->AssemblyDebugInfoPath.empty()) {
+      if (FAILED(SHAssemblyImage::MapFile(assemblyInfo->AssemblyDebugInfoPath.c_str(), &debugInfo)))
+         debugInfo = NULL;
+   }
+
+   SYSTEM_INFO systemInfo;
+   ::GetSystemInfo(&systemInfo);
+   TouchPages(image, systemInfo.dwPageSize);
+   if (debugInfo)
+      TouchPages(debugInfo, systemInfo.dwPageSize);
+
+   {
+      CrstLock lock(indexCrst);
+      auto it = identityIndex.find(identity);
+      if (it != identityIndex.end() && !it->second.image) {
+         it->second.image = image;
+         it->second.debugInfo = debugInfo;
+         Logger::Debug(L"Prefetched %s", assemblyInfo->AssemblyLoadPath.c_str());
+         return;
+      }
+   }
+
+   // A bind got there first
+   image->Release();
+   if (debugInfo)
+      debugInfo->Release();
+}
+
+void SHAssemblyStore::RecordBind(DWORD appDomainId, bool hit, ULONGLONG bytesProvided, LONGLONG microseconds) {
+   int bucket = 0;
+   while (bucket < BIND_HISTOGRAM_BUCKETS - 1 && (microseconds >> bucket) > 0)
+      ++bucket;
+   InterlockedIncrement(&bindHistogram[bucket]);
+
+   CrstLock lock(bindStatisticsCrst);
+   BindStatistics& statistics = domainBinds[appDomainId];
+   ++statistics.binds;
+   if (!hit)
+      ++statistics.misses;
+   statistics.bytesProvided += bytesProvided;
+   statistics.microseconds += microseconds;
+}
+
+void SHAssemblyStore::GetBindStatistics(DWORD appDomainId, BindStatistics* statistics) {
+   CrstLock lock(bindStatisticsCrst);
+   auto it = domainBinds.find(appDomainId);
+   if (it == domainBinds.end())
+      ZeroMemory(statistics, sizeof(BindStatistics));
+   else
+      *statistics = it->second;
+}
+
+void SHAssemblyStore::ResetBindStatistics(DWORD appDomainId) {
+   CrstLock lock(bindStatisticsCrst);
+   domainBinds.erase(appDomainId);
+}
+
+void SHAssemblyStore::GetBindHistogram(LONG* buckets) {
+   for (int i = 0; i < BIND_HISTOGRAM_BUCKETS; ++i)
+      buckets[i] = bindHistogram[i];
 }
 
 // IHostAssemblyStore
@@ -39,6 +305,27 @@ HRESULT STDMETHODCALLTYPE SHAssemblyStore::ProvideAssembly(
    UINT64           *pContext,
    IStream          **ppStmAssemblyImage,
    IStream          **ppStmPDB) {
+
+   LARGE_INTEGER start, end;
+   ::QueryPerformanceCounter(&start);
+   ULONGLONG bytesProvided = 0;
+   HRESULT hr = ProvideHostAssembly(pBindInfo, pAssemblyId, pContext, ppStmAssemblyImage, ppStmPDB, &bytesProvided);
+   ::QueryPerformanceCounter(&end);
+
+   LONGLONG microseconds = (end.QuadPart - start.QuadPart) * 1000000 / ticksPerSecond.QuadPart;
+   RecordBind(pBindInfo->dwAppDomainId, SUCCEEDED(hr), bytesProvided, microseconds);
+   Logger::Debug(L"Bind of '%s' in domain %d: %s, %I64u bytes, %I64d us", pBindInfo->lpPostPolicyIdentity, pBindInfo->dwAppDomainId,
+      SUCCEEDED(hr) ? L"hit" : L"miss", bytesProvided, microseconds);
+   return hr;
+}
+
+HRESULT SHAssemblyStore::ProvideHostAssembly(
+   AssemblyBindInfo *pBindInfo,
+   UINT64           *pAssemblyId,
+   UINT64           *pContext,
+   IStream          **ppStmAssemblyImage,
+   IStream          **ppStmPDB,
+   ULONGLONG        *pBytesProvided) {
    
    Logger::Debug(L"ProvideAssembly called for binding identity '%s' in domain %d ", pBindInfo->lpPostPolicyIdentity, pBindInfo->dwAppDomainId);
 
@@ -57,42 +344,52 @@ HRESULT STDMETHODCALLTYPE SHAssemblyStore::ProvideAssembly(
    // We don't use pContext for any host-specific data - set it to 0. 
    *pContext = 0;
 
-   // WARNING WARNING! This cannot be "0" or the CLR will freak out (and will start to search for types in the wrong assemblies)
-   UINT64 id = 10000; 
-   std::list<AssemblyInfo>::iterator it;
-   for (it = hostAssemblies->begin(); it != hostAssemblies->end(); ++it, ++id) {
-      if (SameAssembly(it->FullName, pBindInfo->lpPostPolicyIdentity)) {
-         *pAssemblyId = id;
+   std::wstring identity = NormalizeAssemblyIdentity(pBindInfo->lpPostPolicyIdentity);
 
-         if (it->AssemblyLoadPath.empty()) {
-            return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
-         }
+   SHAssemblyImage* image;
+   SHAssemblyImage* debugInfo;
+   {
+      CrstLock lock(indexCrst);
 
-         HRESULT hr = CreateStreamFromFile(it->AssemblyLoadPath.c_str(), ppStmAssemblyImage);
-         if (FAILED(hr)) {
-            return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
-         }
+      auto it = identityIndex.find(identity);
+      if (it == identityIndex.end()) {
+         // not something we are interested in?
+         // Ask the CLR to continue with the standart app base probe
+         // TODO: simply fail and stop?
+         return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+      }
 
-         if (!it->AssemblyDebugInfoPath.empty()) {
-            hr = CreateStreamFromFile(it->AssemblyDebugInfoPath.c_str(), ppStmPDB);
-            if (FAILED(hr)) {
-               // Just skip debug info, if not found
-               Logger::Error(L"Cannot load debug info from %s", it->AssemblyDebugInfoPath);
-               *ppStmPDB = NULL;
-            }         
-         }
+      HostAssembly& hostAssembly = it->second;
+      *pAssemblyId = hostAssembly.id;
+
+      if (hostAssembly.info && hostAssembly.info->AssemblyLoadPath.empty()) {
+         return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+      }
 
-         Logger::Debug("Assembly provided by HOST storage");
-         return S_OK;
-      }      
+      HRESULT hr = GetImages(hostAssembly, &image, &debugInfo);
+      if (FAILED(hr)) {
+         return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+      }
+
+      if (!hostAssembly.info)
+         registeredAssemblies.splice(registeredAssemblies.begin(), registeredAssemblies, hostAssembly.lruPosition);
    }
 
-   // not something we are interested in?
-   // Ask the CLR to continue with the standart app base probe
-   // TODO: simply fail and stop?
-   return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND); 
-}
+   CreateStreamFromImage(image, ppStmAssemblyImage);
+   *pBytesProvided = image->Size();
+   image->Release();
+   if (debugInfo) {
+      CreateStreamFromImage(debugInfo, ppStmPDB);
+      *pBytesProvided += debugInfo->Size();
+      debugInfo->Release();
+   }
+   else {
+      *ppStmPDB = NULL;
+   }
 
+   Logger::Debug("Assembly provided by HOST storage");
+   return S_OK;
+}
 
 HRESULT STDMETHODCALLTYPE SHAssemblyStore::ProvideModule(
    ModuleBindInfo* pBindInfo,
@@ -102,7 +399,8 @@ HRESULT STDMETHODCALLTYPE SHAssemblyStore::ProvideModule(
 
    Logger::Debug(L"ProvideModule called for binding identity '%s' in domain %d", pBindInfo->lpAssemblyIdentity, pBindInfo->dwAppDomainId);
 
-   // Let the CLR load every module
+   // Let the CLR load every module (it still counts as a bind, a miss)
+   RecordBind(pBindInfo->dwAppDomainId, false, 0, 0);
    return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
 }
 
@@ -5,20 +5,96 @@
 #include "../Common.h"
 
 #include <list>
+#include <unordered_map>
 #include "AssemblyInfo.h"
 
+class SHAssemblyImage;
+
+// How many assemblies registered at runtime (snippets) we keep around. When we go past it,
+// the least recently used one is dropped; domains that already bound it keep their stream.
+const int MAX_REGISTERED_ASSEMBLIES = 256;
+
+// Bind latency histogram: bucket 0 counts binds under 1 us, bucket i binds in [2^(i-1), 2^i) us.
+// The last bucket takes everything above (8 seconds and more)
+const int BIND_HISTOGRAM_BUCKETS = 24;
+
+struct BindStatistics {
+   LONG binds;
+   LONG misses;
+   ULONGLONG bytesProvided;
+   LONGLONG microseconds;
+};
+
 class SHAssemblyStore : public IHostAssemblyStore {
 
 private:
    volatile LONG m_cRef;
    std::list<AssemblyInfo>* hostAssemblies;
 
-   bool SameAssembly(const std::wstring& availableName, LPCWSTR requiredName);
+   // Host assemblies by normalized identity (see NormalizeAssemblyIdentity), so that a
+   // bind request is a single hash lookup no matter how many assemblies we host.
+   // Assemblies from the command line/configuration are indexed at startup; assemblies
+   // registered at runtime (RegisterAssembly) are added and evicted in LRU order.
+   // Ids are assigned when an assembly enters the index and never change.
+   // Images (and PDBs) of file-based assemblies are loaded the first time any AppDomain asks
+   // for them, then shared by all of them: every stream we hand out is a view over the same bytes.
+   struct HostAssembly {
+      UINT64 id;
+      const AssemblyInfo* info; // NULL for registered assemblies
+      SHAssemblyImage* image;
+      SHAssemblyImage* debugInfo;
+      std::list<std::wstring>::iterator lruPosition; // Registered assemblies only
+   };
+   std::unordered_map<std::wstring, HostAssembly> identityIndex;
+   // Identities of registered assemblies, most recently used first
+   std::list<std::wstring> registeredAssemblies;
+   UINT64 nextAssemblyId;
+   LPCRITICAL_SECTION indexCrst;
+
+   ICLRAssemblyIdentityManager* identityManager;
+
+   // Bind instrumentation: a global latency histogram, and totals for each AppDomain
+   LARGE_INTEGER ticksPerSecond;
+   volatile LONG bindHistogram[BIND_HISTOGRAM_BUCKETS];
+   std::unordered_map<DWORD, BindStatistics> domainBinds;
+   LPCRITICAL_SECTION bindStatisticsCrst;
+
+   HRESULT ProvideHostAssembly(AssemblyBindInfo *pBindInfo, UINT64 *pAssemblyId, UINT64 *pContext,
+      IStream **ppStmAssemblyImage, IStream **ppStmPDB, ULONGLONG* pBytesProvided);
+   void RecordBind(DWORD appDomainId, bool hit, ULONGLONG bytesProvided, LONGLONG microseconds);
+
+   HRESULT GetImages(HostAssembly& hostAssembly, SHAssemblyImage** ppImage, SHAssemblyImage** ppDebugInfo);
+   HRESULT GetIdentity(SHAssemblyImage* image, std::wstring& identity);
+   void EvictRegisteredAssembly();
+
+   struct PrefetchRequest {
+      SHAssemblyStore* store;
+      std::wstring identity;
+   };
+   static DWORD WINAPI PrefetchWorkItem(LPVOID param);
+   void PrefetchAssembly(const std::wstring& identity);
 
 public:
-   SHAssemblyStore(std::list<AssemblyInfo>*);
+   SHAssemblyStore(std::list<AssemblyInfo>*, ICLRAssemblyIdentityManager* identityManager);
    ~SHAssemblyStore();
 
+   // Publishes an assembly image under its own identity, so that any AppDomain can then
+   // bind it by name (Assembly.Load(fullName)) and get a stream over our copy of the bytes.
+   // Registering the same bytes again is a no-op; registering different bytes under an
+   // identity we already serve is an error (HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS))
+   HRESULT RegisterAssembly(const BYTE* data, ULONG size, std::wstring& fullName);
+   bool IsAssemblyRegistered(LPCWSTR fullName);
+
+   // Maps the images of all the host assemblies and faults their pages in, in parallel on the
+   // OS thread pool, so that the first binds find them in memory. Returns immediately.
+   void PrefetchAssemblies();
+
+   // Binds seen so far for the AppDomain (all zeros if none), since the last reset
+   void GetBindStatistics(DWORD appDomainId, BindStatistics* statistics);
+   void ResetBindStatistics(DWORD appDomainId);
+   // Copies BIND_HISTOGRAM_BUCKETS counters
+   void GetBindHistogram(LONG* buckets);
+
    // IUnknown functions
    STDMETHODIMP_(DWORD) AddRef();
    STDMETHODIMP_(DWORD) Release();
@@ -1,14 +1,21 @@
 
 #include "FileStream.h"
 
-SHFileStream::SHFileStream(LPCWSTR fileName) {
+SHFileStream::SHFileStream(LPCWSTR fileName) : m_fileName(fileName) {
    m_cRef = 0;
-   m_fileName = fileName;
    m_hFile = INVALID_HANDLE_VALUE;
+   m_accessMode = 0;
+   m_position = 0;
+
+   m_buffer = NULL;
+   m_bufferOffset = 0;
+   m_bufferLength = 0;
 }
 
 SHFileStream::~SHFileStream() {
    Close();
+   if (m_buffer)
+      ::VirtualFree(m_buffer, 0, MEM_RELEASE);
 }
 
 // IUnknown functions
@@ -29,7 +36,7 @@ STDMETHODIMP SHFileStream::QueryInterface(const IID &riid, void **ppvObject) {
    if (!ppvObject)
       return E_POINTER;
 
-   if (riid == IID_IUnknown || riid == IID_IStream) {
+   if (riid == IID_IUnknown || riid == IID_IStream || riid == IID_ISequentialStream) {
       *ppvObject = this;
       AddRef();
       return S_OK;
@@ -40,10 +47,14 @@ STDMETHODIMP SHFileStream::QueryInterface(const IID &riid, void **ppvObject) {
 }
 
 STDMETHODIMP SHFileStream::Open(DWORD dwAccessMode) {
-   m_hFile = ::CreateFile(m_fileName, dwAccessMode, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+   // Random access: clones read at different offsets, and so does the CLR when it parses metadata
+   m_hFile = ::CreateFile(m_fileName.c_str(), dwAccessMode, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
    if (m_hFile == INVALID_HANDLE_VALUE)
       return HRESULT_FROM_WIN32(GetLastError());
 
+   m_accessMode = dwAccessMode;
+   m_position = 0;
+   InvalidateBuffer();
    return S_OK;
 }
 
@@ -58,11 +69,45 @@ STDMETHODIMP SHFileStream::OpenWrite() {
 STDMETHODIMP SHFileStream::Close() {
    if (m_hFile != INVALID_HANDLE_VALUE)
       ::CloseHandle(m_hFile);
-   m_hFile = NULL;
+   m_hFile = INVALID_HANDLE_VALUE;
+
+   return S_OK;
+}
 
+// Positional read: does not use (nor care about) the file pointer
+HRESULT SHFileStream::ReadAt(ULONGLONG offset, void* pv, ULONG cb, ULONG* pcbRead) {
+   OVERLAPPED overlapped;
+   ZeroMemory(&overlapped, sizeof(OVERLAPPED));
+   overlapped.Offset = (DWORD)offset;
+   overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+   DWORD cbRead = 0;
+   if (!::ReadFile(m_hFile, pv, cb, &cbRead, &overlapped)) {
+      DWORD error = GetLastError();
+      *pcbRead = 0;
+      // Reading at or past the end of the file is not an error for a stream
+      return (error == ERROR_HANDLE_EOF) ? S_OK : HRESULT_FROM_WIN32(error);
+   }
+   *pcbRead = cbRead;
    return S_OK;
 }
 
+HRESULT SHFileStream::FillBuffer(ULONGLONG offset) {
+   if (!m_buffer) {
+      // VirtualAlloc gives us page-aligned memory
+      m_buffer = (BYTE*)::VirtualAlloc(NULL, FILE_STREAM_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+      if (!m_buffer)
+         return E_OUTOFMEMORY;
+   }
+
+   // Start at an aligned offset, so consecutive refills never overlap
+   m_bufferOffset = offset - (offset % FILE_STREAM_BUFFER_SIZE);
+   HRESULT hr = ReadAt(m_bufferOffset, m_buffer, FILE_STREAM_BUFFER_SIZE, &m_bufferLength);
+   if (FAILED(hr))
+      InvalidateBuffer();
+   return hr;
+}
+
 // ISequentialStream functions
 STDMETHODIMP SHFileStream::Read(
    /* [annotation] */
@@ -72,21 +117,79 @@ STDMETHODIMP SHFileStream::Read(
    /* [annotation] */
    _Out_opt_  ULONG *pcbRead) {
 
-   if (::ReadFile(m_hFile, pv, cb, pcbRead, NULL))
-      return S_OK;
-   else
-      return HRESULT_FROM_WIN32(GetLastError());
+   if (!pv)
+      return STG_E_INVALIDPOINTER;
+
+   BYTE* destination = (BYTE*)pv;
+   ULONG totalRead = 0;
+   HRESULT hr = S_OK;
+
+   while (totalRead < cb) {
+      ULONG remaining = cb - totalRead;
+
+      // Served from the read-ahead buffer?
+      if (m_position >= m_bufferOffset && m_position < m_bufferOffset + m_bufferLength) {
+         ULONG available = (ULONG)(m_bufferOffset + m_bufferLength - m_position);
+         ULONG chunk = (available < remaining) ? available : remaining;
+         memcpy(destination + totalRead, m_buffer + (m_position - m_bufferOffset), chunk);
+         totalRead += chunk;
+         m_position += chunk;
+         continue;
+      }
+
+      ULONG cbRead = 0;
+      if (remaining >= FILE_STREAM_BUFFER_SIZE) {
+         // Large reads go straight to the caller memory: no need to copy them twice
+         hr = ReadAt(m_position, destination + totalRead, remaining, &cbRead);
+         if (FAILED(hr))
+            break;
+         totalRead += cbRead;
+         m_position += cbRead;
+      }
+      else {
+         hr = FillBuffer(m_position);
+         if (FAILED(hr))
+            break;
+         // Is there anything at m_position?
+         cbRead = (m_bufferOffset + m_bufferLength > m_position) ? 1 : 0;
+      }
+
+      if (cbRead == 0)
+         // End of file
+         break;
+   }
+
+   if (pcbRead)
+      *pcbRead = totalRead;
+   return hr;
 }
 
 STDMETHODIMP SHFileStream::Write(
    /* [annotation] */
    _In_reads_bytes_(cb)  const void *pv,
-   /* [annotation][in] */
+   /* [annotation] */
    _In_  ULONG cb,
    /* [annotation] */
    _Out_opt_  ULONG *pcbWritten) { 
 
-   if (::WriteFile(m_hFile, pv, cb, pcbWritten, NULL))
+   if (!pv)
+      return STG_E_INVALIDPOINTER;
+
+   // What we have read ahead may be stale now
+   InvalidateBuffer();
+
+   OVERLAPPED overlapped;
+   ZeroMemory(&overlapped, sizeof(OVERLAPPED));
+   overlapped.Offset = (DWORD)m_position;
+   overlapped.OffsetHigh = (DWORD)(m_position >> 32);
+
+   DWORD cbWritten = 0;
+   BOOL result = ::WriteFile(m_hFile, pv, cb, &cbWritten, &overlapped);
+   m_position += cbWritten;
+   if (pcbWritten)
+      *pcbWritten = cbWritten;
+
+   if (result)
       return S_OK;
    else
       return HRESULT_FROM_WIN32(GetLastError());
@@ -102,65 +205,53 @@ STDMETHODIMP SHFileStream::Seek(
 
    // The origin can be the beginning of the file (STREAM_SEEK_SET), 
    // the current seek pointer (STREAM_SEEK_CUR), or the end of the file (STREAM_SEEK_END)
-   DWORD dwMoveMethod;
+   LONGLONG origin;
    if (dwOrigin == STREAM_SEEK_SET) {
-      dwMoveMethod = FILE_BEGIN;
+      origin = 0;
    }
    else if (dwOrigin == STREAM_SEEK_CUR) {
-      dwMoveMethod = FILE_CURRENT;
+      origin = (LONGLONG)m_position;
    }
    else if (dwOrigin == STREAM_SEEK_END) {
-      dwMoveMethod = FILE_END;
+      LARGE_INTEGER size;
+      if (!::GetFileSizeEx(m_hFile, &size))
+         return HRESULT_FROM_WIN32(GetLastError());
+      origin = size.QuadPart;
    }
    else {
-      return E_INVALIDARG;
+      return STG_E_INVALIDFUNCTION;
    }
 
-   LONG distanceToMoveHigh = 0;
-   PLONG lpDistanceToMoveHigh = NULL;
-   if (dlibMove.HighPart > 0) {
-      lpDistanceToMoveHigh = &distanceToMoveHigh;
-      distanceToMoveHigh = dlibMove.HighPart;
-   }
-   DWORD result = SetFilePointer(m_hFile, dlibMove.LowPart, lpDistanceToMoveHigh, dwMoveMethod);
-
-   if (result == INVALID_SET_FILE_POINTER && (GetLastError() != NO_ERROR))
-      return HRESULT_FROM_WIN32(GetLastError());
-   
+   LONGLONG newPosition = origin + dlibMove.QuadPart;
+   if (newPosition < 0)
+      return STG_E_INVALIDFUNCTION;
 
-   if (plibNewPosition != NULL) {
-      plibNewPosition->LowPart = result;
-      plibNewPosition->HighPart = distanceToMoveHigh;
-   }
+   // Just our position: the file pointer is never used
+   m_position = (ULONGLONG)newPosition;
+   if (plibNewPosition != NULL)
+      plibNewPosition->QuadPart = m_position;
 
    return S_OK;
 }
 
 STDMETHODIMP SHFileStream::SetSize(
    /* [in] */ ULARGE_INTEGER libNewSize) {
-   HRESULT hr = S_OK;
 
-   LONG currentPositionHigh = 0;
-   DWORD currentPositionLow = SetFilePointer(m_hFile, 0, &currentPositionHigh, FILE_CURRENT);
-
-   if (currentPositionLow == INVALID_SET_FILE_POINTER && (GetLastError() != NO_ERROR))
-      return HRESULT_FROM_WIN32(GetLastError());
+   if ((m_accessMode & GENERIC_WRITE) == 0)
+      return STG_E_ACCESSDENIED;
 
-   LONG positionHigh = libNewSize.HighPart;
-   DWORD positionLow = SetFilePointer(m_hFile, libNewSize.LowPart, &positionHigh, FILE_CURRENT);
+   InvalidateBuffer();
 
-   if (positionLow == INVALID_SET_FILE_POINTER && (GetLastError() != NO_ERROR))
+   // SetEndOfFile works on the file pointer; we do not use it for anything else
+   LARGE_INTEGER newSize;
+   newSize.QuadPart = (LONGLONG)libNewSize.QuadPart;
+   if (!::SetFilePointerEx(m_hFile, newSize, NULL, FILE_BEGIN))
       return HRESULT_FROM_WIN32(GetLastError());
-   
-   BOOL result = SetEndOfFile(m_hFile);
-   if (!result) {
-      hr = HRESULT_FROM_WIN32(GetLastError());
-   }
 
-   // Put the pointer back
-   SetFilePointer(m_hFile, currentPositionLow, &currentPositionHigh, FILE_CURRENT);
+   if (!::SetEndOfFile(m_hFile))
+      return HRESULT_FROM_WIN32(GetLastError());
 
-   return hr;
+   return S_OK;
 }
 
 STDMETHODIMP SHFileStream::CopyTo(
@@ -172,31 +263,43 @@ STDMETHODIMP SHFileStream::CopyTo(
    /* [annotation] */
    _Out_opt_  ULARGE_INTEGER *pcbWritten) {
 
-   char buffer[4096];
-   ULONGLONG bytesToWrite = cb.QuadPart;   
-   while (bytesToWrite > 0) {
-      DWORD cbRead = 0, cbWritten = 0;
-      if (!::ReadFile(m_hFile, buffer, sizeof(buffer), &cbRead, NULL))
-         return HRESULT_FROM_WIN32(GetLastError());
-
-      if (pcbRead)
-         pcbRead->QuadPart += cbRead;      
+   if (!pstm)
+      return STG_E_INVALIDPOINTER;
 
-      HRESULT hr = pstm->Write(buffer, cbRead, &cbWritten);
-      if (FAILED(hr))
-         return hr;
+   ULONGLONG totalRead = 0, totalWritten = 0;
+   ULONGLONG bytesToCopy = cb.QuadPart;
+   HRESULT hr = S_OK;
 
-      if (pcbWritten)
-         pcbWritten->QuadPart += cbWritten;
+   // Straight from the read-ahead buffer to the destination
+   while (bytesToCopy > 0) {
+      if (!(m_position >= m_bufferOffset && m_position < m_bufferOffset + m_bufferLength)) {
+         hr = FillBuffer(m_position);
+         if (FAILED(hr))
+            break;
+         if (m_bufferOffset + m_bufferLength <= m_position)
+            // End of file
+            break;
+      }
+
+      ULONG available = (ULONG)(m_bufferOffset + m_bufferLength - m_position);
+      ULONG chunk = (available < bytesToCopy) ? available : (ULONG)bytesToCopy;
+      ULONG cbWritten = 0;
+      hr = pstm->Write(m_buffer + (m_position - m_bufferOffset), chunk, &cbWritten);
+
+      totalRead += chunk;
+      totalWritten += cbWritten;
+      m_position += chunk;
+      bytesToCopy -= chunk;
 
-      if (cbRead < sizeof(buffer))
-         //not enough to read
+      if (FAILED(hr))
          break;
-
-      bytesToWrite -= cbRead;
    }
 
-   return S_OK;
+   if (pcbRead)
+      pcbRead->QuadPart = totalRead;
+   if (pcbWritten)
+      pcbWritten->QuadPart = totalWritten;
+   return hr;
 }
 
 STDMETHODIMP SHFileStream::Commit(
@@ -239,18 +342,28 @@ STDMETHODIMP SHFileStream::Stat(
    /* [out] */ __RPC__out STATSTG *pstatstg,
    /* [in] */ DWORD grfStatFlag) {
 
+   if (!pstatstg)
+      return STG_E_INVALIDPOINTER;
+
+   ZeroMemory(pstatstg, sizeof(STATSTG));
+
    if (!(grfStatFlag & STATFLAG_NONAME)) {
-      int len = lstrlenW(m_fileName);
-      pstatstg->pwcsName = (LPOLESTR)CoTaskMemAlloc(len);
-      lstrcpynW(pstatstg->pwcsName, m_fileName, len);
+      size_t cbName = (m_fileName.size() + 1) * sizeof(WCHAR);
+      pstatstg->pwcsName = (LPOLESTR)CoTaskMemAlloc(cbName);
+      if (!pstatstg->pwcsName)
+         return STG_E_INSUFFICIENTMEMORY;
+      memcpy(pstatstg->pwcsName, m_fileName.c_str(), cbName);
    }
 
    pstatstg->type = STGTY_STREAM;
-   pstatstg->cbSize.LowPart = GetFileSize(m_hFile, &(pstatstg->cbSize.HighPart));
+
+   LARGE_INTEGER size;
+   if (::GetFileSizeEx(m_hFile, &size))
+      pstatstg->cbSize.QuadPart = size.QuadPart;
    
    GetFileTime(m_hFile, &(pstatstg->ctime), &(pstatstg->atime), &(pstatstg->mtime));
 
-   pstatstg->grfMode = 0;
+   pstatstg->grfMode = (m_accessMode & GENERIC_WRITE) ? (STGM_READWRITE | STGM_SHARE_DENY_WRITE) : (STGM_READ | STGM_SHARE_DENY_WRITE);
    pstatstg->grfLocksSupported = LOCK_EXCLUSIVE;
 
    // Not used for IStream
@@ -265,19 +378,19 @@ STDMETHODIMP SHFileStream::Clone(
 
    if (!ppstm)
       return STG_E_INVALIDPOINTER;
+   *ppstm = NULL;
 
-   SHFileStream* other = new SHFileStream(m_fileName);
-
-   // Get the current position
-   LONG currentPositionHigh = 0;
-   DWORD currentPositionLow = SetFilePointer(m_hFile, 0, &currentPositionHigh, FILE_CURRENT);
-   // ... if we can
-   if (!(currentPositionLow == INVALID_SET_FILE_POINTER && (GetLastError() != NO_ERROR))) {
-      LARGE_INTEGER move;
-      move.LowPart = currentPositionLow;
-      move.HighPart = currentPositionHigh;
-      other->Seek(move, STREAM_SEEK_SET, NULL);
-   }
+   // Same file object, but a position (and a buffer) of its own
+   HANDLE hFile;
+   HANDLE hProcess = ::GetCurrentProcess();
+   if (!::DuplicateHandle(hProcess, m_hFile, hProcess, &hFile, 0, FALSE, DUPLICATE_SAME_ACCESS))
+      return HRESULT_FROM_WIN32(GetLastError());
+
+   SHFileStream* other = new SHFileStream(m_fileName.c_str());
+   other->m_hFile = hFile;
+   other->m_accessMode = m_accessMode;
+   other->m_position = m_position;
+   other->AddRef();
 
    *ppstm = other;
    return S_OK;
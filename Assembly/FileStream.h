@@ -11,15 +11,34 @@
 
 #include <ObjIdlbase.h>
 #include <windows.h>
+#include <string>
 
+// Read-ahead buffer size; a multiple of the page size, so refills start at aligned offsets
+const ULONG FILE_STREAM_BUFFER_SIZE = 64 * 1024;
+
+// An IStream over a file. Every stream tracks its own 64-bit position and reads at explicit
+// offsets (OVERLAPPED.Offset), never through the shared file pointer: clones are independent,
+// and can be used by different threads at the same time.
+// Small reads are served from a read-ahead buffer.
 class SHFileStream : public IStream {
 private:
    volatile LONG m_cRef;
    HANDLE m_hFile;
-   LPCWSTR m_fileName;
+   std::wstring m_fileName;
+   DWORD m_accessMode;
+   ULONGLONG m_position;
+
+   // Read-ahead: FILE_STREAM_BUFFER_SIZE bytes (page aligned), holding
+   // [m_bufferOffset, m_bufferOffset + m_bufferLength) of the file
+   BYTE* m_buffer;
+   ULONGLONG m_bufferOffset;
+   ULONG m_bufferLength;
 
 private:
    STDMETHODIMP Open(DWORD dwOpenMode);
+   HRESULT ReadAt(ULONGLONG offset, void* pv, ULONG cb, ULONG* pcbRead);
+   HRESULT FillBuffer(ULONGLONG offset);
+   void InvalidateBuffer() { m_bufferLength = 0; }
 
 public:
    SHFileStream(LPCWSTR fileName);
@@ -0,0 +1,225 @@
+
+#include "ImageStream.h"
+
+SHImageStream::SHImageStream(SHAssemblyImage* image) {
+   m_cRef = 0;
+   m_image = image;
+   m_image->AddRef();
+   m_position = 0;
+}
+
+SHImageStream::~SHImageStream() {
+   m_image->Release();
+}
+
+// IUnknown functions
+
+STDMETHODIMP_(DWORD) SHImageStream::AddRef() {
+   return InterlockedIncrement(&m_cRef);
+}
+
+STDMETHODIMP_(DWORD) SHImageStream::Release() {
+   ULONG cRef = InterlockedDecrement(&m_cRef);
+   if (cRef == 0) {
+      delete this;
+   }
+   return cRef;
+}
+
+STDMETHODIMP SHImageStream::QueryInterface(const IID &riid, void **ppvObject) {
+   if (!ppvObject)
+      return E_POINTER;
+
+   if (riid == IID_IUnknown || riid == IID_IStream || riid == IID_ISequentialStream) {
+      *ppvObject = this;
+      AddRef();
+      return S_OK;
+   }
+
+   *ppvObject = NULL;
+   return E_NOINTERFACE;
+}
+
+// ISequentialStream functions
+STDMETHODIMP SHImageStream::Read(
+   /* [annotation] */
+   _Out_writes_bytes_to_(cb, *pcbRead)  void *pv,
+   /* [annotation][in] */
+   _In_  ULONG cb,
+   /* [annotation] */
+   _Out_opt_  ULONG *pcbRead) {
+
+   if (!pv)
+      return STG_E_INVALIDPOINTER;
+
+   ULONG cbRead = 0;
+   ULONGLONG size = m_image->Size();
+   if (m_position < size) {
+      ULONGLONG available = size - m_position;
+      cbRead = (available < cb) ? (ULONG)available : cb;
+      memcpy(pv, m_image->Data() + m_position, cbRead);
+      m_position += cbRead;
+   }
+
+   if (pcbRead)
+      *pcbRead = cbRead;
+   return S_OK;
+}
+
+STDMETHODIMP SHImageStream::Write(
+   /* [annotation] */
+   _In_reads_bytes_(cb)  const void* /*pv*/,
+   /* [annotation][in] */
+   _In_  ULONG /*cb*/,
+   /* [annotation] */
+   _Out_opt_  ULONG *pcbWritten) {
+
+   if (pcbWritten)
+      *pcbWritten = 0;
+   return STG_E_ACCESSDENIED;
+}
+
+// IStream functions
+STDMETHODIMP SHImageStream::Seek(
+   /* [in] */ LARGE_INTEGER dlibMove,
+   /* [in] */ DWORD dwOrigin,
+   /* [annotation] */
+   _Out_opt_  ULARGE_INTEGER *plibNewPosition) {
+
+   LONGLONG origin;
+   if (dwOrigin == STREAM_SEEK_SET) {
+      origin = 0;
+   }
+   else if (dwOrigin == STREAM_SEEK_CUR) {
+      origin = (LONGLONG)m_position;
+   }
+   else if (dwOrigin == STREAM_SEEK_END) {
+      origin = (LONGLONG)m_image->Size();
+   }
+   else {
+      return STG_E_INVALIDFUNCTION;
+   }
+
+   LONGLONG newPosition = origin + dlibMove.QuadPart;
+   if (newPosition < 0)
+      return STG_E_INVALIDFUNCTION;
+
+   // Seeking past the end is allowed; reads there just return 0 bytes
+   m_position = (ULONGLONG)newPosition;
+   if (plibNewPosition != NULL)
+      plibNewPosition->QuadPart = m_position;
+
+   return S_OK;
+}
+
+STDMETHODIMP SHImageStream::SetSize(
+   /* [in] */ ULARGE_INTEGER /*libNewSize*/) {
+   return STG_E_ACCESSDENIED;
+}
+
+STDMETHODIMP SHImageStream::CopyTo(
+   /* [annotation][unique][in] */
+   _In_  IStream *pstm,
+   /* [in] */ ULARGE_INTEGER cb,
+   /* [annotation] */
+   _Out_opt_  ULARGE_INTEGER *pcbRead,
+   /* [annotation] */
+   _Out_opt_  ULARGE_INTEGER *pcbWritten) {
+
+   if (!pstm)
+      return STG_E_INVALIDPOINTER;
+
+   ULONGLONG totalRead = 0, totalWritten = 0;
+   ULONGLONG size = m_image->Size();
+   ULONGLONG bytesToCopy = (m_position < size) ? (size - m_position) : 0;
+   if (cb.QuadPart < bytesToCopy)
+      bytesToCopy = cb.QuadPart;
+
+   // Straight from the image to the destination: no intermediate buffer
+   HRESULT hr = S_OK;
+   while (bytesToCopy > 0) {
+      ULONG chunk = (bytesToCopy > MAXLONG) ? MAXLONG : (ULONG)bytesToCopy;
+      ULONG cbWritten = 0;
+      hr = pstm->Write(m_image->Data() + m_position, chunk, &cbWritten);
+
+      totalRead += chunk;
+      totalWritten += cbWritten;
+      m_position += chunk;
+      bytesToCopy -= chunk;
+
+      if (FAILED(hr))
+         break;
+   }
+
+   if (pcbRead)
+      pcbRead->QuadPart = totalRead;
+   if (pcbWritten)
+      pcbWritten->QuadPart = totalWritten;
+   return hr;
+}
+
+STDMETHODIMP SHImageStream::Commit(
+   /* [in] */ DWORD /*grfCommitFlags*/) {
+   // Nothing to commit: we are read-only
+   return S_OK;
+}
+
+STDMETHODIMP SHImageStream::Revert(void) {
+   return S_OK;
+}
+
+STDMETHODIMP SHImageStream::LockRegion(
+   /* [in] */ ULARGE_INTEGER /*libOffset*/,
+   /* [in] */ ULARGE_INTEGER /*cb*/,
+   /* [in] */ DWORD /*dwLockType*/) {
+   // The image never changes; there is nothing to lock
+   return STG_E_INVALIDFUNCTION;
+}
+
+STDMETHODIMP SHImageStream::UnlockRegion(
+   /* [in] */ ULARGE_INTEGER /*libOffset*/,
+   /* [in] */ ULARGE_INTEGER /*cb*/,
+   /* [in] */ DWORD /*dwLockType*/) {
+   return STG_E_INVALIDFUNCTION;
+}
+
+STDMETHODIMP SHImageStream::Stat(
+   /* [out] */ __RPC__out STATSTG *pstatstg,
+   /* [in] */ DWORD grfStatFlag) {
+
+   if (!pstatstg)
+      return STG_E_INVALIDPOINTER;
+
+   ZeroMemory(pstatstg, sizeof(STATSTG));
+
+   if (!(grfStatFlag & STATFLAG_NONAME)) {
+      const std::wstring& name = m_image->Name();
+      size_t cbName = (name.size() + 1) * sizeof(WCHAR);
+      pstatstg->pwcsName = (LPOLESTR)CoTaskMemAlloc(cbName);
+      if (!pstatstg->pwcsName)
+         return STG_E_INSUFFICIENTMEMORY;
+      memcpy(pstatstg->pwcsName, name.c_str(), cbName);
+   }
+
+   pstatstg->type = STGTY_STREAM;
+   pstatstg->cbSize.QuadPart = m_image->Size();
+   pstatstg->mtime = m_image->LastWriteTime();
+   pstatstg->grfMode = STGM_READ | STGM_SHARE_DENY_WRITE;
+   pstatstg->grfLocksSupported = 0;
+
+   return S_OK;
+}
+
+STDMETHODIMP SHImageStream::Clone(
+   /* [out] */ __RPC__deref_out_opt IStream **ppstm) {
+
+   if (!ppstm)
+      return STG_E_INVALIDPOINTER;
+
+   SHImageStream* other = new SHImageStream(m_image);
+   other->m_position = m_position;
+   other->AddRef();
+
+   *ppstm = other;
+   return S_OK;
+}
@@ -12,6 +12,12 @@ std::wstring CurrentDirectory() {
    return std::wstring(buffer);
 }
 
+int GetCpuCount() {
+   SYSTEM_INFO sysInfo;
+   ::GetSystemInfo(&sysInfo);
+   return sysInfo.dwNumberOfProcessors;
+}
+
 std::wstring toWstring(const std::string& s) {
    std::wstring ws(s.size(), L' ');
    size_t charsConverted = 0;
@@ -4,7 +4,7 @@
 #define WIN32_LEAN_AND_MEAN		// Exclude rarely-used stuff from Windows headers
 
 #ifndef _WIN32_WINNT
-#define _WIN32_WINNT _WIN32_WINNT_WINXP
+#define _WIN32_WINNT _WIN32_WINNT_VISTA // GetQueuedCompletionStatusEx
 #endif
 
 #define LOCK_TRACE 0xCAFEBABE
@@ -29,6 +29,7 @@ std::string toString(const std::wstring& s);
 bstr_t toBSTR(const std::string& s);
 
 std::wstring CurrentDirectory();
+int GetCpuCount();
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,131 @@
+#ifndef SH_FLAT_TABLE_H_INCLUDED
+#define SH_FLAT_TABLE_H_INCLUDED
+
+#include "Common.h"
+
+#include <vector>
+
+// AppDomain ids are handed out in sequence by the CLR: the id itself is the slot, so
+// the live domains (a window of recent ids, plus the default domain) sit next to each other
+struct DomainIdHash {
+   static ULONG Hash(DWORD key) { return key; }
+};
+
+// Windows thread ids are multiples of 4
+struct ThreadIdHash {
+   static ULONG Hash(DWORD key) { return key >> 2; }
+};
+
+// A flat hash table for DWORD keys (0 is not a valid key): one vector of slots, open
+// addressing with linear probing, and backward-shift deletion (no tombstones), so a
+// lookup is one or two cache lines instead of a walk down a red-black tree.
+// Each slot stores its full key, used as a tag: a stale id that lands on a slot now
+// used by another domain (or thread) never matches.
+// Pointers returned by Find and Insert are valid until the next Insert or Erase.
+// Not thread safe: callers hold their own lock.
+template <typename Value, typename Hasher>
+class FlatTable {
+private:
+   struct Slot {
+      DWORD key;
+      Value value;
+   };
+
+   std::vector<Slot> slots;
+   ULONG mask;
+   ULONG count;
+
+   static const ULONG INITIAL_SIZE = 64;
+
+   ULONG Home(DWORD key) const { return Hasher::Hash(key) & mask; }
+
+   void Grow() {
+      std::vector<Slot> old;
+      old.swap(slots);
+      slots.resize(old.size() * 2);
+      mask = (ULONG)slots.size() - 1;
+      for (auto it = old.begin(); it != old.end(); ++it) {
+         if (it->key == 0)
+            continue;
+         ULONG i = Home(it->key);
+         while (slots[i].key != 0)
+            i = (i + 1) & mask;
+         slots[i] = *it;
+      }
+   }
+
+public:
+   FlatTable() {
+      slots.resize(INITIAL_SIZE);
+      mask = INITIAL_SIZE - 1;
+      count = 0;
+   }
+
+   Value* Find(DWORD key) {
+      for (ULONG i = Home(key); slots[i].key != 0; i = (i + 1) & mask) {
+         if (slots[i].key == key)
+            return &slots[i].value;
+      }
+      return NULL;
+   }
+
+   // Like std::map::insert: if the key is already there, its value is left untouched
+   Value* Insert(DWORD key, const Value& value) {
+      Value* existing = Find(key);
+      if (existing)
+         return existing;
+
+      // Keep the load under 1/2: probe sequences stay short
+      if ((count + 1) * 2 > slots.size())
+         Grow();
+
+      ULONG i = Home(key);
+      while (slots[i].key != 0)
+         i = (i + 1) & mask;
+      slots[i].key = key;
+      slots[i].value = value;
+      ++count;
+      return &slots[i].value;
+   }
+
+   bool Erase(DWORD key) {
+      ULONG i = Home(key);
+      while (slots[i].key != key) {
+         if (slots[i].key == 0)
+            return false;
+         i = (i + 1) & mask;
+      }
+
+      // Move back the entries of the same probe run that would not be found anymore
+      ULONG j = i;
+      for (;;) {
+         j = (j + 1) & mask;
+         if (slots[j].key == 0)
+            break;
+         ULONG home = Home(slots[j].key);
+         // Stays where it is if its home is cyclically in (i, j]
+         bool inRange = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+         if (inRange)
+            continue;
+         slots[i] = slots[j];
+         i = j;
+      }
+      slots[i].key = 0;
+      slots[i].value = Value();
+      --count;
+      return true;
+   }
+
+   ULONG Size() const { return count; }
+
+   // Calls function(key, value) for each entry; the table must not change meanwhile
+   template <typename Function>
+   void ForEach(Function function) {
+      for (auto it = slots.begin(); it != slots.end(); ++it) {
+         if (it->key != 0)
+            function(it->key, it->value);
+      }
+   }
+};
+
+#endif //SH_FLAT_TABLE_H_INCLUDED
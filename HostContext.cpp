@@ -4,6 +4,11 @@
 #include "Threading\Task.h"
 #include "Threading\TaskMgr.h"
 #include "Threading\SyncMgr.h"
+#include "Threading\TimerWheel.h"
+#include "Threading\ThreadpoolMgr.h"
+#include "Threading\TaskMgr.h"
+#include "Assembly\AssemblyStore.h"
+#include "Memory\GCMgr.h"
 
 #include "CrstLock.h"
 #include "Logger.h"
@@ -13,8 +18,113 @@
 
 static LPCWSTR HostSignalEventName = L"31FDFE09-22AA-42B7-AF72-048734C5C394";
 
+// HostWait and Sleep are static (the synchronization primitives have no context), and
+// they are the hottest path of the host: they must not take domainMapCrst. Each thread
+// adds its waits to its own slot, lock-free; HostContext claims the slot when the thread
+// enters a domain, and folds it into the domain (under domainMapCrst) when it reads a
+// snapshot or the thread leaves. The table is static and never freed, so a late WaitEnd
+// cannot touch a destroyed HostContext
+struct ThreadWaitSlot {
+   volatile LONG threadId; // 0: free
+   volatile LONGLONG waitTime; // microseconds
+};
+
+static const int WAIT_SLOTS = 1024; // Power of 2
+static const int WAIT_SLOT_PROBES = 8;
+static ThreadWaitSlot waitSlots[WAIT_SLOTS];
+static LONGLONG waitTicksPerSecond = 0;
+
+static ThreadWaitSlot* FindWaitSlot(DWORD threadId) {
+   // Thread ids are multiples of 4
+   int start = (int)(threadId >> 2);
+   for (int i = 0; i < WAIT_SLOT_PROBES; ++i) {
+      ThreadWaitSlot* slot = &waitSlots[(start + i) & (WAIT_SLOTS - 1)];
+      if (slot->threadId == (LONG)threadId)
+         return slot;
+   }
+   return NULL;
+}
+
+// With domainMapCrst held (claims and releases are serialized by it).
+// If the probe window is full, the waits of the thread are not accounted
+static void ClaimWaitSlot(DWORD threadId) {
+   if (FindWaitSlot(threadId) != NULL)
+      return;
+
+   int start = (int)(threadId >> 2);
+   for (int i = 0; i < WAIT_SLOT_PROBES; ++i) {
+      ThreadWaitSlot* slot = &waitSlots[(start + i) & (WAIT_SLOTS - 1)];
+      if (slot->threadId == 0) {
+         InterlockedExchange64(&slot->waitTime, 0);
+         InterlockedExchange(&slot->threadId, (LONG)threadId);
+         return;
+      }
+   }
+   Logger::Debug("No wait slot for thread %d: its waits are not accounted", threadId);
+}
+
+// With domainMapCrst held. Returns the wait time of the thread
+static LONGLONG ReleaseWaitSlot(DWORD threadId) {
+   ThreadWaitSlot* slot = FindWaitSlot(threadId);
+   if (slot == NULL)
+      return 0;
+   LONGLONG waitTime = InterlockedExchange64(&slot->waitTime, 0);
+   InterlockedExchange(&slot->threadId, 0);
+   return waitTime;
+}
+
+static LONGLONG ReadWaitSlot(DWORD threadId) {
+   ThreadWaitSlot* slot = FindWaitSlot(threadId);
+   if (slot == NULL)
+      return 0;
+   return InterlockedCompareExchange64(&slot->waitTime, 0, 0);
+}
+
+static LONGLONG WaitStart() {
+   LARGE_INTEGER now;
+   QueryPerformanceCounter(&now);
+   return now.QuadPart;
+}
+
+static void WaitEnd(LONGLONG start) {
+   if (waitTicksPerSecond == 0)
+      return;
+   ThreadWaitSlot* slot = FindWaitSlot(GetCurrentThreadId());
+   if (slot == NULL)
+      return;
+   LARGE_INTEGER now;
+   QueryPerformanceCounter(&now);
+   InterlockedExchangeAdd64(&slot->waitTime, (now.QuadPart - start) * 1000000 / waitTicksPerSecond);
+}
+
+static LONGLONG FileTimeToMicroseconds(const FILETIME& fileTime) {
+   ULARGE_INTEGER value;
+   value.LowPart = fileTime.dwLowDateTime;
+   value.HighPart = fileTime.dwHighDateTime;
+   return (LONGLONG)(value.QuadPart / 10);
+}
+
+// User + kernel time of the thread (microseconds), or 0 if we cannot open it
+static LONGLONG GetThreadCpuTime(DWORD threadId) {
+   HANDLE hThread = OpenThread(THREAD_QUERY_INFORMATION, FALSE, threadId);
+   if (hThread == NULL)
+      return 0;
+
+   LONGLONG cpuTime = 0;
+   FILETIME creationTime, exitTime, kernelTime, userTime;
+   if (GetThreadTimes(hThread, &creationTime, &exitTime, &kernelTime, &userTime))
+      cpuTime = FileTimeToMicroseconds(kernelTime) + FileTimeToMicroseconds(userTime);
+   CloseHandle(hThread);
+   return cpuTime;
+}
+
 HostContext::HostContext(ICLRRuntimeHost* runtimeHost) {
    this->runtimeHost = runtimeHost;
+   assemblyStore = NULL;
+   gcManager = NULL;
+   taskManager = NULL;
+   domainNeutralLoading = false;
+   accountWaits = (runtimeHost != NULL);
 
    m_cRef = 0;
 
@@ -23,30 +133,38 @@ HostContext::HostContext(ICLRRuntimeHost* runtimeHost) {
 
    numZombieDomains = 0;
 
-   // Create the event for sinchronization of our "message queue" with the 
-   // managed part
-   hMessageEvent = ::CreateEvent(NULL, TRUE, FALSE, NULL);
-   if (hMessageEvent == NULL)
-      Logger::Critical("CreateEvent error: %d", GetLastError());
+   reportedDroppedMessages = 0;
 
    domainMapCrst = new CRITICAL_SECTION;
    if (!domainMapCrst)
       Logger::Critical("Failed to allocate critical sections");
    InitializeCriticalSection(domainMapCrst);
 
-   messageQueueCrst = new CRITICAL_SECTION;
-   if (!messageQueueCrst)
-      Logger::Critical("Failed to allocate critical sections");
-   InitializeCriticalSection(messageQueueCrst);
+   InitializeConditionVariable(&snippetAbortsDone);
+   snippetDeadlines = new TimerWheel(OnSnippetDeadline, this);
+   snippetDeadlines->Start();
+
+   // The one that hosts the CLR (not the ones created for benchmarks)
+   if (runtimeHost != NULL) {
+      LARGE_INTEGER frequency;
+      QueryPerformanceFrequency(&frequency);
+      waitTicksPerSecond = frequency.QuadPart;
+   }
 }
 
 HostContext::~HostContext() {
+   // Stops the timer thread first: it calls back into us, and starts the enforcers
+   delete snippetDeadlines;
+   for (size_t i = 0; i < snippetEnforcers.size(); ++i) {
+      WaitForSingleObject(snippetEnforcers[i], INFINITE);
+      CloseHandle(snippetEnforcers[i]);
+   }
+   if (assemblyStore)
+      assemblyStore->Release();
+   if (gcManager)
+      gcManager->Release();
    if (domainMapCrst) 
       DeleteCriticalSection(domainMapCrst);
-   if (messageQueueCrst)
-      DeleteCriticalSection(messageQueueCrst);
-   if (hMessageEvent)
-      CloseHandle(hMessageEvent);
 }
 
 // IUnknown functions
@@ -81,14 +199,14 @@ STDMETHODIMP HostContext::raw_GetThreadCount(
    if (pRetVal == NULL)
       return E_INVALIDARG;
 
-   CrstLock(this->domainMapCrst);
+   CrstLock lock(this->domainMapCrst);
    
-   auto appDomainInfo = appDomains.find(appDomainId);
-   if (appDomainInfo == appDomains.end()) {
+   AppDomainInfo* appDomainInfo = appDomains.Find(appDomainId);
+   if (appDomainInfo == NULL) {
       Logger::Error("Cannot find AppDomain %d!", appDomainId);
       return S_FALSE;
    }
-   *pRetVal = appDomainInfo->second.threadsInAppDomain;
+   *pRetVal = appDomainInfo->threadsInAppDomain;
    return S_OK;
 }
 
@@ -99,14 +217,325 @@ STDMETHODIMP HostContext::raw_GetMemoryUsage(
    if (pRetVal == NULL)
       return E_INVALIDARG;
 
-   CrstLock(this->domainMapCrst);
+   CrstLock lock(this->domainMapCrst);
+
+   AppDomainInfo* appDomainInfo = appDomains.Find(appDomainId);
+   if (appDomainInfo == NULL) {
+      Logger::Error("Cannot find AppDomain %d!", appDomainId);
+      return S_FALSE;
+   }
+   *pRetVal = appDomainInfo->bytesInAppDomain;
+   return S_OK;
+}
+
+STDMETHODIMP HostContext::raw_GetIoBytes(
+   /*[in]*/ long appDomainId,
+   /*[out,retval]*/ __int64 * pRetVal) {
+   Logger::Debug("In HostContext::GetIoBytes %d", appDomainId);
+   if (pRetVal == NULL)
+      return E_INVALIDARG;
+
+   CrstLock lock(this->domainMapCrst);
+
+   AppDomainInfo* appDomainInfo = appDomains.Find(appDomainId);
+   if (appDomainInfo == NULL) {
+      Logger::Error("Cannot find AppDomain %d!", appDomainId);
+      return S_FALSE;
+   }
+   *pRetVal = appDomainInfo->ioBytes;
+   return S_OK;
+}
+
+STDMETHODIMP HostContext::raw_GetIoOperations(
+   /*[in]*/ long appDomainId,
+   /*[out,retval]*/ long * pRetVal) {
+   Logger::Debug("In HostContext::GetIoOperations %d", appDomainId);
+   if (pRetVal == NULL)
+      return E_INVALIDARG;
+
+   CrstLock lock(this->domainMapCrst);
 
-   auto appDomainInfo = appDomains.find(appDomainId);
-   if (appDomainInfo == appDomains.end()) {
+   AppDomainInfo* appDomainInfo = appDomains.Find(appDomainId);
+   if (appDomainInfo == NULL) {
       Logger::Error("Cannot find AppDomain %d!", appDomainId);
       return S_FALSE;
    }
-   *pRetVal = appDomainInfo->second.bytesInAppDomain;
+   *pRetVal = appDomainInfo->ioOperations;
+   return S_OK;
+}
+
+void HostContext::QueryThreadsCpuTime(DWORD appDomainId, std::vector<ThreadCpuTime>& threads) {
+   {
+      CrstLock lock(this->domainMapCrst);
+      threadAppDomain.ForEach([appDomainId, &threads](DWORD threadId, DWORD threadAppDomainId) {
+         if (appDomainId == 0 || threadAppDomainId == appDomainId) {
+            ThreadCpuTime thread = { threadId, threadAppDomainId, 0 };
+            threads.push_back(thread);
+         }
+      });
+   }
+
+   for (auto thread = threads.begin(); thread != threads.end(); ++thread)
+      thread->cpuTime = GetThreadCpuTime(thread->threadId);
+}
+
+void HostContext::AddLiveThreadsTimes(const std::vector<ThreadCpuTime>& threads, FlatTable<DomainThreadTimes, DomainIdHash>& times) {
+   for (auto thread = threads.begin(); thread != threads.end(); ++thread) {
+      DWORD* appDomainId = threadAppDomain.Find(thread->threadId);
+      if (appDomainId == NULL || *appDomainId != thread->appDomainId)
+         continue;
+      DomainThreadTimes* domainTimes = times.Insert(thread->appDomainId, DomainThreadTimes());
+      domainTimes->cpuTime += thread->cpuTime;
+      domainTimes->waitTime += ReadWaitSlot(thread->threadId);
+   }
+}
+
+void HostContext::FillDomainSnapshot(DWORD appDomainId, const AppDomainInfo& appDomainInfo, const DomainThreadTimes* liveThreadsTimes, DomainSnapshot* snapshot) {
+   DomainThreadTimes liveTimes;
+   if (liveThreadsTimes != NULL)
+      liveTimes = *liveThreadsTimes;
+
+   snapshot->appDomainId = appDomainId;
+   snapshot->threads = appDomainInfo.threadsInAppDomain;
+   snapshot->bytes = appDomainInfo.bytesInAppDomain;
+   snapshot->peakBytes = appDomainInfo.peakBytesInAppDomain;
+   snapshot->allocs = appDomainInfo.allocsInAppDomain;
+   snapshot->workItemsPending = appDomainInfo.workItemsPending;
+   snapshot->ioBytes = appDomainInfo.ioBytes;
+   snapshot->ioOperations = appDomainInfo.ioOperations;
+   snapshot->cpuTime = liveTimes.cpuTime + appDomainInfo.cpuTimeExitedThreads - appDomainInfo.cpuTimeBase;
+   if (snapshot->cpuTime < 0)
+      snapshot->cpuTime = 0; // A thread that had used CPU at the reset has left
+   snapshot->waitTime = liveTimes.waitTime + appDomainInfo.waitTimeExitedThreads - appDomainInfo.waitTimeBase;
+   if (snapshot->waitTime < 0)
+      snapshot->waitTime = 0;
+   snapshot->peakThreads = appDomainInfo.peakThreadsInAppDomain;
+   snapshot->allocationRate = appDomainInfo.allocationRate.BytesPerSecond(GetTickCount64());
+   snapshot->totalBytes = appDomainInfo.totalBytesAllocated;
+   snapshot->totalAllocs = appDomainInfo.totalAllocs;
+   snapshot->liveBytes = appDomainInfo.liveBytes;
+   snapshot->reservedBytes = appDomainInfo.reservedBytes;
+   snapshot->gcTime = appDomainInfo.gcTime;
+}
+
+STDMETHODIMP HostContext::raw_GetDomainSnapshot(
+   /*[in]*/ long appDomainId,
+   /*[out]*/ DomainSnapshot * snapshot,
+   /*[out,retval]*/ VARIANT_BOOL * pRetVal) {
+   if (snapshot == NULL || pRetVal == NULL)
+      return E_INVALIDARG;
+
+   std::vector<ThreadCpuTime> threads;
+   QueryThreadsCpuTime(appDomainId, threads);
+
+   CrstLock lock(this->domainMapCrst);
+
+   AppDomainInfo* appDomainInfo = appDomains.Find(appDomainId);
+   if (appDomainInfo == NULL) {
+      ZeroMemory(snapshot, sizeof(DomainSnapshot));
+      *pRetVal = VARIANT_FALSE;
+      return S_OK;
+   }
+   FlatTable<DomainThreadTimes, DomainIdHash> times;
+   AddLiveThreadsTimes(threads, times);
+   FillDomainSnapshot(appDomainId, *appDomainInfo, times.Find(appDomainId), snapshot);
+   *pRetVal = VARIANT_TRUE;
+   return S_OK;
+}
+
+STDMETHODIMP HostContext::raw_GetDomainSnapshots(
+   /*[in]*/ long maxDomains,
+   /*[in,out]*/ DomainSnapshot * snapshots,
+   /*[out]*/ long * numberOfZombies,
+   /*[out,retval]*/ long * pRetVal) {
+   if (snapshots == NULL || numberOfZombies == NULL || pRetVal == NULL)
+      return E_INVALIDARG;
+
+   // One pass on the threads for the CPU time of every domain
+   std::vector<ThreadCpuTime> threads;
+   QueryThreadsCpuTime(0, threads);
+
+   CrstLock lock(this->domainMapCrst);
+
+   FlatTable<DomainThreadTimes, DomainIdHash> times;
+   AddLiveThreadsTimes(threads, times);
+
+   long domainCount = 0;
+   DWORD defaultId = defaultDomainId;
+   appDomains.ForEach([&](DWORD appDomainId, const AppDomainInfo& appDomainInfo) {
+      if (appDomainId == defaultId || domainCount >= maxDomains)
+         return;
+      FillDomainSnapshot(appDomainId, appDomainInfo, times.Find(appDomainId), &snapshots[domainCount]);
+      ++domainCount;
+   });
+
+   *numberOfZombies = numZombieDomains;
+   *pRetVal = domainCount;
+   return S_OK;
+}
+
+STDMETHODIMP HostContext::raw_RegisterAssembly(
+   /*[in]*/ SAFEARRAY * assemblyImage,
+   /*[out,retval]*/ BSTR * pRetVal) {
+   Logger::Debug("In HostContext::RegisterAssembly");
+   if (assemblyImage == NULL || pRetVal == NULL)
+      return E_INVALIDARG;
+   if (assemblyStore == NULL)
+      return E_NOTIMPL;
+
+   BYTE* data;
+   HRESULT hr = SafeArrayAccessData(assemblyImage, (void**)&data);
+   if (FAILED(hr))
+      return hr;
+
+   std::wstring fullName;
+   hr = assemblyStore->RegisterAssembly(data, assemblyImage->rgsabound[0].cElements, fullName);
+   SafeArrayUnaccessData(assemblyImage);
+   if (FAILED(hr))
+      return hr;
+
+   *pRetVal = SysAllocString(fullName.c_str());
+   return (*pRetVal == NULL) ? E_OUTOFMEMORY : S_OK;
+}
+
+STDMETHODIMP HostContext::raw_IsAssemblyRegistered(
+   /*[in]*/ BSTR fullName,
+   /*[out,retval]*/ VARIANT_BOOL * pRetVal) {
+   if (fullName == NULL || pRetVal == NULL)
+      return E_INVALIDARG;
+
+   *pRetVal = (assemblyStore && assemblyStore->IsAssemblyRegistered(fullName)) ? VARIANT_TRUE : VARIANT_FALSE;
+   return S_OK;
+}
+
+STDMETHODIMP HostContext::raw_GetBindCount(
+   /*[in]*/ long appDomainId,
+   /*[out,retval]*/ long * pRetVal) {
+   if (pRetVal == NULL)
+      return E_INVALIDARG;
+   if (assemblyStore == NULL)
+      return E_NOTIMPL;
+
+   BindStatistics statistics;
+   assemblyStore->GetBindStatistics(appDomainId, &statistics);
+   *pRetVal = statistics.binds;
+   return S_OK;
+}
+
+// In microseconds
+STDMETHODIMP HostContext::raw_GetBindTime(
+   /*[in]*/ long appDomainId,
+   /*[out,retval]*/ __int64 * pRetVal) {
+   if (pRetVal == NULL)
+      return E_INVALIDARG;
+   if (assemblyStore == NULL)
+      return E_NOTIMPL;
+
+   BindStatistics statistics;
+   assemblyStore->GetBindStatistics(appDomainId, &statistics);
+   *pRetVal = statistics.microseconds;
+   return S_OK;
+}
+
+STDMETHODIMP HostContext::raw_GetBindLatencyHistogram(
+   /*[out,retval]*/ SAFEARRAY ** pRetVal) {
+   if (pRetVal == NULL)
+      return E_INVALIDARG;
+   if (assemblyStore == NULL)
+      return E_NOTIMPL;
+
+   *pRetVal = SafeArrayCreateVector(VT_I4, 0, BIND_HISTOGRAM_BUCKETS);
+   if (*pRetVal == NULL)
+      return E_OUTOFMEMORY;
+
+   LONG* buckets;
+   HRESULT hr = SafeArrayAccessData(*pRetVal, (void**)&buckets);
+   if (FAILED(hr)) {
+      SafeArrayDestroy(*pRetVal);
+      *pRetVal = NULL;
+      return hr;
+   }
+   assemblyStore->GetBindHistogram(buckets);
+   SafeArrayUnaccessData(*pRetVal);
+   return S_OK;
+}
+
+STDMETHODIMP HostContext::raw_GetGCCount(
+   /*[in]*/ long generation,
+   /*[out,retval]*/ long * pRetVal) {
+   if (pRetVal == NULL)
+      return E_INVALIDARG;
+   if (gcManager == NULL)
+      return E_NOTIMPL;
+
+   *pRetVal = gcManager->GetPauseCount(generation);
+   return S_OK;
+}
+
+// In microseconds
+STDMETHODIMP HostContext::raw_GetGCPauseTime(
+   /*[in]*/ long generation,
+   /*[out,retval]*/ __int64 * pRetVal) {
+   if (pRetVal == NULL)
+      return E_INVALIDARG;
+   if (gcManager == NULL)
+      return E_NOTIMPL;
+
+   *pRetVal = gcManager->GetPauseTime(generation);
+   return S_OK;
+}
+
+STDMETHODIMP HostContext::raw_GetGCPauseHistogram(
+   /*[in]*/ long generation,
+   /*[out,retval]*/ SAFEARRAY ** pRetVal) {
+   if (pRetVal == NULL)
+      return E_INVALIDARG;
+   if (gcManager == NULL)
+      return E_NOTIMPL;
+
+   *pRetVal = SafeArrayCreateVector(VT_I4, 0, GC_PAUSE_HISTOGRAM_BUCKETS);
+   if (*pRetVal == NULL)
+      return E_OUTOFMEMORY;
+
+   LONG* buckets;
+   HRESULT hr = SafeArrayAccessData(*pRetVal, (void**)&buckets);
+   if (FAILED(hr)) {
+      SafeArrayDestroy(*pRetVal);
+      *pRetVal = NULL;
+      return hr;
+   }
+   gcManager->GetPauseHistogram(generation, buckets);
+   SafeArrayUnaccessData(*pRetVal);
+   return S_OK;
+}
+
+STDMETHODIMP HostContext::raw_GetRecentGCPauses(
+   /*[in]*/ long maxPauses,
+   /*[in,out]*/ GCPause * pauses,
+   /*[out,retval]*/ long * pRetVal) {
+   if (pauses == NULL || pRetVal == NULL)
+      return E_INVALIDARG;
+   if (gcManager == NULL)
+      return E_NOTIMPL;
+
+   GCPauseInfo recentPauses[GC_RECENT_PAUSES];
+   int count = gcManager->GetRecentPauses(recentPauses, min(maxPauses, GC_RECENT_PAUSES));
+   for (int i = 0; i < count; ++i) {
+      pauses[i].timestamp = recentPauses[i].timestamp;
+      pauses[i].duration = recentPauses[i].duration;
+      pauses[i].generation = recentPauses[i].generation;
+      pauses[i].blockingThreads = recentPauses[i].blockingThreads;
+   }
+   *pRetVal = count;
+   return S_OK;
+}
+
+STDMETHODIMP HostContext::raw_IsDomainNeutralLoading(
+   /*[out,retval]*/ VARIANT_BOOL * pRetVal) {
+   if (pRetVal == NULL)
+      return E_INVALIDARG;
+
+   *pRetVal = domainNeutralLoading ? VARIANT_TRUE : VARIANT_FALSE;
    return S_OK;
 }
 
@@ -123,15 +552,33 @@ STDMETHODIMP HostContext::raw_GetNumberOfZombies(
 STDMETHODIMP HostContext::raw_ResetCountersForAppDomain(/*[in]*/long appDomainId) {
    Logger::Debug("In HostContext::raw_ResetCountersForAppDomain");
 
-   CrstLock(this->domainMapCrst);
-   auto appDomainInfo = appDomains.find(appDomainId);
-   if (appDomainInfo == appDomains.end()) {
+   std::vector<ThreadCpuTime> threads;
+   QueryThreadsCpuTime(appDomainId, threads);
+
+   CrstLock lock(this->domainMapCrst);
+   AppDomainInfo* appDomainInfo = appDomains.Find(appDomainId);
+   if (appDomainInfo == NULL) {
       Logger::Error("Cannot find AppDomain %d!", appDomainId);      
    }
    else {
-      appDomainInfo->second.bytesInAppDomain = 0;
-      appDomainInfo->second.threadsInAppDomain = 1;
+      FlatTable<DomainThreadTimes, DomainIdHash> times;
+      AddLiveThreadsTimes(threads, times);
+      DomainThreadTimes* liveTimes = times.Find(appDomainId);
+      appDomainInfo->bytesInAppDomain = 0;
+      appDomainInfo->peakBytesInAppDomain = 0;
+      appDomainInfo->threadsInAppDomain = 1;
+      appDomainInfo->peakThreadsInAppDomain = 1;
+      appDomainInfo->ioBytes = 0;
+      appDomainInfo->ioOperations = 0;
+      // The main thread is reused: count only what it does from now on
+      appDomainInfo->cpuTimeBase = liveTimes ? liveTimes->cpuTime : 0;
+      appDomainInfo->cpuTimeExitedThreads = 0;
+      appDomainInfo->waitTimeBase = liveTimes ? liveTimes->waitTime : 0;
+      appDomainInfo->waitTimeExitedThreads = 0;
+      appDomainInfo->gcTime = 0;
    }
+   if (assemblyStore)
+      assemblyStore->ResetBindStatistics(appDomainId);
    return S_OK;
 }
 
@@ -154,29 +601,258 @@ STDMETHODIMP HostContext::raw_GetLastMessage(/*[in]*/ long dwMilliseconds,
                                              /*[out]*/ HostEvent* hostEvent,  
                                              /*[out,retval]*/ VARIANT_BOOL* eventPresent) {
 
-   // TODO: alertable wait? Will it work with Thread.Interrupt?
-   // It should..
-   DWORD dwResult = WaitForSingleObject(hMessageEvent, dwMilliseconds);
+   if (hostEvent == NULL || eventPresent == NULL)
+      return E_INVALIDARG;
 
-   if (dwResult == WAIT_OBJECT_0) {
-      CrstLock(this->messageQueueCrst);
+   int eventCount;
+   HRESULT hr = GetHostMessages(dwMilliseconds, hostEvent, 1, &eventCount);
+   if (FAILED(hr))
+      return hr;
 
-      *hostEvent = messageQueue.back();
-      messageQueue.pop_back();
+   *eventPresent = (eventCount > 0) ? VARIANT_TRUE : VARIANT_FALSE;
+   return S_OK;
+}
 
-      if (messageQueue.empty())
-         ResetEvent(hMessageEvent);
+STDMETHODIMP HostContext::raw_GetMessages(
+   /*[in]*/ long millisecondsTimeout,
+   /*[in]*/ long maxEvents,
+   /*[in,out]*/ HostEvent * hostEvents,
+   /*[out,retval]*/ long * pRetVal) {
 
-      *eventPresent = VARIANT_TRUE;
-      return S_OK;
+   if (pRetVal == NULL || (hostEvents == NULL && maxEvents > 0))
+      return E_INVALIDARG;
+
+   int eventCount;
+   HRESULT hr = GetHostMessages(millisecondsTimeout, hostEvents, maxEvents, &eventCount);
+   if (FAILED(hr))
+      return hr;
+
+   *pRetVal = eventCount;
+   return S_OK;
+}
+
+STDMETHODIMP HostContext::raw_CloseMessages() {
+   messageQueue.Close();
+   return S_OK;
+}
+
+STDMETHODIMP HostContext::raw_SnippetStarted(
+   /*[in]*/ long appDomainId,
+   /*[in]*/ long timeoutMilliseconds) {
+
+   if (timeoutMilliseconds <= 0)
+      return E_INVALIDARG;
+
+   CrstLock lock(this->domainMapCrst);
+   AppDomainInfo* appDomainInfo = appDomains.Find(appDomainId);
+   if (appDomainInfo == NULL) {
+      Logger::Error("Cannot find AppDomain %d!", appDomainId);
+      return S_FALSE;
    }
-   else if (dwResult == WAIT_TIMEOUT) {
-      *eventPresent = VARIANT_FALSE;
+   appDomainInfo->snippetTimeoutAction = SnippetTimeoutAction_None;
+   appDomainInfo->snippetRunning = true;
+   ++appDomainInfo->snippetRun;
+
+   // Enforced by the timer thread: see OnSnippetDeadline.
+   // Armed under the lock, so that a late expiry of the previous run cannot re-arm
+   // the timer (with its grace period) over this one
+   snippetDeadlines->Arm(appDomainId, timeoutMilliseconds, appDomainInfo->snippetRun);
+   return S_OK;
+}
+
+STDMETHODIMP HostContext::raw_SnippetEnded(
+   /*[in]*/ long appDomainId,
+   /*[out,retval]*/ long * pRetVal) {
+
+   if (pRetVal == NULL)
+      return E_INVALIDARG;
+
+   CrstLock lock(this->domainMapCrst);
+   snippetDeadlines->Cancel(appDomainId);
+
+   AppDomainInfo* appDomainInfo = appDomains.Find(appDomainId);
+   if (appDomainInfo == NULL) {
+      // Unloaded under our feet: we did it, or someone else did
+      *pRetVal = SnippetTimeoutAction_Unload;
       return S_OK;
    }
+   // An expiry already taken off the wheel will find the snippet not running, and do nothing
+   appDomainInfo->snippetRunning = false;
+
+   // An expiry that got here first has decided to abort this thread: wait until the abort has
+   // been requested, so that it is delivered when we return to the (default domain) caller,
+   // which expects it (SnippetTimeoutAction_Abort), and not at some later point of its loop
+   while (appDomainInfo->snippetAbortInProgress) {
+      SleepConditionVariableCS(&snippetAbortsDone, domainMapCrst, INFINITE);
+      appDomainInfo = appDomains.Find(appDomainId);
+      if (appDomainInfo == NULL) {
+         *pRetVal = SnippetTimeoutAction_Unload;
+         return S_OK;
+      }
+   }
+   *pRetVal = appDomainInfo->snippetTimeoutAction;
+   appDomainInfo->snippetTimeoutAction = SnippetTimeoutAction_None;
+   return S_OK;
+}
+
+// Called on the timer thread: enforcement does not depend on any managed thread being
+// scheduled, or on the managed side being healthy. The first expiry aborts the thread
+// running the snippet (ICLRTask::Abort); if the snippet is still running after the
+// grace period, we unload its AppDomain.
+// The wheel calls us outside its lock, so the expiry may be stale: the snippet has ended
+// (the domain is idle), or another run has started. Both are ignored.
+// A safe abort can block for up to THREAD_ABORT_TIMEOUT, and there is one timer thread for
+// all the domains: the abort (or unload) runs on a thread of its own, and we only decide.
+void HostContext::OnSnippetDeadline(DWORD appDomainId, LONG snippetRun, LPVOID context) {
+   HostContext* me = (HostContext*)context;
+
+   SnippetEnforcement* enforcement = new SnippetEnforcement();
+   enforcement->hostContext = me;
+   enforcement->appDomainId = appDomainId;
+   enforcement->snippetRun = snippetRun;
+
+   CrstLock lock(me->domainMapCrst);
+   AppDomainInfo* appDomainInfo = me->appDomains.Find(appDomainId);
+   if (appDomainInfo == NULL || !appDomainInfo->snippetRunning || appDomainInfo->snippetRun != snippetRun) {
+      // Already gone, or stale
+      delete enforcement;
+      return;
+   }
+
+   if (appDomainInfo->snippetTimeoutAction == SnippetTimeoutAction_None) {
+      appDomainInfo->snippetTimeoutAction = SnippetTimeoutAction_Abort;
+      // Decided under the same lock as the stale check: from now on, SnippetEnded waits
+      // for the abort to be delivered before it returns (see raw_SnippetEnded)
+      appDomainInfo->snippetAbortInProgress = true;
+   }
    else {
-      return HRESULT_FROM_WIN32(GetLastError());
+      appDomainInfo->snippetTimeoutAction = SnippetTimeoutAction_Unload;
+   }
+   enforcement->action = appDomainInfo->snippetTimeoutAction;
+   enforcement->mainThreadId = appDomainInfo->mainThreadId;
+
+   // Forget the enforcers that are done already
+   for (size_t i = 0; i < me->snippetEnforcers.size();) {
+      if (WaitForSingleObject(me->snippetEnforcers[i], 0) == WAIT_OBJECT_0) {
+         CloseHandle(me->snippetEnforcers[i]);
+         me->snippetEnforcers[i] = me->snippetEnforcers.back();
+         me->snippetEnforcers.pop_back();
+      }
+      else {
+         ++i;
+      }
    }
+
+   HANDLE hThread = CreateThread(NULL, 0, SnippetEnforcerThreadFunc, enforcement, 0, NULL);
+   if (hThread != NULL) {
+      me->snippetEnforcers.push_back(hThread);
+      return;
+   }
+
+   // Better late than never: enforce it here, stalling the other deadlines
+   Logger::Error("Cannot start a thread to enforce the deadline of domain %d: %d", appDomainId, GetLastError());
+   lock.Exit();
+   SnippetEnforcerThreadFunc(enforcement);
+}
+
+DWORD __stdcall HostContext::SnippetEnforcerThreadFunc(LPVOID lpArgs) {
+   SnippetEnforcement* enforcement = (SnippetEnforcement*)lpArgs;
+   enforcement->hostContext->EnforceSnippetDeadline(enforcement->appDomainId, enforcement->snippetRun, enforcement->action, enforcement->mainThreadId);
+   delete enforcement;
+   return 0;
+}
+
+void HostContext::EnforceSnippetDeadline(DWORD appDomainId, LONG snippetRun, LONG action, DWORD mainThreadId) {
+   HRESULT hr = E_FAIL;
+   if (action == SnippetTimeoutAction_Abort) {
+      Logger::Info("Snippet in domain %d is over its deadline: aborting thread %d", appDomainId, mainThreadId);
+      hr = AbortSnippetThreads(mainThreadId);
+
+      CrstLock lock(domainMapCrst);
+      AppDomainInfo* appDomainInfo = appDomains.Find(appDomainId);
+      if (appDomainInfo != NULL)
+         appDomainInfo->snippetAbortInProgress = false;
+      WakeAllConditionVariable(&snippetAbortsDone);
+
+      if (appDomainInfo == NULL || !appDomainInfo->snippetRunning || appDomainInfo->snippetRun != snippetRun) {
+         // The abort worked quickly, and the snippet ended (or the domain is gone): no grace period
+         action = SnippetTimeoutAction_None;
+      }
+      else if (SUCCEEDED(hr)) {
+         // Timed from now, not from the deadline: the abort itself may have taken a while
+         snippetDeadlines->Arm(appDomainId, SNIPPET_ABORT_GRACE_PERIOD, snippetRun);
+      }
+      else {
+         Logger::Error("Cannot abort thread %d: HRESULT %x", mainThreadId, hr);
+         action = SnippetTimeoutAction_Unload;
+         appDomainInfo->snippetTimeoutAction = action;
+      }
+   }
+
+   if (action == SnippetTimeoutAction_Unload) {
+      Logger::Info("Snippet in domain %d did not stop: unloading the domain", appDomainId);
+      // Does not wait: the CLR escalates it to a rude unload after APPDOMAIN_UNLOAD_TIMEOUT
+      hr = runtimeHost->UnloadAppDomain(appDomainId, false);
+      if (FAILED(hr))
+         Logger::Error("Cannot unload domain %d: HRESULT %x", appDomainId, hr);
+   }
+
+   // Let the watchdog know (it does not need to do anything)
+   PostHostMessage(HostEventType_Timeout, appDomainId, 0);
+}
+
+HRESULT HostContext::AbortSnippetThreads(DWORD mainThreadId) {
+   if (taskManager == NULL)
+      return E_FAIL;
+
+#ifdef TRACK_THREAD_RELATIONSHIP
+   std::vector<DWORD> threads;
+   threadTree.GetSubtree(mainThreadId, threads);
+   // Descendants first (reverse pre-order), the main thread last
+   for (size_t i = threads.size() - 1; i > 0; --i) {
+      HRESULT hr = taskManager->AbortTask(threads[i]);
+      if (FAILED(hr))
+         Logger::Debug("Cannot abort thread %d, started by %d: HRESULT %x", threads[i], mainThreadId, hr);
+   }
+#endif //TRACK_THREAD_RELATIONSHIP
+
+   return taskManager->AbortTask(mainThreadId);
+}
+
+HRESULT HostContext::GetHostMessages(DWORD dwMilliseconds, HostEvent* hostEvents, int maxEvents, int* eventCount) {
+
+   LONG droppedMessages = messageQueue.DroppedMessages();
+   if (droppedMessages != reportedDroppedMessages) {
+      Logger::Error("Host message queue full: %d messages dropped", droppedMessages - reportedDroppedMessages);
+      reportedDroppedMessages = droppedMessages;
+   }
+
+   HRESULT hr = messageQueue.Get(dwMilliseconds, hostEvents, maxEvents, eventCount);
+   if (FAILED(hr) || *eventCount == 0)
+      return hr;
+
+   // Messages are not removed from the queue when their domain is unloaded: skip them here
+   CrstLock lock(this->domainMapCrst);
+   int liveEvents = 0;
+   for (int i = 0; i < *eventCount; ++i) {
+      if (appDomains.Find(hostEvents[i].appDomainId) == NULL) {
+         Logger::Debug("Discarding message %d for unloaded domain %d", hostEvents[i].eventType, hostEvents[i].appDomainId);
+         continue;
+      }
+      hostEvents[liveEvents++] = hostEvents[i];
+   }
+   *eventCount = liveEvents;
+   return S_OK;
+}
+
+void HostContext::SetAssemblyStore(SHAssemblyStore* assemblyStore) {
+   this->assemblyStore = assemblyStore;
+   assemblyStore->AddRef();
+}
+
+void HostContext::SetGCManager(SHGCManager* gcManager) {
+   this->gcManager = gcManager;
+   gcManager->AddRef();
 }
 
 // WARNING/ATTENTION PLEASE: we have to use a "windows-style" message system here because
@@ -192,52 +868,20 @@ STDMETHODIMP HostContext::raw_GetLastMessage(/*[in]*/ long dwMilliseconds,
 // Specifically, a reentrancy error (http://msdn.microsoft.com/en-us/library/ms172237%28v=vs.110%29.aspx)
 // The MDA has no effect per-se, but ignoring it can lead to serious error (stack/heap corruption)
 void HostContext::PostHostMessage(long eventType, long appDomainId, long managedThreadId) {
-   
-   CrstLock(this->messageQueueCrst);
-
-   bool eventAlreadyInserted = false;
-   for (auto it = messageQueue.rbegin(); it != messageQueue.rend(); ++it) { // reverse is more efficient
-      if (it->appDomainId == appDomainId && it->eventType == eventType) {
-         eventAlreadyInserted = true;
-         break;
-      }
-   }
-
-   if (!eventAlreadyInserted) {
-      HostEvent lastMessage;
-      lastMessage.eventType = eventType;
-      lastMessage.appDomainId = appDomainId;
-      lastMessage.managedThreadId = managedThreadId;
-
-      messageQueue.push_back(lastMessage);
-   }
-   SetEvent(hMessageEvent);
+   // Lock-free and allocation-free: see HostMessageQueue
+   messageQueue.Post(eventType, appDomainId, managedThreadId);
 }
 
-
-
 void HostContext::OnDomainUnload(DWORD domainId) {
 
    Logger::Debug("In HostContext::OnDomainUnload %d", domainId);
+   snippetDeadlines->Cancel(domainId);
    {
-      CrstLock(this->messageQueueCrst);
-      auto it = messageQueue.begin(); 
-      while (it != messageQueue.end()) {
-         if ((DWORD)it->appDomainId == domainId) {
-            it = messageQueue.erase(it);
-         }
-         else {
-            ++it;
-         }
-      }
-   }
-   {
-      CrstLock(this->domainMapCrst);
-      auto domainIt = appDomains.find(domainId);
-      if (domainIt != appDomains.end()) {
-         appDomains.erase(domainIt);
-      }
+      CrstLock lock(this->domainMapCrst);
+      appDomains.Erase(domainId);
    }
+   if (assemblyStore)
+      assemblyStore->ResetBindStatistics(domainId);
 }
 
 void HostContext::OnDomainRudeUnload() {
@@ -248,21 +892,24 @@ void HostContext::OnDomainRudeUnload() {
 
 void HostContext::OnDomainCreate(DWORD dwAppDomainID, DWORD dwCurrentThreadId, ISimpleHostDomainManager* domainManager) {
 
-   CrstLock(this->domainMapCrst);
-   appDomains.insert(std::make_pair(dwAppDomainID, AppDomainInfo(dwCurrentThreadId, domainManager)));
+   CrstLock lock(this->domainMapCrst);
+   appDomains.Insert(dwAppDomainID, AppDomainInfo(dwCurrentThreadId, domainManager));
 
    // "Migrate" a thread, if it was already assigned to a domain
-   auto currentThreadDomain = threadAppDomain.find(dwCurrentThreadId);
-   if (currentThreadDomain != threadAppDomain.end()) {
-      DWORD currentAppDomainId = currentThreadDomain->second;
+   DWORD* currentThreadDomain = threadAppDomain.Find(dwCurrentThreadId);
+   if (currentThreadDomain != NULL) {
+      DWORD currentAppDomainId = *currentThreadDomain;
       Logger::Debug("Thread %d moving from domain %d to domain %d", dwCurrentThreadId, currentAppDomainId, dwAppDomainID);
-      AppDomainInfo& domainInfo = appDomains.at(currentAppDomainId);
-      --(domainInfo.threadsInAppDomain);
+      AppDomainInfo* domainInfo = appDomains.Find(currentAppDomainId);
+      if (domainInfo != NULL)
+         --(domainInfo->threadsInAppDomain);
 
-      currentThreadDomain->second = dwAppDomainID;
+      *currentThreadDomain = dwAppDomainID;
    }
    else {
-      threadAppDomain.insert(std::make_pair(dwCurrentThreadId, dwAppDomainID));
+      threadAppDomain.Insert(dwCurrentThreadId, dwAppDomainID);
+      if (accountWaits)
+         ClaimWaitSlot(dwCurrentThreadId);
    }
    if (defaultDomainManager == NULL) {
       defaultDomainId = dwAppDomainID; // It should always be 1, but.. you never know
@@ -278,15 +925,17 @@ ISimpleHostDomainManager* HostContext::GetDomainManagerForDefaultDomain() {
 }
 
 bool HostContext::OnThreadAcquiring(DWORD dwParentThreadId) {
-   CrstLock(this->domainMapCrst);
-   auto parentThreadDomain = threadAppDomain.find(dwParentThreadId);
-   if (parentThreadDomain == threadAppDomain.end())
+   CrstLock lock(this->domainMapCrst);
+   DWORD* parentThreadDomain = threadAppDomain.Find(dwParentThreadId);
+   if (parentThreadDomain == NULL)
       return false;
 
-   DWORD appDomainId = parentThreadDomain->second;
-   AppDomainInfo& domainInfo = appDomains.at(appDomainId);
+   DWORD appDomainId = *parentThreadDomain;
+   AppDomainInfo* domainInfo = appDomains.Find(appDomainId);
+   if (domainInfo == NULL)
+      return true; // Already unloaded
 
-   if (domainInfo.threadsInAppDomain >= MAX_THREAD_PER_DOMAIN) {
+   if (domainInfo->threadsInAppDomain >= MAX_THREAD_PER_DOMAIN) {
       // Signal that we have something to signal :)
       PostHostMessage(HostEventType_OutOfTasks, appDomainId, 0);
       return false;      
@@ -295,19 +944,23 @@ bool HostContext::OnThreadAcquiring(DWORD dwParentThreadId) {
 }
 
 bool HostContext::OnThreadAcquire(DWORD dwParentThreadId, DWORD dwThreadId) {
-   CrstLock(this->domainMapCrst);
-   auto parentThreadDomain = threadAppDomain.find(dwParentThreadId);
-   if (parentThreadDomain != threadAppDomain.end()) {
-      DWORD appDomainId = parentThreadDomain->second;
+   CrstLock lock(this->domainMapCrst);
+   DWORD* parentThreadDomain = threadAppDomain.Find(dwParentThreadId);
+   if (parentThreadDomain != NULL) {
+      DWORD appDomainId = *parentThreadDomain;
       Logger::Debug("Thread %d added to domain %d", dwThreadId, appDomainId);
-      AppDomainInfo& domainInfo = appDomains.at(appDomainId);
-      ++(domainInfo.threadsInAppDomain);
-      threadAppDomain.insert(std::make_pair(dwThreadId, parentThreadDomain->second));
-
-      
+      AppDomainInfo* domainInfo = appDomains.Find(appDomainId);
+      if (domainInfo != NULL) {
+         ++(domainInfo->threadsInAppDomain);
+         if (domainInfo->threadsInAppDomain > domainInfo->peakThreadsInAppDomain)
+            domainInfo->peakThreadsInAppDomain = domainInfo->threadsInAppDomain;
+      }
+      threadAppDomain.Insert(dwThreadId, appDomainId);
+      if (accountWaits)
+         ClaimWaitSlot(dwThreadId);
 
 #ifdef TRACK_THREAD_RELATIONSHIP
-      childThreadToParent.insert(std::make_pair(dwThreadId, dwParentThreadId));
+      threadTree.Add(dwParentThreadId, dwThreadId);
 #endif //TRACK_THREAD_RELATIONSHIP
       return true;
    }
@@ -316,130 +969,310 @@ bool HostContext::OnThreadAcquire(DWORD dwParentThreadId, DWORD dwThreadId) {
 }
 
 bool HostContext::OnThreadRelease(DWORD dwThreadId) {
-   CrstLock(this->domainMapCrst);
-   auto parentThreadDomain = threadAppDomain.find(dwThreadId);
-   if (parentThreadDomain != threadAppDomain.end()) {
-      DWORD appDomainId = parentThreadDomain->second;      
-      auto domainInfo = appDomains.find(appDomainId);
-      if (domainInfo == appDomains.end()) {
+   // Set if the thread was the main thread of a domain: we tell the domain manager
+   // after releasing the lock, since it is managed code (it can block, or trigger a GC)
+   DWORD mainThreadAppDomainId = 0;
+   bool cleanExit = false;
+   // Read before taking the lock: it is a system call
+   LONGLONG cpuTime = GetThreadCpuTime(dwThreadId);
+   {
+      CrstLock lock(this->domainMapCrst);
+      DWORD* parentThreadDomain = threadAppDomain.Find(dwThreadId);
+      if (parentThreadDomain == NULL)
+         return false;
+
+      DWORD appDomainId = *parentThreadDomain;      
+      LONGLONG waitTime = accountWaits ? ReleaseWaitSlot(dwThreadId) : 0;
+      AppDomainInfo* domainInfo = appDomains.Find(appDomainId);
+      if (domainInfo == NULL) {
          Logger::Debug("Releasing thread %d from already unloaded domain %d", dwThreadId, appDomainId);
       }
       else {
          Logger::Debug("Thread %d removed from domain %d", dwThreadId, appDomainId);
-         --(domainInfo->second.threadsInAppDomain);
-         if (domainInfo->second.mainThreadId == dwThreadId) {
+         --(domainInfo->threadsInAppDomain);
+         domainInfo->cpuTimeExitedThreads += cpuTime;
+         domainInfo->waitTimeExitedThreads += waitTime;
+         if (domainInfo->mainThreadId == dwThreadId) {
             Logger::Debug("Thread %d is the domain main thread. Removing association with %d", dwThreadId, appDomainId);
-            defaultDomainManager->OnMainThreadExit(appDomainId, domainInfo->second.threadsInAppDomain == 0);
-            appDomains.erase(appDomainId);
+            mainThreadAppDomainId = appDomainId;
+            cleanExit = (domainInfo->threadsInAppDomain == 0);
+            appDomains.Erase(appDomainId);
          }
       }
 
-      threadAppDomain.erase(parentThreadDomain);
+      threadAppDomain.Erase(dwThreadId);
 
 #ifdef TRACK_THREAD_RELATIONSHIP
-      // Remove thread child-parent relationship, where threadId is the parent
-      for (auto it = childThreadToParent.begin(); it != childThreadToParent.end(); ++it) {
-         DWORD childId = it->first;
-         DWORD parentId = it->second;
-         if (parentId == dwThreadId) {
-            // Get the new parent
-            auto parentParent = childThreadToParent.find(parentId);
-            // Insert the new child - grandfather relationship (if there is one)
-            if (parentParent != childThreadToParent.end()) {
-               childThreadToParent.insert(std::make_pair(childId, parentParent->first));
-            }
-
-            childThreadToParent.erase(it);
-            break;
-         }
-      }      
-      // Remove thread child-parent relationship, where threadId is the child
-      childThreadToParent.erase(dwThreadId);
+      // Its children (if any) are adopted by its parent
+      threadTree.Remove(dwThreadId);
 #endif //TRACK_THREAD_RELATIONSHIP      
-      return true;
    }
-   return false;
+
+   if (mainThreadAppDomainId != 0)
+      defaultDomainManager->OnMainThreadExit(mainThreadAppDomainId, cleanExit);
+   return true;
 }
 
 bool HostContext::OnMemoryAcquiring(DWORD dwThreadId, LONG bytes) {   
-   CrstLock(this->domainMapCrst);
+   CrstLock lock(this->domainMapCrst);
 
    // first of all, see if this is one our our snippet appdomains
-   auto appDomainId = threadAppDomain.find(dwThreadId);
-   if (appDomainId == threadAppDomain.end())
+   DWORD* appDomainId = threadAppDomain.Find(dwThreadId);
+   if (appDomainId == NULL)
       return true; // We don't know this thread. No problem, it probably is an internal CLR thread.
 
-   if (appDomainId->second == defaultDomainId) 
+   if (*appDomainId == defaultDomainId) 
       return true; // No problem, let the appdomain to its work
 
-   auto appDomainInfo = appDomains.find(appDomainId->second);
-   if (appDomainInfo != appDomains.end()) {
-      Logger::Info("Requesting allocation in AppDomain %d, %d bytes", appDomainId->second, bytes);
+   AppDomainInfo* appDomainInfo = appDomains.Find(*appDomainId);
+   if (appDomainInfo != NULL) {
+      Logger::Info("Requesting allocation in AppDomain %d, %d bytes", *appDomainId, bytes);
 
-      if (appDomainInfo->second.bytesInAppDomain + bytes > MAX_BYTES_PER_DOMAIN)
+      if (appDomainInfo->bytesInAppDomain + bytes > MAX_BYTES_PER_DOMAIN)
          return false;
 
-      if (appDomainInfo->second.allocsInAppDomain + 1 > MAX_ALLOCS_PER_DOMAIN)
+      if (appDomainInfo->allocsInAppDomain + 1 > MAX_ALLOCS_PER_DOMAIN)
          return false;
    }
    return true;
 }
 
 void HostContext::OnMemoryAcquire(DWORD dwThreadId, LONG bytes, PVOID address) {
-   CrstLock(this->domainMapCrst);
+   CrstLock lock(this->domainMapCrst);
 
-   auto appDomainId = threadAppDomain.find(dwThreadId);
-   if (appDomainId == threadAppDomain.end())
+   DWORD* appDomainId = threadAppDomain.Find(dwThreadId);
+   if (appDomainId == NULL)
       return;
 
-   if (appDomainId->second == defaultDomainId)
+   if (*appDomainId == defaultDomainId)
       return;
 
-   auto appDomainInfo = appDomains.find(appDomainId->second);
-   if (appDomainInfo == appDomains.end())
+   AppDomainInfo* appDomainInfo = appDomains.Find(*appDomainId);
+   if (appDomainInfo == NULL)
       return;
 
-   Logger::Info("Tracking allocation in AppDomain %d, %d bytes", appDomainId->second, bytes);
-   appDomainInfo->second.bytesInAppDomain += bytes;
-   appDomainInfo->second.allocsInAppDomain += 1;
+   Logger::Info("Tracking allocation in AppDomain %d, %d bytes", *appDomainId, bytes);
+   ChargeMemory(appDomainInfo, bytes);
+   appDomainInfo->allocsInAppDomain += 1;
+   appDomainInfo->totalAllocs += 1;
 
-   MemoryInfo memoryInfo { appDomainId->second, bytes };
+   MemoryInfo memoryInfo { *appDomainId, bytes };
    memoryAppDomain.insert(std::make_pair(address, memoryInfo));
 }
 
 int HostContext::OnMemoryRelease(PVOID address) {
-   CrstLock(this->domainMapCrst);
+   CrstLock lock(this->domainMapCrst);
 
    auto memoryInfo = memoryAppDomain.find(address);
    if (memoryInfo == memoryAppDomain.end())
       return 0;
 
    DWORD appDomainId = memoryInfo->second.appDomainId;
-   auto appDomainInfo = appDomains.find(appDomainId);
-   if (appDomainInfo == appDomains.end())
+   AppDomainInfo* appDomainInfo = appDomains.Find(appDomainId);
+   if (appDomainInfo == NULL)
       return 0;
 
    DWORD dwBytes = memoryInfo->second.dwBytes;
    Logger::Info("Tracking release in AppDomain %d, %d bytes", appDomainId, dwBytes);
-   appDomainInfo->second.bytesInAppDomain -= dwBytes;
-   appDomainInfo->second.allocsInAppDomain -= 1;
+   ChargeMemory(appDomainInfo, -(LONG)dwBytes);
+   appDomainInfo->allocsInAppDomain -= 1;
 
    memoryAppDomain.erase(memoryInfo);
    return dwBytes;
 }
 
+void HostContext::ChargeMemory(AppDomainInfo* appDomainInfo, LONG bytes) {
+   appDomainInfo->bytesInAppDomain += bytes;
+   appDomainInfo->liveBytes += bytes;
+   if (bytes > 0) {
+      if (appDomainInfo->bytesInAppDomain > appDomainInfo->peakBytesInAppDomain)
+         appDomainInfo->peakBytesInAppDomain = appDomainInfo->bytesInAppDomain;
+      appDomainInfo->totalBytesAllocated += bytes;
+      appDomainInfo->allocationRate.Add(GetTickCount64(), bytes);
+   }
+}
+
+bool HostContext::OnMemoryCommitting(DWORD appDomainId, LONG bytes) {
+   if (appDomainId == 0 || bytes == 0)
+      return true;
+
+   CrstLock lock(this->domainMapCrst);
+   if (appDomainId == defaultDomainId)
+      return true;
+
+   AppDomainInfo* appDomainInfo = appDomains.Find(appDomainId);
+   if (appDomainInfo != NULL) {
+      Logger::Info("Requesting commit in AppDomain %d, %d bytes", appDomainId, bytes);
+      if (appDomainInfo->bytesInAppDomain + bytes > MAX_BYTES_PER_DOMAIN)
+         return false;
+   }
+   return true;
+}
+
+void HostContext::OnVirtualMemoryChange(const std::vector<VirtualRegionChange>& changes) {
+   if (changes.empty())
+      return;
+
+   CrstLock lock(this->domainMapCrst);
+   for (auto change = changes.begin(); change != changes.end(); ++change) {
+      if (change->appDomainId == 0 || change->appDomainId == defaultDomainId)
+         continue; // Host (or CLR) memory
+
+      AppDomainInfo* appDomainInfo = appDomains.Find(change->appDomainId);
+      if (appDomainInfo == NULL)
+         continue;
+
+      Logger::Info("Tracking virtual memory in AppDomain %d: %d bytes reserved, %d bytes committed", 
+         change->appDomainId, (LONG)change->reservedBytes, (LONG)change->committedBytes);
+      appDomainInfo->reservedBytes += change->reservedBytes;
+      ChargeMemory(appDomainInfo, (LONG)change->committedBytes);
+      // A reservation counts as one allocation
+      appDomainInfo->allocsInAppDomain += change->regions;
+      if (change->regions > 0)
+         appDomainInfo->totalAllocs += change->regions;
+   }
+}
+
 bool HostContext::IsSnippetThread(DWORD dwNativeThreadId) {
-   CrstLock(this->domainMapCrst);
+   CrstLock lock(this->domainMapCrst);
    
-   auto appDomain = threadAppDomain.find(dwNativeThreadId);
-   if (appDomain == threadAppDomain.end())
+   DWORD* appDomain = threadAppDomain.Find(dwNativeThreadId);
+   if (appDomain == NULL)
       return false;
 
-   return (appDomain->second != defaultDomainId);
+   return (*appDomain != defaultDomainId);
+}
+
+DWORD HostContext::GetSnippetAppDomain(DWORD dwNativeThreadId) {
+   CrstLock lock(this->domainMapCrst);
+
+   DWORD* appDomain = threadAppDomain.Find(dwNativeThreadId);
+   if (appDomain == NULL || *appDomain == defaultDomainId)
+      return 0;
+
+   return *appDomain;
+}
+
+DWORD HostContext::OnIoCompleted(DWORD dwAppDomainId, DWORD dwBytes) {
+   CrstLock lock(this->domainMapCrst);
+
+   AppDomainInfo* appDomainInfo = appDomains.Find(dwAppDomainId);
+   if (appDomainInfo == NULL)
+      return 0; // Already unloaded
+
+   AppDomainInfo& domainInfo = *appDomainInfo;
+   domainInfo.ioBytes += dwBytes;
+   ++(domainInfo.ioOperations);
+
+#ifdef THROTTLE_DOMAIN_IO
+   ULONGLONG now = GetTickCount64();
+   if (now - domainInfo.ioWindowStart >= 1000) {
+      domainInfo.ioWindowStart = now;
+      domainInfo.ioWindowBytes = 0;
+   }
+   domainInfo.ioWindowBytes += dwBytes;
+
+   if (domainInfo.ioWindowBytes > MAX_IO_BYTES_PER_SECOND_PER_DOMAIN) {
+      // Over budget: hold the completion back for as many windows as it takes to
+      // bring what was completed so far within the budget
+      LONGLONG excessWindows = domainInfo.ioWindowBytes / MAX_IO_BYTES_PER_SECOND_PER_DOMAIN;
+      ULONGLONG releaseTime = domainInfo.ioWindowStart + excessWindows * 1000;
+      return (DWORD)(releaseTime - now);
+   }
+#endif //THROTTLE_DOMAIN_IO
+   return 0;
+}
+
+DWORD HostContext::OnWorkItemQueued(DWORD dwThreadId, DWORD dwAppDomainId) {
+   CrstLock lock(this->domainMapCrst);
+
+   if (dwAppDomainId == 0) {
+      DWORD* appDomainId = threadAppDomain.Find(dwThreadId);
+      if (appDomainId == NULL)
+         return 0; // Not one of ours: probably an internal CLR thread
+      dwAppDomainId = *appDomainId;
+   }
+
+   if (dwAppDomainId == defaultDomainId)
+      return 0; // Host work, not a snippet
+
+   AppDomainInfo* appDomainInfo = appDomains.Find(dwAppDomainId);
+   if (appDomainInfo != NULL) {
+      ++(appDomainInfo->workItemsQueued);
+      ++(appDomainInfo->workItemsPending);
+   }
+   return dwAppDomainId;
+}
+
+void HostContext::OnWorkItemCompleted(DWORD dwAppDomainId) {
+   if (dwAppDomainId == 0)
+      return;
+
+   CrstLock lock(this->domainMapCrst);
+   AppDomainInfo* appDomainInfo = appDomains.Find(dwAppDomainId);
+   if (appDomainInfo != NULL) {
+      --(appDomainInfo->workItemsPending);
+   }
+}
+
+LONGLONG HostContext::RunCallbackBenchmark(LONG numDomains, LONG iterations) {
+   if (numDomains < 1)
+      numDomains = 1;
+
+   // Thread ids are multiples of 4: each domain gets a main thread, plus one child
+   const DWORD firstThreadId = 0x10000;
+   OnDomainCreate(1, firstThreadId - 4, NULL);
+   for (LONG d = 0; d < numDomains; ++d)
+      OnDomainCreate(d + 2, firstThreadId + d * 8, NULL);
+   // Without a domain manager every domain looks like the default one
+   defaultDomainId = 1;
+
+   LARGE_INTEGER frequency, start, end;
+   QueryPerformanceFrequency(&frequency);
+   QueryPerformanceCounter(&start);
+
+   for (LONG i = 0; i < iterations; ++i) {
+      DWORD mainThreadId = firstThreadId + (i % numDomains) * 8;
+      DWORD childThreadId = mainThreadId + 4;
+      PVOID address = (PVOID)(0x1000 + (ULONG_PTR)i * 16);
+
+      // The mix a snippet usually produces: a new thread, an allocation, a work item,
+      // a few "is this a snippet?" checks from the managers
+      if (OnThreadAcquiring(mainThreadId))
+         OnThreadAcquire(mainThreadId, childThreadId);
+      if (OnMemoryAcquiring(childThreadId, 64))
+         OnMemoryAcquire(childThreadId, 64, address);
+      OnWorkItemCompleted(OnWorkItemQueued(childThreadId, 0));
+      IsSnippetThread(childThreadId);
+      OnMemoryRelease(address);
+      OnThreadRelease(childThreadId);
+   }
+
+   QueryPerformanceCounter(&end);
+   return (end.QuadPart - start.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+void HostContext::OnGCSuspension(const DWORD* threadIds, const LONGLONG* microseconds, int numThreads) {
+   CrstLock lock(this->domainMapCrst);
+
+   for (int i = 0; i < numThreads; ++i) {
+      DWORD* appDomainId = threadAppDomain.Find(threadIds[i]);
+      if (appDomainId == NULL || *appDomainId == defaultDomainId)
+         continue;
+
+      AppDomainInfo* appDomainInfo = appDomains.Find(*appDomainId);
+      if (appDomainInfo != NULL)
+         appDomainInfo->gcTime += microseconds[i];
+   }
 }
 
 HRESULT HostContext::Sleep(DWORD dwMilliseconds, DWORD option) {
 
+   // Sleep(0) is a yield, not a wait
+   if (dwMilliseconds != 0)
+      SHThreadpoolManager::OnWorkerBlocking();
+   LONGLONG waitStart = WaitStart();
+   HRESULT hr;
    BOOL alertable = option & WAIT_ALERTABLE;
 
    // WAIT_MSGPUMP: Notifies the host that it must pump messages on the current OS thread if the thread becomes blocked.The runtime specifies this value only on an STA thread.
@@ -466,15 +1299,20 @@ HRESULT HostContext::Sleep(DWORD dwMilliseconds, DWORD option) {
       // CoWaitForMultipleHandles may call WaitForMultipleObjectEx, which does NOT support 0 array handles.
       // Besides, MSDN is not clear if the handle array can be NULL, so.. we use a trick
       HANDLE dummy = GetCurrentProcess();
-      HRESULT hr = CoWaitForMultipleHandles(dwFlags, dwMilliseconds, 1, &dummy, &dwIndex);
+      hr = CoWaitForMultipleHandles(dwFlags, dwMilliseconds, 1, &dummy, &dwIndex);
       if (dwIndex == WAIT_TIMEOUT) {
-         return S_OK;
+         hr = S_OK;
       }
-      return hr;
    }
    else {
-      return HRESULTFromWaitResult(SleepEx(dwMilliseconds, alertable));
+      hr = HRESULTFromWaitResult(SleepEx(dwMilliseconds, alertable));
    }
+
+   if (dwMilliseconds != 0) {
+      WaitEnd(waitStart);
+      SHThreadpoolManager::OnWorkerUnblocked();
+   }
+   return hr;
 }
 
 HRESULT HostContext::HRESULTFromWaitResult(DWORD dwWaitResult) {
@@ -500,6 +1338,11 @@ HRESULT HostContext::HRESULTFromWaitResult(DWORD dwWaitResult) {
 
 HRESULT HostContext::HostWait(HANDLE hWait, DWORD dwMilliseconds, DWORD dwOption) {
 
+   // Polls (0 timeout) do not block
+   if (dwMilliseconds != 0)
+      SHThreadpoolManager::OnWorkerBlocking();
+   LONGLONG waitStart = WaitStart();
+   HRESULT hr;
    BOOL alertable = dwOption & WAIT_ALERTABLE;
    if (dwOption & WAIT_MSGPUMP) {
       DWORD dwFlags = 0;
@@ -508,9 +1351,15 @@ HRESULT HostContext::HostWait(HANDLE hWait, DWORD dwMilliseconds, DWORD dwOption
          // See http://msdn.microsoft.com/en-us/library/windows/desktop/ms680732%28v=vs.85%29.aspx
          SetLastError(ERROR_SUCCESS);
       }
-      return CoWaitForMultipleHandles(dwFlags, dwMilliseconds, 1, &hWait, NULL);
+      hr = CoWaitForMultipleHandles(dwFlags, dwMilliseconds, 1, &hWait, NULL);
    }
    else {
-      return HRESULTFromWaitResult(WaitForSingleObjectEx(hWait, dwMilliseconds, alertable));
+      hr = HRESULTFromWaitResult(WaitForSingleObjectEx(hWait, dwMilliseconds, alertable));
+   }
+
+   if (dwMilliseconds != 0) {
+      WaitEnd(waitStart);
+      SHThreadpoolManager::OnWorkerUnblocked();
    }
+   return hr;
 }
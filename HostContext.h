@@ -6,34 +6,75 @@
 
 #include <map>
 #include <list>
+#include <vector>
 
 #import "SimpleHostRuntime.tlb" no_namespace named_guids
 
 //using namespace SimpleHostRuntime;
 
 #include "AppDomainInfo.h"
+#include "FlatTable.h"
+#include "HostMessageQueue.h"
+#include "Threading/ThreadTree.h"
+#include "Memory/VirtualRegionMap.h"
 
 const int MAX_THREAD_PER_DOMAIN = 10;
 const int MAX_ALLOCS_PER_DOMAIN = 1000;
 const int MAX_BYTES_PER_DOMAIN = 10 * 1024 * 1024; // 10 MB
+#ifdef THROTTLE_DOMAIN_IO
+const LONGLONG MAX_IO_BYTES_PER_SECOND_PER_DOMAIN = 10 * 1024 * 1024; // 10 MB/s
+#endif //THROTTLE_DOMAIN_IO
+
+class SHAssemblyStore;
+class TimerWheel;
+class SHTaskManager;
+class SHGCManager;
+
+// Time a timed-out snippet has to stop after the abort, before we unload its domain (ms)
+const DWORD SNIPPET_ABORT_GRACE_PERIOD = 2000;
 
 struct MemoryInfo {
    DWORD appDomainId;
    DWORD dwBytes;
 };
 
+// A thread, the domain it was in, and its CPU time (microseconds) when we looked
+struct ThreadCpuTime {
+   DWORD threadId;
+   DWORD appDomainId;
+   LONGLONG cpuTime;
+};
+
+// CPU and wait time (microseconds) of the live threads of a domain
+struct DomainThreadTimes {
+   DomainThreadTimes() : cpuTime(0), waitTime(0) { }
+   LONGLONG cpuTime;
+   LONGLONG waitTime;
+};
+
+class HostContext;
+
+// What the timer thread decided to do about a snippet over its deadline
+struct SnippetEnforcement {
+   HostContext* hostContext;
+   DWORD appDomainId;
+   LONG snippetRun;
+   LONG action; // SnippetTimeoutAction_Abort or SnippetTimeoutAction_Unload
+   DWORD mainThreadId;
+};
+
 class HostContext: public IHostContext {
 private:
    volatile LONG m_cRef;
 
    LPCRITICAL_SECTION domainMapCrst;
-   std::map<DWORD, AppDomainInfo> appDomains;
+   FlatTable<AppDomainInfo, DomainIdHash> appDomains;
 
 #ifdef TRACK_THREAD_RELATIONSHIP
-   std::map<DWORD, DWORD> childThreadToParent;
+   ThreadTree threadTree;
 #endif //TRACK_THREAD_RELATIONSHIP
 
-   std::map<DWORD, DWORD> threadAppDomain;
+   FlatTable<DWORD, ThreadIdHash> threadAppDomain;
    std::map<void*, MemoryInfo> memoryAppDomain;
 
    volatile unsigned long numZombieDomains;
@@ -42,11 +83,45 @@ private:
    DWORD defaultDomainId;
 
    ICLRRuntimeHost* runtimeHost;
+   SHTaskManager* taskManager;
+   SHAssemblyStore* assemblyStore;
+   SHGCManager* gcManager;
+   // The CLR loads every assembly it can domain-neutral (STARTUP_LOADER_OPTIMIZATION_MULTI_DOMAIN)
+   bool domainNeutralLoading;
+   // Only the context that hosts the CLR accounts waits (the wait slots are per process)
+   bool accountWaits;
 
    // Our "windows-style" message queue
-   std::list<HostEvent> messageQueue;
-   LPCRITICAL_SECTION messageQueueCrst;
-   HANDLE hMessageEvent;
+   HostMessageQueue messageQueue;
+   LONG reportedDroppedMessages;
+
+   HRESULT GetHostMessages(DWORD dwMilliseconds, HostEvent* hostEvents, int maxEvents, int* eventCount);
+
+   // Deadlines of running snippets, by AppDomain
+   TimerWheel* snippetDeadlines;
+   static void OnSnippetDeadline(DWORD appDomainId, LONG snippetRun, LPVOID context);
+   // The threads aborting (or unloading) the snippets over their deadline (with domainMapCrst).
+   // Signalled when an abort has been requested, for SnippetEnded
+   std::vector<HANDLE> snippetEnforcers;
+   CONDITION_VARIABLE snippetAbortsDone;
+   static DWORD __stdcall SnippetEnforcerThreadFunc(LPVOID lpArgs);
+   void EnforceSnippetDeadline(DWORD appDomainId, LONG snippetRun, LONG action, DWORD mainThreadId);
+   // Aborts the snippet main thread and, with TRACK_THREAD_RELATIONSHIP, all the threads
+   // it started (directly or not). Returns the result of aborting the main thread
+   HRESULT AbortSnippetThreads(DWORD mainThreadId);
+
+   // CPU time of the live threads of a domain (of all the domains, if appDomainId is 0).
+   // Takes domainMapCrst just to copy the thread list: OpenThread and GetThreadTimes are
+   // system calls, and run outside the lock
+   void QueryThreadsCpuTime(DWORD appDomainId, std::vector<ThreadCpuTime>& threads);
+   // With domainMapCrst held: adds up, by domain, the CPU and wait time of the threads that are
+   // still in the domain they were in when queried (the ones that left since then have been moved
+   // to the ...ExitedThreads counters already; the ones that arrived since then are missed by this sample)
+   void AddLiveThreadsTimes(const std::vector<ThreadCpuTime>& threads, FlatTable<DomainThreadTimes, DomainIdHash>& times);
+   // Bytes (positive or negative) allocated by the domain: current, peak and lifetime counters
+   void ChargeMemory(AppDomainInfo* appDomainInfo, LONG bytes);
+   // liveThreadsTimes may be NULL (no live thread of the domain was sampled)
+   void FillDomainSnapshot(DWORD appDomainId, const AppDomainInfo& appDomainInfo, const DomainThreadTimes* liveThreadsTimes, DomainSnapshot* snapshot);
 
 public:
    HostContext(ICLRRuntimeHost* runtimeHost);
@@ -75,6 +150,86 @@ public:
 
    virtual STDMETHODIMP raw_GetLastMessage(/*[in]*/ long dwMilliseconds,  /*[out]*/ HostEvent* hostEvent,  /*[out,retval]*/ VARIANT_BOOL* eventPresent);
 
+   virtual STDMETHODIMP raw_GetMessages(
+      /*[in]*/ long millisecondsTimeout,
+      /*[in]*/ long maxEvents,
+      /*[in,out]*/ HostEvent * hostEvents,
+      /*[out,retval]*/ long * pRetVal);
+
+   virtual STDMETHODIMP raw_CloseMessages();
+
+   virtual STDMETHODIMP raw_SnippetStarted(
+      /*[in]*/ long appDomainId,
+      /*[in]*/ long timeoutMilliseconds);
+
+   virtual STDMETHODIMP raw_SnippetEnded(
+      /*[in]*/ long appDomainId,
+      /*[out,retval]*/ long * pRetVal);
+
+   virtual STDMETHODIMP raw_GetIoBytes(
+      /*[in]*/ long appDomainId,
+      /*[out,retval]*/ __int64 * pRetVal);
+
+   virtual STDMETHODIMP raw_GetIoOperations(
+      /*[in]*/ long appDomainId,
+      /*[out,retval]*/ long * pRetVal);
+
+   virtual STDMETHODIMP raw_GetDomainSnapshot(
+      /*[in]*/ long appDomainId,
+      /*[out]*/ DomainSnapshot * snapshot,
+      /*[out,retval]*/ VARIANT_BOOL * pRetVal);
+
+   virtual STDMETHODIMP raw_GetDomainSnapshots(
+      /*[in]*/ long maxDomains,
+      /*[in,out]*/ DomainSnapshot * snapshots,
+      /*[out]*/ long * numberOfZombies,
+      /*[out,retval]*/ long * pRetVal);
+
+   virtual STDMETHODIMP raw_RegisterAssembly(
+      /*[in]*/ SAFEARRAY * assemblyImage,
+      /*[out,retval]*/ BSTR * pRetVal);
+
+   virtual STDMETHODIMP raw_IsAssemblyRegistered(
+      /*[in]*/ BSTR fullName,
+      /*[out,retval]*/ VARIANT_BOOL * pRetVal);
+
+   virtual STDMETHODIMP raw_GetBindCount(
+      /*[in]*/ long appDomainId,
+      /*[out,retval]*/ long * pRetVal);
+
+   virtual STDMETHODIMP raw_GetBindTime(
+      /*[in]*/ long appDomainId,
+      /*[out,retval]*/ __int64 * pRetVal);
+
+   virtual STDMETHODIMP raw_GetBindLatencyHistogram(
+      /*[out,retval]*/ SAFEARRAY ** pRetVal);
+
+   virtual STDMETHODIMP raw_GetGCCount(
+      /*[in]*/ long generation,
+      /*[out,retval]*/ long * pRetVal);
+
+   virtual STDMETHODIMP raw_GetGCPauseTime(
+      /*[in]*/ long generation,
+      /*[out,retval]*/ __int64 * pRetVal);
+
+   virtual STDMETHODIMP raw_GetGCPauseHistogram(
+      /*[in]*/ long generation,
+      /*[out,retval]*/ SAFEARRAY ** pRetVal);
+
+   virtual STDMETHODIMP raw_GetRecentGCPauses(
+      /*[in]*/ long maxPauses,
+      /*[in,out]*/ GCPause * pauses,
+      /*[out,retval]*/ long * pRetVal);
+
+   virtual STDMETHODIMP raw_IsDomainNeutralLoading(
+      /*[out,retval]*/ VARIANT_BOOL * pRetVal);
+
+   void SetAssemblyStore(SHAssemblyStore* assemblyStore);
+   void SetGCManager(SHGCManager* gcManager);
+   // Not refcounted: the task manager holds a (plain) pointer to us too
+   void SetTaskManager(SHTaskManager* taskManager) { this->taskManager = taskManager; }
+   void SetDomainNeutralLoading(bool domainNeutralLoading) { this->domainNeutralLoading = domainNeutralLoading; }
+
    void PostHostMessage(long eventType, long appDomainId, long managedThreadId);
 
    void OnDomainUnload(DWORD domainId);
@@ -91,8 +246,34 @@ public:
    void OnMemoryAcquire(DWORD dwThreadId, LONG bytes, PVOID address);
    int OnMemoryRelease(PVOID address);
 
+   // Virtual memory (see VirtualRegionMap) is charged to the domain that commits it:
+   // quotas apply to committed bytes only
+   bool OnMemoryCommitting(DWORD appDomainId, LONG bytes);
+   void OnVirtualMemoryChange(const std::vector<VirtualRegionChange>& changes);
+
    bool IsSnippetThread(DWORD nativeThreadId);
+   // The snippet AppDomain the thread belongs to, or 0 (default domain, or unknown thread)
+   DWORD GetSnippetAppDomain(DWORD nativeThreadId);
+
+   // Threadpool accounting. Returns the AppDomain the work item is attributed to
+   // (dwAppDomainId, if known by the caller, or the domain of the queuing thread),
+   // or 0 for host work (default domain, CLR internal threads)
+   DWORD OnWorkItemQueued(DWORD dwThreadId, DWORD dwAppDomainId);
+   void OnWorkItemCompleted(DWORD dwAppDomainId);
+
+   // Time lost by each thread to a GC suspension
+   void OnGCSuspension(const DWORD* threadIds, const LONGLONG* microseconds, int numThreads);
+
+   // I/O accounting. Returns for how many milliseconds the completion should be held
+   // back, because the domain is over its I/O budget (always 0 without THROTTLE_DOMAIN_IO)
+   DWORD OnIoCompleted(DWORD dwAppDomainId, DWORD dwBytes);
   
+   // Replays iterations of the thread/memory/threadpool callback mix over numDomains
+   // synthetic domains; returns the elapsed time in microseconds. Does not need the CLR
+   // (call it on a fresh HostContext, created with a NULL runtime host).
+   // Single threaded: it measures the table lookups, not lock contention.
+   LONGLONG RunCallbackBenchmark(LONG numDomains, LONG iterations);
+
    static HRESULT HostWait(HANDLE hWait, DWORD dwMilliseconds, DWORD dwOption);
    static HRESULT Sleep(DWORD dwMilliseconds, DWORD dwOption);
    static HRESULT HRESULTFromWaitResult(DWORD dwWaitResult);
@@ -10,13 +10,15 @@
 #include "Threading\ThreadpoolMgr.h"
 #include "Threading\IoCompletionMgr.h"
 #include "Assembly\AssemblyMgr.h"
+#include "Assembly\AssemblyStore.h"
 #include "EventManager.h"
 #include "PolicyManager.h"
 
 #include "Logger.h"
 
-DHHostControl::DHHostControl(ICLRRuntimeHost *pRuntimeHost, const std::list<AssemblyInfo>& hostAssemblies) {
+DHHostControl::DHHostControl(ICLRRuntimeHost *pRuntimeHost, const std::list<AssemblyInfo>& hostAssemblies, ICLRAssemblyIdentityManager* identityManager) {
    m_cRef = 0;
+   hostIoCompletion = false;
    m_pRuntimeHost = pRuntimeHost;
    m_pRuntimeHost->AddRef();
 
@@ -32,10 +34,10 @@ DHHostControl::DHHostControl(ICLRRuntimeHost *pRuntimeHost, const std::list<Asse
    taskManager = new SHTaskManager(hostContext);
    syncManager = new SHSyncManager();
    memoryManager = new SHMemoryManager(hostContext);
-   gcManager = new SHGCManager();
+   gcManager = new SHGCManager(hostContext);
    threadpoolManager = new SHThreadpoolManager(hostContext);
    iocpManager = new SHIoCompletionManager(hostContext);
-   assemblyManager = new SHAssemblyManager(hostAssemblies);
+   assemblyManager = new SHAssemblyManager(hostAssemblies, identityManager);
    eventManager = new SHEventManager(hostContext);
    policyManager = new SHPolicyManager(hostContext);
 
@@ -53,6 +55,10 @@ DHHostControl::DHHostControl(ICLRRuntimeHost *pRuntimeHost, const std::list<Asse
       Logger::Critical("Unable to allocate Host Managers");
    }
 
+   hostContext->SetAssemblyStore(assemblyManager->GetHostAssemblyStore());
+   hostContext->SetTaskManager(taskManager);
+   hostContext->SetGCManager(gcManager);
+
    hostContext->AddRef();
 
    taskManager->AddRef();
@@ -85,6 +91,8 @@ DHHostControl::~DHHostControl() {
 }
 
 STDMETHODIMP_(VOID) DHHostControl::ShuttingDown() {
+   threadpoolManager->Shutdown();
+   iocpManager->Shutdown();
 }
 
 // IUnknown functions
@@ -124,8 +132,9 @@ STDMETHODIMP DHHostControl::GetHostManager(const IID &riid, void **ppvHostManage
       return memoryManager->QueryInterface(IID_IHostMemoryManager, ppvHostManager);
    if (riid == IID_IHostGCManager)
       return gcManager->QueryInterface(IID_IHostGCManager, ppvHostManager);
-   //if (riid == IID_IHostIoCompletionManager)
-   //   return iocpManager->QueryInterface(IID_IHostIoCompletionManager, ppvHostManager);
+   // Without it, the CLR uses its own completion port and threads (and we do not account I/O)
+   if (riid == IID_IHostIoCompletionManager && hostIoCompletion)
+      return iocpManager->QueryInterface(IID_IHostIoCompletionManager, ppvHostManager);
    if (riid == IID_IHostThreadpoolManager)
       return threadpoolManager->QueryInterface(IID_IHostThreadpoolManager, ppvHostManager);
    if (riid == IID_IHostAssemblyManager)
@@ -182,6 +191,18 @@ IHostContext* DHHostControl::GetHostContext() {
    return hostContext;
 }
 
+void DHHostControl::PrefetchHostAssemblies() {
+   assemblyManager->GetHostAssemblyStore()->PrefetchAssemblies();
+}
+
+void DHHostControl::SetDomainNeutralLoading(bool domainNeutralLoading) {
+   hostContext->SetDomainNeutralLoading(domainNeutralLoading);
+}
+
+void DHHostControl::SetHostIoCompletion(bool hostIoCompletion) {
+   this->hostIoCompletion = hostIoCompletion;
+}
+
 bool DHHostControl::SetupEscalationPolicy() {
    ICLRPolicyManager* clrPolicyManager = NULL;
 
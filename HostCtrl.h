@@ -38,9 +38,11 @@ private:
    SHPolicyManager* policyManager;
 
    HostContext* hostContext;
+   // Whether we give our I/O completion manager to the CLR (GetHostManager)
+   bool hostIoCompletion;
 
 public:
-   DHHostControl(ICLRRuntimeHost *pRuntimeHost, const std::list<AssemblyInfo>& hostAssemblies);
+   DHHostControl(ICLRRuntimeHost *pRuntimeHost, const std::list<AssemblyInfo>& hostAssemblies, ICLRAssemblyIdentityManager* identityManager);
    ~DHHostControl();
 
    ICLRControl* GetCLRControl() { return m_pRuntimeControl; };
@@ -57,6 +59,10 @@ public:
 
    ISimpleHostDomainManager* GetDomainManagerForDefaultDomain();
    IHostContext* GetHostContext();
+   void PrefetchHostAssemblies();
+   void SetDomainNeutralLoading(bool domainNeutralLoading);
+   // Must be called before the CLR starts: it asks for its managers only then
+   void SetHostIoCompletion(bool hostIoCompletion);
 
    bool SetupEscalationPolicy();
 };
@@ -0,0 +1,150 @@
+
+#include "HostMessageQueue.h"
+
+#include "CrstLock.h"
+#include "Logger.h"
+
+HostMessageQueue::HostMessageQueue() {
+   for (LONG i = 0; i < HOST_MESSAGE_QUEUE_SIZE; ++i) {
+      cells[i].sequence = i;
+      cells[i].pendingEntry = NULL;
+   }
+   enqueuePosition = 0;
+   dequeuePosition = 0;
+   ZeroMemory((void*)pending, sizeof(pending));
+   droppedMessages = 0;
+
+   LARGE_INTEGER frequency;
+   QueryPerformanceFrequency(&frequency);
+   ticksPerMillisecond = frequency.QuadPart / 1000;
+
+   hMessageEvent = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+   if (hMessageEvent == NULL)
+      Logger::Critical("CreateEvent error: %d", GetLastError());
+   hCloseEvent = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+   if (hCloseEvent == NULL)
+      Logger::Critical("CreateEvent error: %d", GetLastError());
+
+   consumerCrst = new CRITICAL_SECTION;
+   if (!consumerCrst)
+      Logger::Critical("Failed to allocate critical sections");
+   InitializeCriticalSection(consumerCrst);
+}
+
+HostMessageQueue::~HostMessageQueue() {
+   if (consumerCrst)
+      DeleteCriticalSection(consumerCrst);
+   if (hMessageEvent)
+      CloseHandle(hMessageEvent);
+   if (hCloseEvent)
+      CloseHandle(hCloseEvent);
+}
+
+volatile LONG* HostMessageQueue::PendingEntry(long eventType, long appDomainId) {
+   // 0 marks a free entry, so it cannot be used as a domain id
+   if (appDomainId <= 0 || eventType < 0 || eventType >= HOST_MESSAGE_EVENT_TYPES)
+      return NULL;
+   return &pending[(appDomainId & (HOST_MESSAGE_PENDING_ROWS - 1)) * HOST_MESSAGE_EVENT_TYPES + eventType];
+}
+
+bool HostMessageQueue::Post(long eventType, long appDomainId, long managedThreadId) {
+
+   volatile LONG* pendingEntry = PendingEntry(eventType, appDomainId);
+   if (pendingEntry) {
+      LONG owner = InterlockedCompareExchange(pendingEntry, appDomainId, 0);
+      if (owner == appDomainId)
+         return true; // Already in the queue, and not yet delivered
+      if (owner != 0)
+         pendingEntry = NULL; // Taken by another domain
+   }
+
+   // Claim a cell
+   Cell* cell;
+   LONG position = enqueuePosition;
+   for (;;) {
+      cell = &cells[position & (HOST_MESSAGE_QUEUE_SIZE - 1)];
+      LONG difference = (LONG)((ULONG)cell->sequence - (ULONG)position);
+      if (difference == 0) {
+         LONG current = InterlockedCompareExchange(&enqueuePosition, position + 1, position);
+         if (current == position)
+            break;
+         position = current;
+      }
+      else if (difference < 0) {
+         // The consumer has not freed this cell yet: the queue is full
+         if (pendingEntry)
+            InterlockedExchange(pendingEntry, 0);
+         InterlockedIncrement(&droppedMessages);
+         return false;
+      }
+      else {
+         // Another producer took it
+         position = enqueuePosition;
+      }
+   }
+
+   cell->hostEvent.eventType = eventType;
+   cell->hostEvent.appDomainId = appDomainId;
+   cell->hostEvent.managedThreadId = managedThreadId;
+   cell->hostEvent.sequenceNumber = position;
+   LARGE_INTEGER now;
+   QueryPerformanceCounter(&now);
+   cell->hostEvent.timestamp = now.QuadPart / ticksPerMillisecond;
+   cell->pendingEntry = pendingEntry;
+   // Publish it (full barrier: the writes above are visible before the sequence)
+   InterlockedExchange(&cell->sequence, position + 1);
+
+   SetEvent(hMessageEvent);
+   return true;
+}
+
+int HostMessageQueue::TryDequeue(HostEvent* hostEvents, int maxEvents) {
+   CrstLock lock(consumerCrst);
+
+   int eventCount = 0;
+   while (eventCount < maxEvents) {
+      LONG position = dequeuePosition;
+      Cell* cell = &cells[position & (HOST_MESSAGE_QUEUE_SIZE - 1)];
+      LONG difference = (LONG)((ULONG)cell->sequence - (ULONG)(position + 1));
+      if (difference < 0)
+         break; // Empty, or the producer has not finished writing it yet
+
+      hostEvents[eventCount++] = cell->hostEvent;
+      // From now on, the same (domain, event) can be posted again
+      if (cell->pendingEntry)
+         InterlockedExchange(cell->pendingEntry, 0);
+      cell->pendingEntry = NULL;
+
+      dequeuePosition = position + 1;
+      // Give the cell back to producers, for the next lap
+      InterlockedExchange(&cell->sequence, position + HOST_MESSAGE_QUEUE_SIZE);
+   }
+   return eventCount;
+}
+
+HRESULT HostMessageQueue::Get(DWORD dwMilliseconds, HostEvent* hostEvents, int maxEvents, int* eventCount) {
+
+   *eventCount = TryDequeue(hostEvents, maxEvents);
+   if (*eventCount > 0 || maxEvents <= 0)
+      return S_OK;
+
+   // Not an alertable wait, so Thread.Interrupt cannot wake us up: Close does
+   HANDLE handles[] = { hMessageEvent, hCloseEvent };
+   DWORD dwResult = WaitForMultipleObjects(2, handles, FALSE, dwMilliseconds);
+   if (dwResult == WAIT_OBJECT_0) {
+      // The event can be left signaled by a message we already consumed: in that case,
+      // we just return with no message, as if the wait timed out
+      *eventCount = TryDequeue(hostEvents, maxEvents);
+      return S_OK;
+   }
+   else if (dwResult == WAIT_OBJECT_0 + 1 || dwResult == WAIT_TIMEOUT) {
+      return S_OK;
+   }
+   else {
+      return HRESULT_FROM_WIN32(GetLastError());
+   }
+}
+
+void HostMessageQueue::Close() {
+   SetEvent(hCloseEvent);
+}
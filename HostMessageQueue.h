@@ -0,0 +1,77 @@
+#ifndef SH_HOST_MESSAGE_QUEUE_H_INCLUDED
+#define SH_HOST_MESSAGE_QUEUE_H_INCLUDED
+
+#include "Common.h"
+
+#import "SimpleHostRuntime.tlb" no_namespace named_guids
+
+// Must be a power of 2
+const LONG HOST_MESSAGE_QUEUE_SIZE = 256;
+// Pending (domain, event) pairs are tracked in a direct-mapped table: domain ids are
+// hashed on this many rows (power of 2), one column per event type
+const int HOST_MESSAGE_PENDING_ROWS = 64;
+const int HOST_MESSAGE_EVENT_TYPES = 8;
+
+// The host-to-managed message queue: a bounded ring buffer, multiple producers and a
+// single consumer (Vyukov's bounded queue: each cell carries a sequence number that
+// tells producers and consumer whose turn it is).
+// Posting never allocates, never blocks and never waits for a lock: it is called from
+// inside CreateTask and other places where the CLR forbids reentrancy and blocking.
+// A (domain, event) pair that is already waiting to be delivered is not queued again;
+// messages are delivered in FIFO order, each one with its position in the queue as a
+// sequence number.
+class HostMessageQueue {
+private:
+   struct Cell {
+      volatile LONG sequence;
+      HostEvent hostEvent;
+      // The pending entry this message owns (cleared on delivery), or NULL
+      volatile LONG* pendingEntry;
+   };
+
+   Cell cells[HOST_MESSAGE_QUEUE_SIZE];
+   volatile LONG enqueuePosition;
+   // Only the consumer moves this one, under consumerCrst
+   LONG dequeuePosition;
+
+   // The domain that has a message of that type in the queue, or 0.
+   // When two live domains hash on the same row the second one is just queued
+   // without de-duplication: we never suppress a message we cannot prove is a duplicate.
+   volatile LONG pending[HOST_MESSAGE_PENDING_ROWS * HOST_MESSAGE_EVENT_TYPES];
+
+   volatile LONG droppedMessages;
+
+   // Auto-reset; signaled after each successful post
+   HANDLE hMessageEvent;
+   // Manual-reset; signaled by Close
+   HANDLE hCloseEvent;
+   LPCRITICAL_SECTION consumerCrst;
+
+   // Message timestamps are in milliseconds, on the same clock as the managed
+   // StopwatchExtensions.GetTimestampMillis (QueryPerformanceCounter)
+   LONGLONG ticksPerMillisecond;
+
+   volatile LONG* PendingEntry(long eventType, long appDomainId);
+   int TryDequeue(HostEvent* hostEvents, int maxEvents);
+
+public:
+   HostMessageQueue();
+   ~HostMessageQueue();
+
+   // Returns false if the message was dropped because the queue is full
+   bool Post(long eventType, long appDomainId, long managedThreadId);
+
+   // Waits up to dwMilliseconds for a message, then takes all the messages already in the
+   // queue, up to maxEvents. Returns S_OK with *eventCount == 0 on timeout, or if the
+   // queue has been closed.
+   HRESULT Get(DWORD dwMilliseconds, HostEvent* hostEvents, int maxEvents, int* eventCount);
+
+   // Wakes up the consumer, if it is waiting in Get, and keeps it from waiting again:
+   // at shutdown, the consumer does not have to wait for its timeout to expire.
+   // Messages can still be posted and taken.
+   void Close();
+
+   LONG DroppedMessages() const { return droppedMessages; }
+};
+
+#endif //SH_HOST_MESSAGE_QUEUE_H_INCLUDED
@@ -10,6 +10,12 @@ static const size_t LINE_BUFFER_SIZE = 320;
 
 LogLevel::Level Logger::currentLevel = LogLevel::Debug;
 
+LogLevel::Level Logger::SetLevel(LogLevel::Level level) {
+   LogLevel::Level previousLevel = currentLevel;
+   currentLevel = level;
+   return previousLevel;
+}
+
 wchar_t* wlevels [] = { L"Info", L"Debug", L"Error", L"Critical" };
 char* levels [] = { "Info", "Debug", "Error", "Critical" };
 
@@ -33,6 +33,9 @@ public:
    static void Debug(const char* format, ...);
    static void Debug(const wchar_t* format, ...);
 
+   // Returns the previous level
+   static LogLevel::Level SetLevel(LogLevel::Level level);
+
 };
 
 
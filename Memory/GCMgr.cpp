@@ -1,15 +1,71 @@
 #include "GCMgr.h"
 
+#include "../HostContext.h"
+#include "../CrstLock.h"
 #include "../Logger.h"
 
 
-SHGCManager::SHGCManager()
+SHGCManager::SHGCManager(HostContext* hostContext)
 {
    m_cRef = 0;
+   this->hostContext = hostContext;
+
+   LARGE_INTEGER frequency;
+   QueryPerformanceFrequency(&frequency);
+   ticksPerSecond = frequency.QuadPart;
+
+   suspensionStart = 0;
+   suspendingThreadId = 0;
+   blockingThreads = 0;
+   ZeroMemory((void*)pauseHistogram, sizeof(pauseHistogram));
+   ZeroMemory((void*)pauseCount, sizeof(pauseCount));
+   ZeroMemory((void*)pauseMicroseconds, sizeof(pauseMicroseconds));
+   recentPausesCount = 0;
+
+   recentPausesCrst = new CRITICAL_SECTION;
+   if (!recentPausesCrst)
+      Logger::Critical("Failed to allocate critical sections");
+   InitializeCriticalSection(recentPausesCrst);
 }
 
 SHGCManager::~SHGCManager()
 {
+   if (recentPausesCrst)
+      DeleteCriticalSection(recentPausesCrst);
+}
+
+static int ClampGeneration(int generation) {
+   if (generation < 0)
+      return 0;
+   if (generation >= GC_GENERATIONS)
+      return GC_GENERATIONS - 1;
+   return generation;
+}
+
+LONG SHGCManager::GetPauseCount(int generation) {
+   return pauseCount[ClampGeneration(generation)];
+}
+
+LONGLONG SHGCManager::GetPauseTime(int generation) {
+   // A 64 bit read is not atomic on x86
+   return InterlockedCompareExchange64(&pauseMicroseconds[ClampGeneration(generation)], 0, 0);
+}
+
+void SHGCManager::GetPauseHistogram(int generation, LONG* buckets) {
+   generation = ClampGeneration(generation);
+   for (int i = 0; i < GC_PAUSE_HISTOGRAM_BUCKETS; ++i)
+      buckets[i] = pauseHistogram[generation][i];
+}
+
+int SHGCManager::GetRecentPauses(GCPauseInfo* pauses, int maxPauses) {
+   CrstLock lock(recentPausesCrst);
+
+   int count = min(maxPauses, min(recentPausesCount, GC_RECENT_PAUSES));
+   if (count < 0)
+      count = 0;
+   for (int i = 0; i < count; ++i)
+      pauses[i] = recentPauses[(recentPausesCount - count + i) & (GC_RECENT_PAUSES - 1)];
+   return count;
 }
 
 // IUnknown functions
@@ -43,17 +99,68 @@ STDMETHODIMP SHGCManager::QueryInterface(const IID &riid, void **ppvObject)
 }
 
 // IHostGCManager functions
+
+// Called on each thread that stops for the suspension (not on the one that suspends)
 STDMETHODIMP SHGCManager::ThreadIsBlockingForSuspension() {
-   Logger::Info("In ThreadIsBlockingForSuspension");
+   LARGE_INTEGER now;
+   QueryPerformanceCounter(&now);
+
+   LONG slot = InterlockedIncrement(&blockingThreads) - 1;
+   if (slot < GC_MAX_BLOCKING_THREADS) {
+      blockingThreadIds[slot] = GetCurrentThreadId();
+      blockingStart[slot] = now.QuadPart;
+   }
    return S_OK;
 }
 
 STDMETHODIMP SHGCManager::SuspensionStarting() {
-   Logger::Info("In SuspensionStarting");
+   LARGE_INTEGER now;
+   QueryPerformanceCounter(&now);
+
+   suspendingThreadId = GetCurrentThreadId();
+   InterlockedExchange(&blockingThreads, 0);
+   suspensionStart = now.QuadPart;
    return S_OK;
 }
 
 STDMETHODIMP SHGCManager::SuspensionEnding(DWORD Generation) {
-   Logger::Info("In SuspensionStarting: Generation %d", Generation);
+   LARGE_INTEGER now;
+   QueryPerformanceCounter(&now);
+
+   int generation = ClampGeneration(Generation);
+   LONGLONG microseconds = (now.QuadPart - suspensionStart) * 1000000 / ticksPerSecond;
+
+   int bucket = 0;
+   while (bucket < GC_PAUSE_HISTOGRAM_BUCKETS - 1 && (microseconds >> bucket) > 0)
+      ++bucket;
+   InterlockedIncrement(&pauseHistogram[generation][bucket]);
+   InterlockedIncrement(&pauseCount[generation]);
+   InterlockedExchangeAdd64(&pauseMicroseconds[generation], microseconds);
+
+   // Each thread lost the time from when it blocked to now; the suspending thread, all of it
+   LONG numBlockingThreads = blockingThreads;
+   int trackedThreads = min(numBlockingThreads, GC_MAX_BLOCKING_THREADS);
+   DWORD threadIds[GC_MAX_BLOCKING_THREADS + 1];
+   LONGLONG blockedMicroseconds[GC_MAX_BLOCKING_THREADS + 1];
+   for (int i = 0; i < trackedThreads; ++i) {
+      threadIds[i] = blockingThreadIds[i];
+      blockedMicroseconds[i] = (now.QuadPart - blockingStart[i]) * 1000000 / ticksPerSecond;
+   }
+   threadIds[trackedThreads] = suspendingThreadId;
+   blockedMicroseconds[trackedThreads] = microseconds;
+   if (hostContext)
+      hostContext->OnGCSuspension(threadIds, blockedMicroseconds, trackedThreads + 1);
+
+   {
+      CrstLock lock(recentPausesCrst);
+      GCPauseInfo& pause = recentPauses[recentPausesCount & (GC_RECENT_PAUSES - 1)];
+      pause.timestamp = suspensionStart * 1000 / ticksPerSecond;
+      pause.duration = (LONG)microseconds;
+      pause.generation = generation;
+      pause.blockingThreads = numBlockingThreads;
+      ++recentPausesCount;
+   }
+
+   Logger::Info("GC suspension ending: generation %d, %d us, %d threads blocked", Generation, (LONG)microseconds, numBlockingThreads);
    return S_OK;
 }
@@ -1,18 +1,63 @@
-
 #ifndef SH_GC_MANAGER_H_INCLUDED
 #define SH_GC_MANAGER_H_INCLUDED
 
 #include "../Common.h"
 
+class HostContext;
+
+// Pause histogram, one per generation: bucket 0 counts pauses under 1 us, bucket i
+// pauses in [2^(i-1), 2^i) us (same buckets as the bind latency histogram)
+const int GC_GENERATIONS = 3;
+const int GC_PAUSE_HISTOGRAM_BUCKETS = 24;
+// Threads blocking for a suspension we keep track of (for per-domain attribution);
+// the ones after these are only counted
+const int GC_MAX_BLOCKING_THREADS = 64;
+// Most recent pauses kept (power of 2)
+const int GC_RECENT_PAUSES = 64;
+
+struct GCPauseInfo {
+   LONGLONG timestamp; // Start of the suspension, QueryPerformanceCounter milliseconds
+   LONG duration; // Microseconds
+   LONG generation;
+   LONG blockingThreads;
+};
+
 class SHGCManager : public IHostGCManager {
 
 private:
    volatile LONG m_cRef;
+   HostContext* hostContext;
+
+   LONGLONG ticksPerSecond;
+
+   // The runtime suspends for one GC at a time: these describe the current suspension
+   LONGLONG suspensionStart;
+   DWORD suspendingThreadId;
+   volatile LONG blockingThreads;
+   DWORD blockingThreadIds[GC_MAX_BLOCKING_THREADS];
+   LONGLONG blockingStart[GC_MAX_BLOCKING_THREADS];
+
+   // Updated with interlocked operations only: readers never block the GC
+   volatile LONG pauseHistogram[GC_GENERATIONS][GC_PAUSE_HISTOGRAM_BUCKETS];
+   volatile LONG pauseCount[GC_GENERATIONS];
+   volatile LONGLONG pauseMicroseconds[GC_GENERATIONS];
+
+   LPCRITICAL_SECTION recentPausesCrst;
+   GCPauseInfo recentPauses[GC_RECENT_PAUSES];
+   LONG recentPausesCount;
 
 public:
-   SHGCManager();
+   SHGCManager(HostContext* hostContext);
    ~SHGCManager();
 
+   // Pause statistics; generation is clamped to [0, GC_GENERATIONS)
+   LONG GetPauseCount(int generation);
+   LONGLONG GetPauseTime(int generation); // Microseconds
+   // Copies GC_PAUSE_HISTOGRAM_BUCKETS counters
+   void GetPauseHistogram(int generation, LONG* buckets);
+   // Copies the last (up to maxPauses) pauses, oldest first; returns how many
+   int GetRecentPauses(GCPauseInfo* pauses, int maxPauses);
+
    // IUnknown functions
    STDMETHODIMP_(DWORD) AddRef();
    STDMETHODIMP_(DWORD) Release();
@@ -25,4 +70,3 @@ public:
 };
 
 #endif //SH_GC_MANAGER_H_INCLUDED
-
@@ -57,9 +57,14 @@ STDMETHODIMP SHMemoryManager::CreateMalloc(DWORD dwMallocType, IHostMalloc **ppM
 STDMETHODIMP SHMemoryManager::VirtualAlloc(void *pAddress, SIZE_T dwSize, DWORD flAllocationType, DWORD flProtect, EMemoryCriticalLevel eCriticalLevel, void **ppMem) {
    DWORD dwThreadId = GetCurrentThreadId();
    
-   Logger::Info("VirtualAlloc: %d bytes, critical level %d", dwSize, eCriticalLevel);
+   Logger::Info("VirtualAlloc: %d bytes, type %x, critical level %d", dwSize, flAllocationType, eCriticalLevel);
 
-   bool belowMemoryLimit = hostContext->OnMemoryAcquiring(dwThreadId, dwSize);
+   // Reserving address space is free: only commits count against the quota of the
+   // committing domain, and only for the pages that are not committed already
+   DWORD appDomainId = hostContext->GetSnippetAppDomain(dwThreadId);
+   bool belowMemoryLimit = true;
+   if (flAllocationType & MEM_COMMIT)
+      belowMemoryLimit = hostContext->OnMemoryCommitting(appDomainId, (LONG)virtualRegions.GetUncommittedBytes(pAddress, dwSize));
 
    *ppMem = NULL;
    if (eCriticalLevel > eTaskCritical || belowMemoryLimit) {
@@ -70,7 +75,9 @@ STDMETHODIMP SHMemoryManager::VirtualAlloc(void *pAddress, SIZE_T dwSize, DWORD
          return HRESULT_FROM_WIN32(errorCode);
       }
       else {
-         hostContext->OnMemoryAcquire(dwThreadId, dwSize, *ppMem);
+         std::vector<VirtualRegionChange> changes;
+         virtualRegions.OnAlloc(*ppMem, dwSize, flAllocationType, appDomainId, changes);
+         hostContext->OnVirtualMemoryChange(changes);
          return S_OK;
       }
    }
@@ -81,9 +88,12 @@ STDMETHODIMP SHMemoryManager::VirtualAlloc(void *pAddress, SIZE_T dwSize, DWORD
 }
 
 STDMETHODIMP SHMemoryManager::VirtualFree(LPVOID lpAddress, SIZE_T dwSize, DWORD dwFreeType) {
-   Logger::Info("VirtualFree: %d bytes", dwSize);
+   Logger::Info("VirtualFree: %d bytes, type %x", dwSize, dwFreeType);
    if (::VirtualFree(lpAddress, dwSize, dwFreeType)) {
-      hostContext->OnMemoryRelease(lpAddress);
+      // A MEM_DECOMMIT gives back just the committed pages in the range
+      std::vector<VirtualRegionChange> changes;
+      virtualRegions.OnFree(lpAddress, dwSize, dwFreeType, changes);
+      hostContext->OnVirtualMemoryChange(changes);
       return S_OK;
    }
    else {
@@ -4,6 +4,7 @@
 
 #include "../Common.h"
 #include "../HostContext.h"
+#include "VirtualRegionMap.h"
 
 class SHMemoryManager : public IHostMemoryManager {
 
@@ -11,6 +12,7 @@ private:
    volatile LONG m_cRef;
    ICLRMemoryNotificationCallback* memoryNotificationCallback;
    HostContext* hostContext;
+   VirtualRegionMap virtualRegions;
 
 public:
    SHMemoryManager(HostContext* context);
@@ -0,0 +1,196 @@
+
+#include "VirtualRegionMap.h"
+#include "../CrstLock.h"
+#include "../Logger.h"
+
+#include <iterator>
+
+VirtualRegionMap::VirtualRegionMap() {
+   SYSTEM_INFO systemInfo;
+   GetSystemInfo(&systemInfo);
+   pageSize = systemInfo.dwPageSize;
+
+   crst = new CRITICAL_SECTION;
+   if (!crst)
+      Logger::Critical("Failed to allocate critical sections");
+   InitializeCriticalSection(crst);
+}
+
+VirtualRegionMap::~VirtualRegionMap() {
+   if (crst)
+      DeleteCriticalSection(crst);
+}
+
+std::map<ULONG_PTR, VirtualRegion>::iterator VirtualRegionMap::FindRegion(ULONG_PTR address) {
+   auto region = regions.upper_bound(address);
+   if (region == regions.begin())
+      return regions.end();
+   --region;
+   return (address < region->second.end) ? region : regions.end();
+}
+
+void VirtualRegionMap::AddChange(std::vector<VirtualRegionChange>& changes, DWORD appDomainId, LONGLONG reservedBytes, LONGLONG committedBytes, LONG regions) {
+   // Few entries (usually one): a linear search is fine
+   for (auto it = changes.begin(); it != changes.end(); ++it) {
+      if (it->appDomainId == appDomainId) {
+         it->reservedBytes += reservedBytes;
+         it->committedBytes += committedBytes;
+         it->regions += regions;
+         return;
+      }
+   }
+   VirtualRegionChange change = { appDomainId, reservedBytes, committedBytes, regions };
+   changes.push_back(change);
+}
+
+SIZE_T VirtualRegionMap::AddInterval(std::map<ULONG_PTR, CommittedRange>& intervals, ULONG_PTR start, ULONG_PTR end, DWORD appDomainId, std::vector<VirtualRegionChange>& changes) {
+   // Pages already committed keep their owner (committing them again is a no-op):
+   // find the gaps in [start, end) first, then fill them
+   std::vector<std::pair<ULONG_PTR, ULONG_PTR> > gaps;
+   ULONG_PTR cursor = start;
+   auto it = intervals.upper_bound(start);
+   if (it != intervals.begin() && std::prev(it)->second.end > start)
+      --it;
+   for (; it != intervals.end() && it->first < end; ++it) {
+      if (it->first > cursor)
+         gaps.push_back(std::make_pair(cursor, it->first));
+      cursor = max(cursor, it->second.end);
+   }
+   if (cursor < end)
+      gaps.push_back(std::make_pair(cursor, end));
+
+   SIZE_T added = 0;
+   for (auto gap = gaps.begin(); gap != gaps.end(); ++gap) {
+      ULONG_PTR gapStart = gap->first;
+      ULONG_PTR gapEnd = gap->second;
+      added += gapEnd - gapStart;
+
+      // Coalesce with the neighbours charged to the same domain
+      auto next = intervals.lower_bound(gapStart);
+      if (next != intervals.end() && next->first == gapEnd && next->second.appDomainId == appDomainId) {
+         gapEnd = next->second.end;
+         next = intervals.erase(next);
+      }
+      if (next != intervals.begin()) {
+         auto previous = std::prev(next);
+         if (previous->second.end == gapStart && previous->second.appDomainId == appDomainId) {
+            previous->second.end = gapEnd;
+            continue;
+         }
+      }
+      CommittedRange range = { gapEnd, appDomainId };
+      intervals.insert(next, std::make_pair(gapStart, range));
+   }
+
+   if (added > 0)
+      AddChange(changes, appDomainId, 0, (LONGLONG)added, 0);
+   return added;
+}
+
+SIZE_T VirtualRegionMap::RemoveInterval(std::map<ULONG_PTR, CommittedRange>& intervals, ULONG_PTR start, ULONG_PTR end, std::vector<VirtualRegionChange>& changes) {
+   SIZE_T removed = 0;
+
+   auto it = intervals.upper_bound(start);
+   if (it != intervals.begin() && std::prev(it)->second.end > start)
+      --it;
+   while (it != intervals.end() && it->first < end) {
+      ULONG_PTR intervalStart = it->first;
+      CommittedRange range = it->second;
+      it = intervals.erase(it);
+
+      SIZE_T bytes = min(range.end, end) - max(intervalStart, start);
+      removed += bytes;
+      AddChange(changes, range.appDomainId, 0, -(LONGLONG)bytes, 0);
+      // Keep what is outside [start, end)
+      if (intervalStart < start) {
+         CommittedRange before = { start, range.appDomainId };
+         intervals[intervalStart] = before;
+      }
+      if (range.end > end) {
+         CommittedRange after = { range.end, range.appDomainId };
+         intervals[end] = after;
+      }
+   }
+   return removed;
+}
+
+SIZE_T VirtualRegionMap::GetUncommittedBytes(PVOID address, SIZE_T size) {
+   ULONG_PTR start = (ULONG_PTR)address & ~(pageSize - 1);
+   ULONG_PTR end = ((ULONG_PTR)address + size + pageSize - 1) & ~(pageSize - 1);
+   if (address == NULL)
+      return end - start; // VirtualAlloc chooses the address: all new
+
+   CrstLock lock(crst);
+   auto region = FindRegion(start);
+   if (region == regions.end())
+      return end - start;
+
+   end = min(end, region->second.end);
+   SIZE_T uncommitted = end - start;
+   const std::map<ULONG_PTR, CommittedRange>& committed = region->second.committed;
+   auto it = committed.upper_bound(start);
+   if (it != committed.begin() && std::prev(it)->second.end > start)
+      --it;
+   for (; it != committed.end() && it->first < end; ++it)
+      uncommitted -= min(it->second.end, end) - max(it->first, start);
+   return uncommitted;
+}
+
+void VirtualRegionMap::OnAlloc(PVOID address, SIZE_T size, DWORD flAllocationType, DWORD appDomainId, std::vector<VirtualRegionChange>& changes) {
+   if ((flAllocationType & (MEM_RESERVE | MEM_COMMIT)) == 0)
+      return; // MEM_RESET and friends: nothing changes state
+
+   // VirtualAlloc works on whole pages
+   ULONG_PTR start = (ULONG_PTR)address & ~(pageSize - 1);
+   ULONG_PTR end = ((ULONG_PTR)address + size + pageSize - 1) & ~(pageSize - 1);
+
+   CrstLock lock(crst);
+
+   auto region = FindRegion(start);
+   if ((flAllocationType & MEM_RESERVE) || region == regions.end()) {
+      // A new region (a commit outside any region we know is treated as reserve + commit)
+      if (region != regions.end()) {
+         Logger::Error("Reserving %x, which is already in region %x: dropping the old one", start, region->first);
+         RemoveInterval(region->second.committed, region->first, region->second.end, changes);
+         AddChange(changes, region->second.appDomainId, -(LONGLONG)(region->second.end - region->first), 0, -1);
+         regions.erase(region);
+      }
+      VirtualRegion newRegion;
+      newRegion.end = end;
+      newRegion.appDomainId = appDomainId;
+      newRegion.committedBytes = 0;
+      region = regions.insert(std::make_pair(start, newRegion)).first;
+      AddChange(changes, appDomainId, (LONGLONG)(end - start), 0, 1);
+   }
+   else {
+      end = min(end, region->second.end);
+   }
+
+   if (flAllocationType & MEM_COMMIT)
+      region->second.committedBytes += AddInterval(region->second.committed, start, end, appDomainId, changes);
+}
+
+void VirtualRegionMap::OnFree(PVOID address, SIZE_T size, DWORD dwFreeType, std::vector<VirtualRegionChange>& changes) {
+   CrstLock lock(crst);
+
+   auto region = FindRegion((ULONG_PTR)address);
+   if (region == regions.end())
+      return; // Not ours (or reserved before we started tracking)
+
+   if (dwFreeType & MEM_RELEASE) {
+      // Always the whole region, whatever the address
+      RemoveInterval(region->second.committed, region->first, region->second.end, changes);
+      AddChange(changes, region->second.appDomainId, -(LONGLONG)(region->second.end - region->first), 0, -1);
+      regions.erase(region);
+   }
+   else if (dwFreeType & MEM_DECOMMIT) {
+      ULONG_PTR start = (ULONG_PTR)address & ~(pageSize - 1);
+      ULONG_PTR end;
+      if (size == 0 && start == region->first)
+         end = region->second.end; // The whole region
+      else
+         end = min(((ULONG_PTR)address + size + pageSize - 1) & ~(pageSize - 1), region->second.end);
+
+      region->second.committedBytes -= RemoveInterval(region->second.committed, start, end, changes);
+   }
+}
@@ -0,0 +1,68 @@
+#ifndef SH_VIRTUAL_REGION_MAP_H_INCLUDED
+#define SH_VIRTUAL_REGION_MAP_H_INCLUDED
+
+#include "../Common.h"
+
+#include <map>
+#include <vector>
+
+// A range of committed pages, and the AppDomain charged for them
+struct CommittedRange {
+   ULONG_PTR end;
+   DWORD appDomainId;
+};
+
+struct VirtualRegion {
+   ULONG_PTR end;
+   // The AppDomain that reserved it (0: the host, or the CLR itself)
+   DWORD appDomainId;
+   SIZE_T committedBytes;
+   // Committed pages, as disjoint [start, end) intervals (coalesced when they have the same owner)
+   std::map<ULONG_PTR, CommittedRange> committed;
+};
+
+// What an allocation or a free did to the accounting of a domain (signed, in bytes)
+struct VirtualRegionChange {
+   DWORD appDomainId;
+   LONGLONG reservedBytes;
+   LONGLONG committedBytes;
+   LONG regions; // +1 for a new reservation, -1 for a release
+};
+
+// The address space the CLR got through IHostMemoryManager::VirtualAlloc: reserved
+// regions, by base address, each one with the page ranges committed in it.
+// Reserved bytes are accounted to the domain that reserved the region. Committed pages
+// are charged to the domain of the thread that committed them, whoever reserved the
+// region: GC segments are reserved once (often by the CLR itself, domain 0) and then
+// grow on whatever thread needs the memory. Pages committed by the host or the CLR
+// threads are not charged to anyone.
+// Decommitting part of a region gives the pages back to whoever was charged for them.
+class VirtualRegionMap {
+private:
+   LPCRITICAL_SECTION crst;
+   std::map<ULONG_PTR, VirtualRegion> regions;
+   ULONG_PTR pageSize;
+
+   // The region that contains address, or regions.end()
+   std::map<ULONG_PTR, VirtualRegion>::iterator FindRegion(ULONG_PTR address);
+
+   // Both return how many bytes actually changed state, and add the per-domain charges to changes
+   static SIZE_T AddInterval(std::map<ULONG_PTR, CommittedRange>& intervals, ULONG_PTR start, ULONG_PTR end, DWORD appDomainId, std::vector<VirtualRegionChange>& changes);
+   static SIZE_T RemoveInterval(std::map<ULONG_PTR, CommittedRange>& intervals, ULONG_PTR start, ULONG_PTR end, std::vector<VirtualRegionChange>& changes);
+   static void AddChange(std::vector<VirtualRegionChange>& changes, DWORD appDomainId, LONGLONG reservedBytes, LONGLONG committedBytes, LONG regions);
+
+public:
+   VirtualRegionMap();
+   ~VirtualRegionMap();
+
+   // How many bytes of [address, address + size) are not committed yet: what a commit
+   // of that range would add
+   SIZE_T GetUncommittedBytes(PVOID address, SIZE_T size);
+
+   // After a successful VirtualAlloc/VirtualFree: adds to changes what happened to each domain.
+   // appDomainId is the domain of the calling thread (0 for the host and the CLR)
+   void OnAlloc(PVOID address, SIZE_T size, DWORD flAllocationType, DWORD appDomainId, std::vector<VirtualRegionChange>& changes);
+   void OnFree(PVOID address, SIZE_T size, DWORD dwFreeType, std::vector<VirtualRegionChange>& changes);
+};
+
+#endif //SH_VIRTUAL_REGION_MAP_H_INCLUDED
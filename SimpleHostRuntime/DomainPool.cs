@@ -25,6 +25,12 @@ namespace SimpleHostRuntime {
       public Thread mainThread;
       public int numberOfUsages;
       public int isAborting;
+      // Host-side heap of the domain after the last snippet, and how many snippets in a row made it grow
+      public long liveBytes;
+      public int growingUsages;
+      public long liveBytesBeforeGrowth;
+      // Identities of the published assemblies run in the domain (bound by name, they stay loaded)
+      public HashSet<string> loadedAssemblies = new HashSet<string>();
    }
 
    public class DomainPool {
@@ -33,6 +39,12 @@ namespace SimpleHostRuntime {
       const int MaxZombies = 20; // How many "zombie" (potentially undead/leaking domains) we tolerate? (0 = infinite)
       const int NumberOfDomainsInPool = 1;
       const int runningThreshold = 3 * 1000; // In milliseconds
+      const int HousekeepingInterval = 10 * 1000; // In milliseconds; timeouts and Exit do not depend on it
+      const int HotSnippetRuns = 2; // Snippets submitted at least this many times are JITted in advance in new domains
+      const int MaxWarmUpAssemblies = 16;
+      const int MaxHostEventsPerCall = 32; // Host messages the watchdog takes with a single call
+      const int HeapGrowthUsages = 5; // Recycle a domain whose heap grew after this many snippets in a row..
+      const long HeapGrowthThreshold = 4 * 1024 * 1024; // ..by this many bytes overall (0 = never)
 
       // Using separate arrays may improve efficiency, especially if 
       // we want to go (later) for a lock-free approach.
@@ -40,7 +52,6 @@ namespace SimpleHostRuntime {
       PooledDomainData[] poolDomains = new PooledDomainData[NumberOfDomainsInPool];
 
       static string threadsExaustedAbortToken = "AbortTooManyThreads";
-      static string timeoutAbortToken = "AbortTimeout";
 
       Thread watchdogThread;
       BlockingCollection<SnippetInfo> snippetsQueue = new BlockingCollection<SnippetInfo>();
@@ -97,70 +108,57 @@ namespace SimpleHostRuntime {
 
       private void WatchdogThreadFunc() {
 
-         while (!isExiting) {
+         HostEvent[] hostEvents = new HostEvent[MaxHostEventsPerCall];
 
-            // This is a watchdog; it does not need to be precise.
-            // It can be improved by recomputing the next check time (i.e. when a snippet expires)
-            // at each submission, but for now we are good.
+         while (!isExiting) {
 
-            // We sleep for a while, than check 
+            // The host owns the snippet deadlines (armed by SnippetStarted), and tells us
+            // with a Timeout message when one expires (give or take a system timer tick,
+            // ~15.6 ms: see TimerWheel.h): we only wake up for messages.
+            // Without messages, we wake up now and then just to check the health of the pool.
             try {
-               //Thread.Sleep(1000);
-               HostEvent hostEvent;
-               if (defaultDomainManager.GetHostMessage(1000, out hostEvent)) {
-                  System.Diagnostics.Debug.WriteLine("Watchdog: message from host for AppDomain " + hostEvent.appDomainId);
-                  // Process event
-                  switch ((HostEventType)hostEvent.eventType) {
-                     case HostEventType.OutOfTasks: {
-                           PooledDomainData poolDomain = FindByAppDomainId(hostEvent.appDomainId);
-                           if (poolDomain != null) {
-                              if (Interlocked.CompareExchange(ref poolDomain.isAborting, 1, 0) == 0) {
-                                 poolDomain.mainThread.Abort(threadsExaustedAbortToken);
+               // A burst of messages (e.g. OutOfTasks from many domains) is taken in a single call
+               int eventCount = defaultDomainManager.GetHostMessages(HousekeepingInterval, hostEvents);
+               if (eventCount > 0) {
+                  long receiveTime = StopwatchExtensions.GetTimestampMillis();
+                  for (int e = 0; e < eventCount; ++e) {
+                     HostEvent hostEvent = hostEvents[e];
+                     System.Diagnostics.Debug.WriteLine("Watchdog: message #{0} from host for AppDomain {1} (queued for {2} ms)", 
+                        hostEvent.sequenceNumber, hostEvent.appDomainId, receiveTime - hostEvent.timestamp);
+                     // Process event
+                     switch ((HostEventType)hostEvent.eventType) {
+                        case HostEventType.OutOfTasks: {
+                              PooledDomainData poolDomain = FindByAppDomainId(hostEvent.appDomainId);
+                              if (poolDomain != null) {
+                                 if (Interlocked.CompareExchange(ref poolDomain.isAborting, 1, 0) == 0) {
+                                    poolDomain.mainThread.Abort(threadsExaustedAbortToken);
+                                 }
                               }
                            }
-                        }
-                        break;
+                           break;
+
+                        case HostEventType.Timeout:
+                           // The host aborted the snippet (or unloaded its domain) on its own; the pool
+                           // thread learns what happened from SnippetEnded
+                           System.Diagnostics.Debug.WriteLine("Timeout: host enforced the deadline in domain {0}", hostEvent.appDomainId);
+                           break;
+                     }
                   }
                }
                else {
-                  long currentTime = StopwatchExtensions.GetTimestampMillis();
-                  //System.Diagnostics.Debug.WriteLine("Watchdog: check at " + currentTime);
-
                   for (int i = 0; i < NumberOfDomainsInPool; ++i) {
-                     // Something is running?
                      PooledDomainData poolDomain = null;
                      lock (poolLock) {
                         poolDomain = poolDomains[i];
                      }
 
-                     if (poolDomain != null) {
-                        long snippetStartTime = Thread.VolatileRead(ref poolDomain.timeOfSubmission);
-                        if (snippetStartTime > 0) {
-                           // For too long?
-                           long millisRunning = currentTime - snippetStartTime;
-                           if (millisRunning > runningThreshold) {
-                              // Abort Thread i / Unload domain i
-                              // Calling abort here is fine: the host will escalate it for us if it times
-                              // out. Otherwise, we can still catch it and reuse the AppDomain
-                              System.Diagnostics.Debug.WriteLine("Timeout: aborting thread #{0} in domain {1} ({2} ms)", i, poolDomains[i].domainId, millisRunning);
-
-                              // Avoid to call Abort twice
-                              Thread.VolatileWrite(ref poolDomains[i].timeOfSubmission, 0);
-                              poolDomains[i].mainThread.Abort(timeoutAbortToken);
-                           }
-                           // Check also for appDomain.MonitoringTotalProcessorTime
-                           //else if (poolDomains[i].appDomain.MonitoringTotalProcessorTime > MaxCpuTime)
-                           //   //TODO
-                           //}
-                        }
-
-                        // If our thread was aborted rudely, we need to create a new one
-                        if (poolDomain.mainThread == null || poolDomain.mainThread.ThreadState == System.Threading.ThreadState.Aborted) {
-                           defaultDomainManager.HostUnloadDomain(poolDomain.domainId);
-                           poolDomains[i] = new PooledDomainData();
-                           var thread = CreateDomainThread(i);
-                           thread.Start();
-                        }
+                     // If our thread was aborted rudely, we need to create a new one
+                     if (poolDomain != null && 
+                         (poolDomain.mainThread == null || poolDomain.mainThread.ThreadState == System.Threading.ThreadState.Aborted)) {
+                        defaultDomainManager.HostUnloadDomain(poolDomain.domainId);
+                        poolDomains[i] = new PooledDomainData();
+                        var thread = CreateDomainThread(i);
+                        thread.Start();
                      }
                   }
                }
@@ -182,6 +180,9 @@ namespace SimpleHostRuntime {
          // CompleteAdding will make threads in our pool to exit
          isExiting = true;
          snippetsQueue.CompleteAdding();
+         // The watchdog may be waiting for host messages (up to HousekeepingInterval):
+         // that wait is native and not alertable, so Interrupt alone would not wake it up
+         defaultDomainManager.CloseHostMessages();
          watchdogThread.Interrupt();
          watchdogThread.Join();
       }
@@ -215,6 +216,77 @@ namespace SimpleHostRuntime {
          }
       }      
 
+      // Bucket 0 is < 1 us, bucket i is [2^(i-1), 2^i) us
+      private static string FormatLatencyHistogram(int[] buckets) {
+         var builder = new StringBuilder();
+         for (int i = 0; i < buckets.Length; ++i) {
+            if (buckets[i] == 0)
+               continue;
+            if (i == 0)
+               builder.AppendFormat("<1us: {0} ", buckets[i]);
+            else
+               builder.AppendFormat("{0}-{1}us: {2} ", 1L << (i - 1), 1L << i, buckets[i]);
+         }
+         return builder.ToString();
+      }
+
+      // Updates the heap trend of the domain with its size after a snippet
+      private static bool IsHeapGrowing(PooledDomainData domainData, long liveBytes) {
+         if (liveBytes > domainData.liveBytes) {
+            if (domainData.growingUsages == 0)
+               domainData.liveBytesBeforeGrowth = domainData.liveBytes;
+            ++domainData.growingUsages;
+         }
+         else {
+            domainData.growingUsages = 0;
+         }
+         domainData.liveBytes = liveBytes;
+
+         return HeapGrowthThreshold > 0 &&
+            domainData.growingUsages >= HeapGrowthUsages &&
+            liveBytes - domainData.liveBytesBeforeGrowth >= HeapGrowthThreshold;
+      }
+
+      private void CompleteSubmission(SnippetInfo snippet, SnippetResult result) {
+         if (!String.IsNullOrEmpty(snippet.submissionId)) {
+            var completion = submissionMap[snippet.submissionId];
+            // TCS is thread-safe (can be called cross-thread)
+            completion.TrySetResult(result);
+         }
+      }
+
+      // Creates (and warms up) the sandbox domain of a pool thread, on that thread
+      private AppDomain CreatePoolDomain(PooledDomainData myPoolDomain) {
+         long workingSetBefore = Environment.WorkingSet;
+         var creationWatch = Stopwatch.StartNew();
+         var appDomain = AppDomainHelpers.CreateSandbox("Host Sandbox");
+         var manager = (SimpleHostAppDomainManager)appDomain.DomainManager;
+         System.Diagnostics.Debug.WriteLine("Domain {0} created in {1} ms; {2} binds, {3} ms binding", appDomain.Id, creationWatch.Elapsed.TotalMilliseconds,
+            defaultDomainManager.GetBindCount(appDomain.Id), defaultDomainManager.GetBindTime(appDomain.Id) / 1000.0);
+         // Compare with and without --loader-optimization multi: shared host assemblies cost less per domain
+         System.Diagnostics.Debug.WriteLine("Domain {0} working set: +{1} KB (process), {2} KB survived in domain", appDomain.Id,
+            (Environment.WorkingSet - workingSetBefore) / 1024, appDomain.MonitoringSurvivedMemorySize / 1024);
+         System.Diagnostics.Debug.WriteLine("Bind latencies: " + FormatLatencyHistogram(defaultDomainManager.GetBindLatencyHistogram()));
+         for (int generation = 0; generation < 3; ++generation) {
+            System.Diagnostics.Debug.WriteLine("GC gen {0}: {1} pauses, {2} ms; " + FormatLatencyHistogram(defaultDomainManager.GetGCPauseHistogram(generation)), 
+               generation, defaultDomainManager.GetGCCount(generation), defaultDomainManager.GetGCPauseTime(generation) / 1000.0);
+         }
+
+         // A recycled domain would JIT hot snippets again at their next run: do it now, before taking work
+         var hotAssemblies = defaultDomainManager.GetHotAssemblies(HotSnippetRuns, MaxWarmUpAssemblies);
+         if (hotAssemblies.Length > 0) {
+            var warmUpWatch = Stopwatch.StartNew();
+            int preparedMethods = manager.WarmUp(appDomain, hotAssemblies);
+            System.Diagnostics.Debug.WriteLine("Domain {0} warmed up: {1} assemblies, {2} methods in {3} ms", appDomain.Id, hotAssemblies.Length,
+               preparedMethods, warmUpWatch.Elapsed.TotalMilliseconds);
+         }
+
+         lock (poolLock) {
+            myPoolDomain.domainId = appDomain.Id;
+         }
+         return appDomain;
+      }
+
       private Thread CreateDomainThread(int threadIndex) {
          System.Diagnostics.Debug.WriteLine("CreateDomainThread: " + threadIndex);
 
@@ -224,12 +296,8 @@ namespace SimpleHostRuntime {
             Interlocked.Increment(ref numberOfThreadsInPool);
             // Here we enforce the "one domain, one thread" relationship
             try {
-               var appDomain = AppDomainHelpers.CreateSandbox("Host Sandbox");
-               var manager = (SimpleHostAppDomainManager)appDomain.DomainManager;               
-
-               lock (poolLock) {                  
-                  myPoolDomain.domainId = appDomain.Id;
-               }
+               var appDomain = CreatePoolDomain(myPoolDomain);
+               var manager = (SimpleHostAppDomainManager)appDomain.DomainManager;
 
                while (!snippetsQueue.IsCompleted) {
                   defaultDomainManager.ResetContextFor(myPoolDomain);
@@ -253,15 +321,37 @@ namespace SimpleHostRuntime {
                      bool recycleDomain = false;
 
                      try {
+                        // Only the name crosses the AppDomain boundary, if we can
+                        string assemblyName = defaultDomainManager.PublishAssembly(snippetToRun.assemblyFile);
+                        byte[] assemblyFile = (assemblyName == null) ? snippetToRun.assemblyFile : null;
+
+                        if (assemblyName != null && !myPoolDomain.loadedAssemblies.Add(assemblyName)) {
+                           // Load would give us back the Assembly of a previous run: its statics, and its
+                           // static constructors already run. Replace the domain before running it again
+                           System.Diagnostics.Debug.WriteLine("Domain {0} already ran {1}: replacing it", myPoolDomain.domainId, assemblyName);
+                           int usedDomainId = myPoolDomain.domainId;
+                           appDomain = CreatePoolDomain(myPoolDomain);
+                           manager = (SimpleHostAppDomainManager)appDomain.DomainManager;
+                           defaultDomainManager.HostUnloadDomain(usedDomainId);
+
+                           myPoolDomain.numberOfUsages = 0;
+                           myPoolDomain.liveBytes = 0;
+                           myPoolDomain.growingUsages = 0;
+                           myPoolDomain.loadedAssemblies.Clear();
+                           myPoolDomain.loadedAssemblies.Add(assemblyName);
+                           defaultDomainManager.ResetContextFor(myPoolDomain);
+                        }
+
                         Interlocked.Increment(ref myPoolDomain.numberOfUsages);
                         // Record when we started
                         long startTimestamp = StopwatchExtensions.GetTimestampMillis();
                         System.Diagnostics.Debug.WriteLine("Starting execution at " + startTimestamp);
                         Thread.VolatileWrite(ref myPoolDomain.timeOfSubmission, startTimestamp);
+                        defaultDomainManager.SnippetStarted(myPoolDomain.domainId, runningThreshold);
 
                         // Thread transitions into the AppDomain
                         // This function DOES NOT throw
-                        result = manager.InternalRun(appDomain, snippetToRun.assemblyFile, snippetToRun.mainTypeName, snippetToRun.methodName, true);
+                        result = manager.InternalRun(appDomain, assemblyName, assemblyFile, snippetToRun.mainTypeName, snippetToRun.methodName, true);
 
 
                         // ...back to the main AppDomain
@@ -276,12 +366,8 @@ namespace SimpleHostRuntime {
                         result.exception = ex.Message;
 
                         // It may be possible to use this domain again, otherwise we will recycle
-                        if (Object.Equals(ex.ExceptionState, timeoutAbortToken)) {
-                           // The abort was issued by us because we timed out
-                           System.Diagnostics.Debug.WriteLine("Thread Abort due to timeout");
-                           result.status = SnippetStatus.Timeout;                           
-                        }
-                        else if (Object.Equals(ex.ExceptionState, threadsExaustedAbortToken)) {
+                        // (host aborts on timeout have no ExceptionState: see SnippetEnded below)
+                        if (Object.Equals(ex.ExceptionState, threadsExaustedAbortToken)) {
                            System.Diagnostics.Debug.WriteLine("Thread Abort due to thread exaustion");
                            result.status = SnippetStatus.ResourceError;
                         }
@@ -320,9 +406,40 @@ namespace SimpleHostRuntime {
                      // for us
                      // TODO: check that AppDomain.DomainUnload is called anyway!                     
 
+                     // Disarm the host deadline, whatever the outcome, and see if the host enforced it.
+                     // The deadline may have expired while the snippet was returning: SnippetEnded then waits
+                     // for the host abort, which hits us here, back in the default domain. It is ours: absorb it
+                     SnippetTimeoutAction timeoutAction;
+                     try {
+                        timeoutAction = defaultDomainManager.SnippetEnded(myPoolDomain.domainId);
+                     }
+                     catch (ThreadAbortException) {
+                        System.Diagnostics.Debug.WriteLine("Host abort delivered after the snippet ended");
+                        Thread.ResetAbort();
+                        timeoutAction = SnippetTimeoutAction.Abort;
+                     }
+                     if (timeoutAction != SnippetTimeoutAction.None) {
+                        System.Diagnostics.Debug.WriteLine("Snippet timed out ({0} by the host)", timeoutAction);
+                        result.status = SnippetStatus.Timeout;
+                        // An abort on timeout is ours: the domain can be used again
+                        recycleDomain = false;
+                     }
+                     if (timeoutAction == SnippetTimeoutAction.Unload) {
+                        // The domain is gone already: return the result and leave the pool
+                        CompleteSubmission(snippetToRun, result);
+                        Interlocked.Decrement(ref numberOfThreadsInPool);
+                        lock (poolLock) {
+                           if (poolDomains[threadIndex] == myPoolDomain)
+                              poolDomains[threadIndex] = null;
+                        }
+                        return;
+                     }
+
                      // Before looping, check if we are OK; we reuse the domain only if we are not leaking
-                     int threadsInDomain = defaultDomainManager.GetThreadCount(appDomain.Id);
-                     int memoryUsage = defaultDomainManager.GetMemoryUsage(appDomain.Id);
+                     DomainSnapshot snapshot;
+                     defaultDomainManager.GetDomainSnapshot(appDomain.Id, out snapshot);
+                     int threadsInDomain = snapshot.threads;
+                     int binds = defaultDomainManager.GetBindCount(appDomain.Id);
 
                      System.Diagnostics.Debug.WriteLine("============= AppDomain {0} =============", appDomain.Id);
                      System.Diagnostics.Debug.WriteLine("Finished in: {0}", result.executionTime);
@@ -330,7 +447,12 @@ namespace SimpleHostRuntime {
                      if (result.exception != null)
                         System.Diagnostics.Debug.WriteLine("Exception: " + result.exception);
                      System.Diagnostics.Debug.WriteLine("Threads: {0}", threadsInDomain);
-                     System.Diagnostics.Debug.WriteLine("Memory: {0}", memoryUsage);
+                     System.Diagnostics.Debug.WriteLine("Memory: {0} (peak {1}), {2} allocations", snapshot.bytes, snapshot.peakBytes, snapshot.allocs);
+                     System.Diagnostics.Debug.WriteLine("Peak threads: {0}, allocation rate: {1} bytes/s", snapshot.peakThreads, snapshot.allocationRate);
+                     System.Diagnostics.Debug.WriteLine("Domain heap: {0} bytes live, {1} bytes in {2} allocations since creation", snapshot.liveBytes, snapshot.totalBytes, snapshot.totalAllocs);
+                     System.Diagnostics.Debug.WriteLine("CPU: {0} us, waiting: {1} us, stopped by GC: {2} us", snapshot.cpuTime, snapshot.waitTime, snapshot.gcTime);
+                     System.Diagnostics.Debug.WriteLine("I/O: {0} bytes, {1} operations", snapshot.ioBytes, snapshot.ioOperations);
+                     System.Diagnostics.Debug.WriteLine("Binds: {0}", binds);
                      System.Diagnostics.Debug.WriteLine("========================================");
 
                      if (threadsInDomain > 1) {
@@ -349,13 +471,15 @@ namespace SimpleHostRuntime {
                         // Same if the domain is too old
                         recycleDomain = true;
                      } 
+                     else if (IsHeapGrowing(myPoolDomain, snapshot.liveBytes)) {
+                        System.Diagnostics.Debug.WriteLine("Domain heap keeps growing");
+
+                        // Or if snippets keep leaving memory behind
+                        recycleDomain = true;
+                     }
                    
                      // Return the result to the caller
-                     if (!String.IsNullOrEmpty(snippetToRun.submissionId)) {
-                        var completion = submissionMap[snippetToRun.submissionId];
-                        // TCS is thread-safe (can be called cross-thread)
-                        completion.TrySetResult(result);
-                     }
+                     CompleteSubmission(snippetToRun, result);
 
                      if (recycleDomain) {
                         System.Diagnostics.Debug.WriteLine("Recycling domain...");
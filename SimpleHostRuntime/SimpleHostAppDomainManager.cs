@@ -4,8 +4,10 @@ using System.Collections.Generic;
 using System.Diagnostics;
 using System.Linq;
 using System.Reflection;
+using System.Runtime.CompilerServices;
 using System.Runtime.InteropServices;
 using System.Security;
+using System.Security.Cryptography;
 using System.Security.Permissions;
 using System.Security.Policy;
 using System.Text;
@@ -26,7 +28,15 @@ namespace SimpleHostRuntime {
    public enum HostEventType {
       None = 0,
       OutOfTasks = 1,
-      OutOfMemory = 2
+      OutOfMemory = 2,
+      Timeout = 3
+   }
+
+   // What the host did to a snippet that went past its deadline
+   public enum SnippetTimeoutAction {
+      None = 0,
+      Abort = 1, // Its thread was aborted
+      Unload = 2 // It did not stop in time: its AppDomain was unloaded
    }
 
    [ComVisible(true), Guid("057732A2-6120-40B9-A65E-9B045A1C0CBB")]
@@ -34,6 +44,41 @@ namespace SimpleHostRuntime {
       public int eventType; //HostEventType
       public int appDomainId;
       public int managedThreadId;
+      public int sequenceNumber; // Position in the host queue: tells the order (and gaps) of messages
+      public long timestamp; // When it was posted, in StopwatchExtensions.GetTimestampMillis units
+   }
+
+   // The resource usage of a snippet AppDomain, read by the host in one go.
+   // Times are in microseconds, since the last ResetCountersForAppDomain
+   [ComVisible(true), Guid("6E1C0B1F-5F8B-4C52-9A57-0D2E7A4B93C6")]
+   public struct DomainSnapshot {
+      public int appDomainId;
+      public int threads;
+      public int bytes;
+      public int peakBytes;
+      public int allocs;
+      public int workItemsPending;
+      public long ioBytes;
+      public int ioOperations;
+      public long cpuTime; // User + kernel time of the domain threads
+      public long waitTime; // Time the domain threads spent blocked in host waits
+      public int peakThreads;
+      public long allocationRate; // Bytes per second, over the last 2 seconds
+      // Since the domain was created (not reset between snippets)
+      public long totalBytes;
+      public int totalAllocs;
+      public long liveBytes; // Allocated and not yet released: the host-side heap of the domain
+      public long reservedBytes; // Address space reserved (bytes counts only what is committed)
+      public long gcTime; // Time the domain threads were stopped by GC suspensions
+   }
+
+   // A GC suspension, as seen by the host
+   [ComVisible(true), Guid("C3F0A8D2-41B7-4E6A-8D95-27B6E1F05A4C")]
+   public struct GCPause {
+      public long timestamp; // When it started, in StopwatchExtensions.GetTimestampMillis units
+      public int duration; // In microseconds
+      public int generation;
+      public int blockingThreads; // Threads that had to stop for it
    }
 
    [ComVisible(true), Guid("2AF95991-AF3E-4192-B1AC-8FD254E087F3")]
@@ -46,6 +91,45 @@ namespace SimpleHostRuntime {
       void UnloadDomain(int appDomainId);
 
       bool GetLastMessage(int millisecondsTimeout, out HostEvent hostEvent);
+      // Waits for the first message, then fills hostEvents with the ones already queued.
+      // Returns how many were written.
+      int GetMessages(int millisecondsTimeout, int maxEvents, 
+                      [In, Out, MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 1)] HostEvent[] hostEvents);
+      // Wakes up a GetLastMessage/GetMessages waiting for messages, and makes the next ones
+      // return at once (the wait is not alertable: Thread.Interrupt does not reach it)
+      void CloseMessages();
+
+      // Arms/cancels the host deadline for the snippet running in the domain. At expiry, the
+      // host aborts the snippet thread (unloads the domain, if that is not enough) and posts a Timeout message
+      void SnippetStarted(int appDomainId, int timeoutMilliseconds);
+      int SnippetEnded(int appDomainId); // SnippetTimeoutAction
+
+      long GetIoBytes(int appDomainId);
+      int GetIoOperations(int appDomainId);
+
+      // All the counters of a domain, read under one lock. Returns false if the domain is unknown
+      bool GetDomainSnapshot(int appDomainId, out DomainSnapshot snapshot);
+      // Fills snapshots with (up to maxDomains) snippet domains. Returns how many were written
+      int GetDomainSnapshots(int maxDomains, 
+                             [In, Out, MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 0)] DomainSnapshot[] snapshots,
+                             out int numberOfZombies);
+
+      string RegisterAssembly(byte[] assemblyImage);
+      bool IsAssemblyRegistered(string fullName);
+
+      int GetBindCount(int appDomainId);
+      long GetBindTime(int appDomainId); // In microseconds
+      int[] GetBindLatencyHistogram();
+
+      // GC suspensions, by generation (0-2)
+      int GetGCCount(int generation);
+      long GetGCPauseTime(int generation); // In microseconds
+      int[] GetGCPauseHistogram(int generation); // Same buckets as GetBindLatencyHistogram
+      // The most recent suspensions (up to 64), oldest first. Returns how many were written
+      int GetRecentGCPauses(int maxPauses, 
+                            [In, Out, MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 0)] GCPause[] pauses);
+
+      bool IsDomainNeutralLoading();
    }
 
    [ComVisible(true), Guid("A603EC84-3449-47B9-BCF5-391C628067D6")]
@@ -76,6 +160,16 @@ namespace SimpleHostRuntime {
 
       static IHostContext hostContext = null;
       static DomainPool domainPool = null;
+      // Assemblies loaded by name are shared by all domains, and never unloaded
+      static bool domainNeutralLoading = false;
+
+      // Snippet assemblies published in the host store, by content hash (null: cannot be published),
+      // and content hash by identity (null: the identity was used by different assemblies)
+      static Dictionary<string, string> identityByHash = new Dictionary<string, string>();
+      static Dictionary<string, string> hashByIdentity = new Dictionary<string, string>();
+      // How many times each published assembly was submitted, by content hash
+      static Dictionary<string, int> runsByHash = new Dictionary<string, int>();
+      static object publishedAssembliesLock = new object();
       public event Action<int> DomainUnload;
       public event Action<int, Exception> FirstChanceException;
       public event Action<int, Object> UnhandledException;
@@ -152,6 +246,7 @@ namespace SimpleHostRuntime {
          // and only once
          Debug.Assert(domainPool == null);
          SimpleHostAppDomainManager.hostContext = hostContext;
+         SimpleHostAppDomainManager.domainNeutralLoading = hostContext.IsDomainNeutralLoading();
          SimpleHostAppDomainManager.domainPool = new DomainPool(this);
       }     
  
@@ -202,6 +297,14 @@ namespace SimpleHostRuntime {
          return hostContext.GetLastMessage(millisecondsTimeout, out hostEvent);
       }
 
+      internal int GetHostMessages(int millisecondsTimeout, HostEvent[] hostEvents) {
+         return hostContext.GetMessages(millisecondsTimeout, hostEvents.Length, hostEvents);
+      }
+
+      internal void CloseHostMessages() {
+         hostContext.CloseMessages();
+      }
+
       public void OnMainThreadExit(int appDomainId, bool cleanExit) {
          // This is one alternative: we let the main thread exit, and we check if it exited cleanly.
          // This puts (asks) more control in the hands of the Host
@@ -243,8 +346,111 @@ namespace SimpleHostRuntime {
       //   get { return new SimpleHostSecurityManager(); }
       //}
 
+      // Publishes the assembly in the host store (once per content), so snippet domains can load it
+      // by name and bind a stream over the host copy, instead of receiving the whole image at every run.
+      // Returns the assembly full name, or null if the assembly must be loaded from its bytes.
+      internal string PublishAssembly(byte[] assembly) {
+         // A snippet loaded domain-neutral would stay in the process after its domain is recycled
+         if (domainNeutralLoading)
+            return null;
+
+         string hash;
+         using (var sha1 = new SHA1Managed()) {
+            hash = Convert.ToBase64String(sha1.ComputeHash(assembly));
+         }
+
+         lock (publishedAssembliesLock) {
+            int runs;
+            runsByHash.TryGetValue(hash, out runs);
+            runsByHash[hash] = runs + 1;
+
+            string fullName;
+            if (identityByHash.TryGetValue(hash, out fullName)) {
+               if (fullName == null || hashByIdentity[fullName] == null)
+                  return null;
+               // It may have been evicted from the store
+               if (hostContext.IsAssemblyRegistered(fullName))
+                  return fullName;
+            }
+
+            try {
+               fullName = hostContext.RegisterAssembly(assembly);
+            }
+            catch (COMException ex) {
+               System.Diagnostics.Debug.WriteLine("Cannot publish assembly: " + ex.Message);
+               identityByHash[hash] = null;
+               return null;
+            }
+
+            identityByHash[hash] = fullName;
+            string publishedHash;
+            if (hashByIdentity.TryGetValue(fullName, out publishedHash) && publishedHash != hash) {
+               // Same identity, different bytes: a domain that already loaded the other one would
+               // get it back from Load(fullName). Load both from their bytes from now on.
+               hashByIdentity[fullName] = null;
+               return null;
+            }
+            hashByIdentity[fullName] = hash;
+            return fullName;
+         }
+      }
+
+      // The published assemblies submitted at least minRuns times, most submitted first
+      internal string[] GetHotAssemblies(int minRuns, int maxAssemblies) {
+         lock (publishedAssembliesLock) {
+            return runsByHash.Where(r => r.Value >= minRuns)
+               .OrderByDescending(r => r.Value)
+               .Select(r => {
+                  string fullName;
+                  identityByHash.TryGetValue(r.Key, out fullName);
+                  return fullName;
+               })
+               .Where(fullName => fullName != null && hashByIdentity[fullName] != null && hostContext.IsAssemblyRegistered(fullName))
+               .Take(maxAssemblies)
+               .ToArray();
+         }
+      }
+
+      // Loads the assemblies (through the host store) and JITs all their methods in this domain,
+      // so a snippet from one of them finds its code already compiled. Runs no snippet code.
+      // Returns the number of methods prepared
+      internal int WarmUp(AppDomain appDomain, string[] assemblyNames) {
+         int preparedMethods = 0;
+         (new PermissionSet(PermissionState.Unrestricted)).Assert();
+         try {
+            foreach (var assemblyName in assemblyNames) {
+               try {
+                  var assembly = appDomain.Load(assemblyName);
+                  foreach (var type in assembly.GetTypes()) {
+                     if (type.ContainsGenericParameters)
+                        continue;
+                     var methods = type.GetMethods(BindingFlags.Public | BindingFlags.NonPublic | BindingFlags.Static | BindingFlags.Instance | BindingFlags.DeclaredOnly);
+                     foreach (var method in methods) {
+                        if (method.IsAbstract || method.ContainsGenericParameters)
+                           continue;
+                        try {
+                           RuntimeHelpers.PrepareMethod(method.MethodHandle);
+                           ++preparedMethods;
+                        }
+                        catch (Exception) {
+                           // Not every method can be prepared upfront; it will be JITted when called
+                        }
+                     }
+                  }
+               }
+               catch (Exception ex) {
+                  System.Diagnostics.Debug.WriteLine("WarmUp - cannot load " + assemblyName + ": " + ex.Message);
+               }
+            }
+         }
+         finally {
+            CodeAccessPermission.RevertAssert();
+         }
+         return preparedMethods;
+      }
+
       //[SecuritySafeCritical]
-      internal SnippetResult InternalRun(AppDomain appDomain, byte[] assembly, string mainTypeName, string methodName,
+      internal SnippetResult InternalRun(AppDomain appDomain, string assemblyName, byte[] assembly, string mainTypeName, string methodName,
                                          bool runningInSandbox) {
 
          // Here we already are on the new domain
@@ -256,7 +462,10 @@ namespace SimpleHostRuntime {
             // When loading the assembly, we need at least FileIOPermission. 
             // Calling it with a full-trust stack. TODO: only what is needed
             (new PermissionSet(PermissionState.Unrestricted)).Assert();
-            var clientAssembly = appDomain.Load(assembly);
+            // Published assemblies are bound through the host store (ProvideAssembly).
+            // A domain gets back the assembly it already loaded, statics included: the pool never runs
+            // the same published identity twice in a domain (see DomainPool)
+            var clientAssembly = (assemblyName != null) ? appDomain.Load(assemblyName) : appDomain.Load(assembly);
             //var clientAssembly = Assembly.Load(assembly, null, SecurityContextSource.CurrentAppDomain);
             //AssemblyName an = AssemblyName.GetAssemblyName(assemblyFileName);
             //var clientAssembly = appDomain.Load(an);            
@@ -322,6 +531,14 @@ namespace SimpleHostRuntime {
          return result;
       }
 
+      internal void SnippetStarted(int appDomainId, int timeoutMilliseconds) {
+         hostContext.SnippetStarted(appDomainId, timeoutMilliseconds);
+      }
+
+      internal SnippetTimeoutAction SnippetEnded(int appDomainId) {
+         return (SnippetTimeoutAction)hostContext.SnippetEnded(appDomainId);
+      }
+
       internal int GetThreadCount(int appDomainId) {
          return hostContext.GetThreadCount(appDomainId);
       }
@@ -339,6 +556,50 @@ namespace SimpleHostRuntime {
          return hostContext.GetMemoryUsage(appDomainId);
       }
 
+      internal long GetIoBytes(int appDomainId) {
+         return hostContext.GetIoBytes(appDomainId);
+      }
+
+      internal int GetIoOperations(int appDomainId) {
+         return hostContext.GetIoOperations(appDomainId);
+      }
+
+      internal bool GetDomainSnapshot(int appDomainId, out DomainSnapshot snapshot) {
+         return hostContext.GetDomainSnapshot(appDomainId, out snapshot);
+      }
+
+      internal int GetDomainSnapshots(DomainSnapshot[] snapshots, out int numberOfZombies) {
+         return hostContext.GetDomainSnapshots(snapshots.Length, snapshots, out numberOfZombies);
+      }
+
+      internal int GetBindCount(int appDomainId) {
+         return hostContext.GetBindCount(appDomainId);
+      }
+
+      internal long GetBindTime(int appDomainId) {
+         return hostContext.GetBindTime(appDomainId);
+      }
+
+      internal int[] GetBindLatencyHistogram() {
+         return hostContext.GetBindLatencyHistogram();
+      }
+
+      internal int GetGCCount(int generation) {
+         return hostContext.GetGCCount(generation);
+      }
+
+      internal long GetGCPauseTime(int generation) {
+         return hostContext.GetGCPauseTime(generation);
+      }
+
+      internal int[] GetGCPauseHistogram(int generation) {
+         return hostContext.GetGCPauseHistogram(generation);
+      }
+
+      internal int GetRecentGCPauses(GCPause[] pauses) {
+         return hostContext.GetRecentGCPauses(pauses.Length, pauses);
+      }
+
       internal void HostUnloadDomain(int appDomainId) {
          hostContext.UnloadDomain(appDomainId);
       }
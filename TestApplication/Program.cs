@@ -244,9 +244,101 @@ namespace TestApplication {
       }
 
 
+      //- try to use a lot of "file" (handle-based) async operations (*)
+      public static void SnippetTest25() {
+         const int pipeCount = 16;
+         const int messagesPerPipe = 1000;
+         var tasks = new List<Task>();
+         for (int p = 0; p < pipeCount; ++p) {
+            var pipeName = "SnippetTest25_" + Guid.NewGuid().ToString("N");
+            var server = new System.IO.Pipes.NamedPipeServerStream(pipeName, System.IO.Pipes.PipeDirection.In, 1,
+               System.IO.Pipes.PipeTransmissionMode.Byte, System.IO.Pipes.PipeOptions.Asynchronous);
+            var client = new System.IO.Pipes.NamedPipeClientStream(".", pipeName, System.IO.Pipes.PipeDirection.Out,
+               System.IO.Pipes.PipeOptions.Asynchronous);
+
+            tasks.Add(Task.Run(async () => {
+               await Task.Factory.FromAsync(server.BeginWaitForConnection, server.EndWaitForConnection, null);
+               var buffer = new byte[4];
+               int received = 0;
+               while (received < messagesPerPipe * buffer.Length) {
+                  int read = await server.ReadAsync(buffer, 0, buffer.Length);
+                  if (read == 0)
+                     break;
+                  received += read;
+               }
+               server.Dispose();
+            }));
+            tasks.Add(Task.Run(async () => {
+               client.Connect();
+               var buffer = new byte[4];
+               for (int i = 0; i < messagesPerPipe; ++i)
+                  await client.WriteAsync(buffer, 0, buffer.Length);
+               client.Dispose();
+            }));
+         }
+         Task.WaitAll(tasks.ToArray());
+      }
+
+      //- use System.Data (and, through it, System.Xml and System.Transactions) from the GAC
+      public static void SnippetTest26() {
+         var table = new System.Data.DataTable("Orders");
+         table.Columns.Add("Id", typeof(int));
+         table.Columns.Add("Quantity", typeof(int));
+         table.Columns.Add("Price", typeof(decimal));
+         table.Columns.Add("Total", typeof(decimal), "Quantity * Price");
+         for (int i = 1; i <= 10; ++i)
+            table.Rows.Add(i, i * 2, 1.5m * i);
+
+         var bigOrders = table.Select("Total > 50", "Total DESC");
+         Console.WriteLine("{0} orders over 50, the biggest is #{1}", bigOrders.Length, bigOrders[0]["Id"]);
+
+         using (var scope = new System.Transactions.TransactionScope()) {
+            var dataSet = new System.Data.DataSet("Shop");
+            dataSet.Tables.Add(table);
+            var xml = new StringWriter();
+            dataSet.WriteXml(xml);
+            Console.WriteLine("DataSet as XML: {0} characters", xml.ToString().Length);
+            scope.Complete();
+         }
+      }
+
+      //- flood the thread pool with short CPU-bound tasks. Run it next to other snippets:
+      //  the host fair queue should keep their work items from waiting behind the storm
+      public static void SnippetTest27() {
+         var tasks = new Task[10000];
+         for (int i = 0; i < tasks.Length; ++i) {
+            tasks[i] = Task.Run(() => Thread.SpinWait(100000));
+         }
+         Task.WaitAll(tasks);
+         Console.WriteLine("Done");
+      }
+
+      //- pool work items that block on other work items of the same snippet (nested Task.Run(...).Wait(),
+      //  Task.WaitAll). More of them than the per-domain cap: it must complete, not hang
+      public static void SnippetTest28() {
+         var outer = new Task<int>[20];
+         for (int i = 0; i < outer.Length; ++i) {
+            int n = i;
+            outer[i] = Task.Run(() => {
+               var inner = new Task<int>[4];
+               for (int j = 0; j < inner.Length; ++j) {
+                  int m = j;
+                  inner[j] = Task.Run(() => {
+                     var leaf = Task.Run(() => { Thread.Sleep(10); return n + m; });
+                     leaf.Wait();
+                     return leaf.Result;
+                  });
+               }
+               Task.WaitAll(inner);
+               return inner.Sum(t => t.Result);
+            });
+         }
+         Task.WaitAll(outer);
+         Console.WriteLine("Done: " + outer.Sum(t => t.Result));
+      }
+
       //- try to open a socket, connect
       //- try to open a socket, listen
-      //- try to use a lot of "file" (handle-based) async operations (*)
       // TODO
 
 
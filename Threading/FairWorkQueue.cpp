@@ -0,0 +1,193 @@
+
+#include "FairWorkQueue.h"
+#include "../HostContext.h"
+#include "../CrstLock.h"
+#include "../Logger.h"
+
+FairWorkQueue::FairWorkQueue() {
+   length = 0;
+
+   crst = new CRITICAL_SECTION;
+   if (!crst)
+      Logger::Critical("Failed to allocate critical sections");
+   InitializeCriticalSection(crst);
+}
+
+FairWorkQueue::~FairWorkQueue() {
+   for (auto it = domains.begin(); it != domains.end(); ++it) {
+      DomainWorkQueue* domain = it->second;
+      for (auto item = domain->items.begin(); item != domain->items.end(); ++item)
+         delete *item;
+      delete domain;
+   }
+
+   if (crst)
+      DeleteCriticalSection(crst);
+}
+
+DomainWorkQueue* FairWorkQueue::NewDomain(DWORD appDomainId) {
+   DomainWorkQueue* domain = new DomainWorkQueue;
+   domain->appDomainId = appDomainId;
+   domain->deficit = 0;
+   domain->isActive = false;
+   domain->running = 0;
+   domain->blocked = 0;
+   domain->averageCost = FAIR_QUEUE_INITIAL_COST;
+   domain->refs = 0;
+
+   if (appDomainId == 0) {
+      domain->weight = FAIR_QUEUE_HOST_WEIGHT;
+      domain->maxRunning = 0;
+   }
+   else {
+      domain->weight = 1;
+      // A snippet can keep busy as many pool threads as threads of its own (its main thread excluded)
+      domain->maxRunning = MAX_THREAD_PER_DOMAIN - 1;
+   }
+   return domain;
+}
+
+void FairWorkQueue::Attach(WorkItem* item) {
+   CrstLock lock(crst);
+
+   DomainWorkQueue* domain;
+   auto it = domains.find(item->appDomainId);
+   if (it == domains.end()) {
+      domain = NewDomain(item->appDomainId);
+      domains.insert(std::make_pair(item->appDomainId, domain));
+   }
+   else {
+      domain = it->second;
+   }
+   InterlockedIncrement(&domain->refs);
+   item->domain = domain;
+}
+
+void FairWorkQueue::AttachTo(WorkItem* item, DomainWorkQueue* domain) {
+   // The running item holds a reference, so domain cannot be collected under us (see refs)
+   InterlockedIncrement(&domain->refs);
+   item->domain = domain;
+}
+
+void FairWorkQueue::Detach(WorkItem* item) {
+   InterlockedDecrement(&item->domain->refs);
+   item->domain = NULL;
+}
+
+void FairWorkQueue::Enqueue(WorkItem* item) {
+   CrstLock lock(crst);
+
+   DomainWorkQueue* domain = item->domain;
+   domain->items.push_back(item);
+   if (!domain->isActive) {
+      domain->isActive = true;
+      activeDomains.push_back(domain);
+   }
+   InterlockedIncrement(&length);
+}
+
+WorkItem* FairWorkQueue::Dequeue() {
+   // Cheap check, to avoid taking the lock when there is nothing there
+   if (length == 0)
+      return NULL;
+
+   CrstLock lock(crst);
+
+   // Domains at their cap in a row; when we have seen all of them, there is
+   // nothing we can run now
+   size_t capped = 0;
+   while (!activeDomains.empty() && capped < activeDomains.size()) {
+      DomainWorkQueue* domain = activeDomains.front();
+
+      if (domain->maxRunning > 0 && domain->running - domain->blocked >= domain->maxRunning) {
+         // Not eligible: it does not gain credit while waiting
+         activeDomains.pop_front();
+         activeDomains.push_back(domain);
+         ++capped;
+         continue;
+      }
+      capped = 0;
+
+      LONG cost = domain->averageCost;
+      if (cost > FAIR_QUEUE_MAX_COST)
+         cost = FAIR_QUEUE_MAX_COST;
+
+      if (domain->deficit < cost) {
+         // Turn over: give it its quantum for the next round
+         domain->deficit += FAIR_QUEUE_QUANTUM * domain->weight;
+         activeDomains.pop_front();
+         activeDomains.push_back(domain);
+         continue;
+      }
+
+      WorkItem* item = domain->items.front();
+      domain->items.pop_front();
+      domain->deficit -= cost;
+      InterlockedIncrement(&domain->running);
+      InterlockedDecrement(&length);
+
+      if (domain->items.empty()) {
+         // An idle domain does not keep its credit
+         domain->isActive = false;
+         domain->deficit = 0;
+         activeDomains.pop_front();
+      }
+      return item;
+   }
+   return NULL;
+}
+
+bool FairWorkQueue::TryAcquireSlot(WorkItem* item) {
+   DomainWorkQueue* domain = item->domain;
+   if (domain->maxRunning <= 0) {
+      InterlockedIncrement(&domain->running);
+      return true;
+   }
+
+   LONG running = domain->running;
+   while (running - domain->blocked < domain->maxRunning) {
+      if (InterlockedCompareExchange(&domain->running, running + 1, running) == running)
+         return true;
+      running = domain->running;
+   }
+   return false;
+}
+
+bool FairWorkQueue::ReleaseSlot(WorkItem* item, LONG elapsedMicroseconds) {
+   DomainWorkQueue* domain = item->domain;
+
+   // Exponentially weighted moving average, alpha = 1/8
+   LONG average = domain->averageCost;
+   domain->averageCost = average + (elapsedMicroseconds - average) / 8;
+
+   InterlockedDecrement(&domain->running);
+   // Read before we give up our reference
+   bool hasWaitingItems = domain->maxRunning > 0 && domain->isActive;
+   Detach(item);
+   return hasWaitingItems;
+}
+
+void FairWorkQueue::OnItemBlocked(DomainWorkQueue* domain) {
+   InterlockedIncrement(&domain->blocked);
+}
+
+void FairWorkQueue::OnItemUnblocked(DomainWorkQueue* domain) {
+   InterlockedDecrement(&domain->blocked);
+}
+
+void FairWorkQueue::Collect() {
+   CrstLock lock(crst);
+
+   auto it = domains.begin();
+   while (it != domains.end()) {
+      DomainWorkQueue* domain = it->second;
+      // refs can leave 0 only under our lock: if it is 0 now, it stays 0
+      if (domain->refs == 0) {
+         delete domain;
+         it = domains.erase(it);
+      }
+      else {
+         ++it;
+      }
+   }
+}
@@ -0,0 +1,96 @@
+
+#ifndef SH_FAIR_WORK_QUEUE_H_INCLUDED
+#define SH_FAIR_WORK_QUEUE_H_INCLUDED
+
+#include "../Common.h"
+
+#include "WorkStealingQueue.h"
+
+#include <map>
+#include <deque>
+
+// DRR quantum, in microseconds of (estimated) work
+const LONG FAIR_QUEUE_QUANTUM = 1000;
+// Cost we charge for an item whose domain has no history yet
+const LONG FAIR_QUEUE_INITIAL_COST = 100;
+// An item is never charged more than this, so a domain with very long items
+// still gets its turn after a bounded number of rounds
+const LONG FAIR_QUEUE_MAX_COST = 8 * FAIR_QUEUE_QUANTUM;
+// Host work (default domain, CLR internals) gets a bigger share, and no cap
+const LONG FAIR_QUEUE_HOST_WEIGHT = 2;
+
+struct DomainWorkQueue {
+   DWORD appDomainId;
+   std::deque<WorkItem*> items;
+
+   // Deficit round robin state; protected by the FairWorkQueue lock
+   LONG deficit;
+   LONG weight;
+   bool isActive;
+
+   // Items of this domain running right now, and how many we allow (0 = no cap).
+   // Items blocked in a host wait do not count against the cap: they may be waiting for
+   // another item of the same domain (Task.Run(...).Wait()), which must be able to run
+   volatile LONG running;
+   volatile LONG blocked;
+   LONG maxRunning;
+
+   // Average cost of an item (microseconds); updated by workers without locks,
+   // it is only an estimate anyway
+   volatile LONG averageCost;
+
+   // Work items (queued anywhere, or running) that point to us. Always changed with
+   // interlocked operations: the decrement (ReleaseSlot) does not take the lock.
+   // It goes from 0 to 1 only in Attach, under the FairWorkQueue lock. AttachTo increments
+   // it without the lock, but its caller is running an item of this domain, which holds
+   // a reference until ReleaseSlot, after the increment: refs is at least 1 all along, so
+   // Collect (which frees, under the lock, the domains it sees at 0) cannot free it.
+   volatile LONG refs;
+};
+
+// The pool global queue: one FIFO per AppDomain, served with deficit round robin
+// (Shreedhar and Varghese, "Efficient Fair Queuing using Deficit Round Robin"), using
+// the measured run time of items as their cost. Domains that already have
+// maxRunning items in execution (and not blocked) are skipped, so a burst from one
+// snippet cannot take all the pool threads.
+class FairWorkQueue {
+private:
+   LPCRITICAL_SECTION crst;
+   std::map<DWORD, DomainWorkQueue*> domains;
+   // Domains with queued items, in round robin order; the front one is "on turn"
+   std::deque<DomainWorkQueue*> activeDomains;
+   volatile LONG length;
+
+   DomainWorkQueue* NewDomain(DWORD appDomainId);
+
+public:
+   FairWorkQueue();
+   ~FairWorkQueue();
+
+   // Binds a new item to the queue of its domain
+   void Attach(WorkItem* item);
+   // Binds a new item to the same domain of an item that is running right now
+   void AttachTo(WorkItem* item, DomainWorkQueue* domain);
+   // Releases the binding of an item that will never run
+   void Detach(WorkItem* item);
+
+   void Enqueue(WorkItem* item);
+   // Returns the next item to run, with an execution slot already taken for its domain
+   WorkItem* Dequeue();
+
+   // For items taken from somewhere else (local deques): takes an execution slot,
+   // if the domain is under its cap
+   bool TryAcquireSlot(WorkItem* item);
+   // Returns true if the domain has items waiting for the slot we just freed
+   bool ReleaseSlot(WorkItem* item, LONG elapsedMicroseconds);
+   // A running item of the domain starts, or stops, blocking in a host wait
+   void OnItemBlocked(DomainWorkQueue* domain);
+   void OnItemUnblocked(DomainWorkQueue* domain);
+
+   // Frees queues of domains that have nothing queued or running
+   void Collect();
+
+   LONG Length() const { return length; }
+};
+
+#endif //SH_FAIR_WORK_QUEUE_H_INCLUDED
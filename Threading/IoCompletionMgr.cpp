@@ -5,15 +5,13 @@
 
 #include "../CrstLock.h"
 
-#include <algorithm>
+// How long an idle completion thread waits before considering to exit
+const DWORD IOCP_THREAD_IDLE_TIMEOUT = 20 * 1000;
 
-// Utility
-
-int GetCpuCount() {
-   SYSTEM_INFO sysInfo;
-   ::GetSystemInfo(&sysInfo);
-   return sysInfo.dwNumberOfProcessors;
-}
+// GetQueuedCompletionStatusEx gives us the NTSTATUS of each I/O (in OVERLAPPED::Internal);
+// the CLR wants a Win32 error code
+typedef ULONG (WINAPI *RtlNtStatusToDosErrorFunc)(LONG status);
+static RtlNtStatusToDosErrorFunc pfnRtlNtStatusToDosError = NULL;
 
 SHIoCompletionManager::SHIoCompletionManager(HostContext* context) {
    m_cRef = 0;
@@ -21,15 +19,30 @@ SHIoCompletionManager::SHIoCompletionManager(HostContext* context) {
    hostContext = context;
    globalCompletionPort = NULL;
 
-   numberOfPorts = 0;
-
    numThreads = 0;
    numBusyThreads = 0;
+   isShuttingDown = 0;
    numberOfProcessors = GetCpuCount();
    minThreads = numberOfProcessors;
    maxThreads = numberOfProcessors * 10;
+   maxBatchSize = IOCP_MAX_BATCH_SIZE;
+
+   numCompletions = 0;
+   numBatches = 0;
+   dispatchTicks = 0;
+   QueryPerformanceFrequency(&performanceFrequency);
 
-   ZeroMemory(ports, sizeof(Port) * MAX_COMPLETION_PORTS);
+   benchmarkRemaining = 0;
+   hBenchmarkDone = CreateEvent(NULL, FALSE, FALSE, NULL);
+   if (!hBenchmarkDone)
+      Logger::Critical("CreateEvent error: %d", GetLastError());
+
+#ifdef THROTTLE_DOMAIN_IO
+   isThrottleStarted = 0;
+   hDeferredAvailable = CreateEvent(NULL, FALSE, FALSE, NULL);
+   if (!hDeferredAvailable)
+      Logger::Critical("CreateEvent error: %d", GetLastError());
+#endif //THROTTLE_DOMAIN_IO
 
    pLock = new CRITICAL_SECTION;
    if (!pLock) {
@@ -37,17 +50,83 @@ SHIoCompletionManager::SHIoCompletionManager(HostContext* context) {
    }
 
    InitializeCriticalSection(pLock);
+
+   enginePort = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+   if (enginePort == NULL) {
+      Logger::Critical("SHIoCompletionManager: CreateIoCompletionPort error: %d", GetLastError());
+   }
+
+   HMODULE hNtDll = GetModuleHandle(L"ntdll.dll");
+   if (hNtDll)
+      pfnRtlNtStatusToDosError = (RtlNtStatusToDosErrorFunc)GetProcAddress(hNtDll, "RtlNtStatusToDosError");
 }
 
 SHIoCompletionManager::~SHIoCompletionManager()
 {
+   // Workers hold a reference to us, so when we get here they are all gone
    if (clrIoCompletionManager)
       clrIoCompletionManager->Release();
 
+   for (auto it = ports.begin(); it != ports.end(); ++it)
+      ::CloseHandle(*it);
+
+   if (enginePort)
+      ::CloseHandle(enginePort);
+   if (hBenchmarkDone)
+      ::CloseHandle(hBenchmarkDone);
+#ifdef THROTTLE_DOMAIN_IO
+   if (hDeferredAvailable)
+      ::CloseHandle(hDeferredAvailable);
+#endif //THROTTLE_DOMAIN_IO
+
    if (pLock)
       DeleteCriticalSection(pLock);
 }
 
+void SHIoCompletionManager::Shutdown() {
+   if (InterlockedExchange(&isShuttingDown, 1) == 1)
+      return;
+
+   // Wake up everyone: a packet without an OVERLAPPED is not a completion
+   LONG threads = numThreads;
+   for (LONG i = 0; i < threads; ++i)
+      PostQueuedCompletionStatus(enginePort, 0, 0, NULL);
+
+#ifdef THROTTLE_DOMAIN_IO
+   SetEvent(hDeferredAvailable);
+#endif //THROTTLE_DOMAIN_IO
+}
+
+void SHIoCompletionManager::GetStatistics(IoCompletionStatistics* statistics) {
+   statistics->completions = numCompletions;
+   statistics->batches = numBatches;
+   statistics->dispatchMicroseconds = dispatchTicks * 1000000 / performanceFrequency.QuadPart;
+}
+
+LONGLONG SHIoCompletionManager::RunBenchmark(LONG count, ULONG batchSize) {
+   if (batchSize < 1 || batchSize > IOCP_MAX_BATCH_SIZE)
+      batchSize = IOCP_MAX_BATCH_SIZE;
+   maxBatchSize = batchSize;
+
+   EnsureWorkers();
+
+   InterlockedExchange(&benchmarkRemaining, count);
+   LARGE_INTEGER start, end;
+   QueryPerformanceCounter(&start);
+
+   for (LONG i = 0; i < count; ++i) {
+      if (!PostQueuedCompletionStatus(enginePort, 0, IOCP_BENCHMARK_KEY, NULL)) {
+         Logger::Error("PostQueuedCompletionStatus error: %d", GetLastError());
+         return -1;
+      }
+   }
+   WaitForSingleObject(hBenchmarkDone, INFINITE);
+
+   QueryPerformanceCounter(&end);
+   maxBatchSize = IOCP_MAX_BATCH_SIZE;
+   return (end.QuadPart - start.QuadPart) * 1000000 / performanceFrequency.QuadPart;
+}
+
 // IUnknown functions
 
 STDMETHODIMP_(DWORD) SHIoCompletionManager::AddRef()
@@ -77,49 +156,33 @@ STDMETHODIMP SHIoCompletionManager::QueryInterface(const IID &riid, void **ppvOb
    return E_NOINTERFACE;
 }
 
-int SHIoCompletionManager::IndexOf(HANDLE hPort) {
-   CrstLock(this->pLock);
-   for (int i = 0; i < numberOfPorts; ++i) {
-      if (ports[i].hPort == hPort) {
-         return i;
-      }
-   }
-
-   return -1;
+bool SHIoCompletionManager::IsKnownPort(HANDLE hPort) {
+   CrstLock lock(this->pLock);
+   return ports.find(hPort) != ports.end();
 }
 
 // IHostIoCompletionManager functions
 STDMETHODIMP SHIoCompletionManager::CreateIoCompletionPort(/* [out] */ HANDLE *phPort) {
 
    Logger::Info("In CreateIoCompletionPort");
+   if (phPort == NULL)
+      return E_POINTER;
 
-   // TODO! if (numberOfPorts == MAX_COMPLETION_PORTS)
-
-   *phPort = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, // No file, for now
-      NULL, // There is no existing completion port (we are creating it)
-      0,  // Key ignored for this case (just creation)
-      0); // As many concurrent threads as processors
-
-   if (*phPort == NULL) {
+   // A new handle to the engine port: the CLR can bind to it, post to it and close it
+   // as if it were a port of its own
+   if (!DuplicateHandle(GetCurrentProcess(), enginePort, GetCurrentProcess(), phPort, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
       DWORD errorCode = GetLastError();
       Logger::Error("CreateIoCompletionPort error: %d", errorCode);
+      *phPort = NULL;
       return HRESULT_FROM_WIN32(errorCode);
    }
-   else {
 
-      CrstLock(this->pLock);
-      for (int i = 0; i < MAX_COMPLETION_PORTS; ++i) {
-         if (ports[i].hPort == NULL) {
-            ports[numberOfPorts].hPort = *phPort;
-            // The number of threads must be stored in a separate memory area. 
-            // We might have a race between the pool-thread func, CloseIo and Create Io otherwise
-            ports[numberOfPorts].numThreads = new DWORD;
-            *(ports[numberOfPorts].numThreads) = 0;
-            ++numberOfPorts;
-            break;
-         }
-      }
+   {
+      CrstLock lock(this->pLock);
+      ports.insert(*phPort);
    }
+
+   EnsureWorkers();
    return S_OK;
 }
 
@@ -127,20 +190,18 @@ STDMETHODIMP SHIoCompletionManager::CloseIoCompletionPort(HANDLE hPort) {
 
    Logger::Info("In CloseIoCompletionPort");
 
-   if (::CloseHandle(hPort)) {
-
-      CrstLock(this->pLock);
-      for (int i = 0; i < numberOfPorts; ++i) {
-         if (ports[numberOfPorts].hPort == hPort) {
-            ports[i].hPort = NULL;
-            if (ports[i].numThreads)
-               delete (ports[i].numThreads);
-            ports[i].numThreads = NULL;
-            --numberOfPorts;
-            break;
-         }
-      }    
+   {
+      CrstLock lock(this->pLock);
+      auto it = ports.find(hPort);
+      if (it == ports.end()) {
+         Logger::Error("CloseIoCompletionPort: unknown port %p", hPort);
+         return E_INVALIDARG;
+      }
+      ports.erase(it);
+   }
 
+   // Closes only this handle: the engine port (and handles bound through it) stay alive
+   if (::CloseHandle(hPort)) {
       return S_OK;
    }
    else {
@@ -151,33 +212,46 @@ STDMETHODIMP SHIoCompletionManager::CloseIoCompletionPort(HANDLE hPort) {
 }
 
 STDMETHODIMP SHIoCompletionManager::SetMaxThreads(DWORD dwMaxIOCompletionThreads) {
+   if (dwMaxIOCompletionThreads == 0 || dwMaxIOCompletionThreads < minThreads)
+      return E_INVALIDARG;
+
    maxThreads = dwMaxIOCompletionThreads;
    return S_OK;
 }
 
 STDMETHODIMP SHIoCompletionManager::GetMaxThreads(/* [out] */ DWORD *pdwMaxIOCompletionThreads) {
+   if (pdwMaxIOCompletionThreads == NULL)
+      return E_POINTER;
+
    *pdwMaxIOCompletionThreads = maxThreads;
    return S_OK;
 }
 
 STDMETHODIMP SHIoCompletionManager::SetMinThreads(DWORD dwMinIOCompletionThreads) {
+   if (dwMinIOCompletionThreads > maxThreads)
+      return E_INVALIDARG;
+
    minThreads = dwMinIOCompletionThreads;
    return S_OK;
 }
 
 STDMETHODIMP SHIoCompletionManager::GetMinThreads(/* [out] */ DWORD *pdwMinIOCompletionThreads) {
+   if (pdwMinIOCompletionThreads == NULL)
+      return E_POINTER;
+
    *pdwMinIOCompletionThreads = minThreads;
    return S_OK;
 }
 
 STDMETHODIMP SHIoCompletionManager::GetAvailableThreads(/* [out] */ DWORD *pdwAvailableIOCompletionThreads) {
-   *pdwAvailableIOCompletionThreads = maxThreads - numThreads;
-  
-   if (*pdwAvailableIOCompletionThreads < 0)
-      *pdwAvailableIOCompletionThreads = 0;
+   if (pdwAvailableIOCompletionThreads == NULL)
+      return E_POINTER;
+
+   LONG busy = numBusyThreads;
+   *pdwAvailableIOCompletionThreads = (busy < (LONG)maxThreads) ? (maxThreads - busy) : 0;
 
    Logger::Info("GetAvailableThreads: returns %d", *pdwAvailableIOCompletionThreads);
-   
+
    return S_OK;
 }
 
@@ -189,8 +263,8 @@ STDMETHODIMP SHIoCompletionManager::SetCLRIoCompletionManager(
    return S_OK;
 }
 
-// The Windows Platform functions use the OVERLAPPED structure to store state for asynchronous I/O requests. 
-// The CLR calls the InitializeHostOverlapped method to give the host the opportunity to append 
+// The Windows Platform functions use the OVERLAPPED structure to store state for asynchronous I/O requests.
+// The CLR calls the InitializeHostOverlapped method to give the host the opportunity to append
 // custom data to an OVERLAPPED instance.
 STDMETHODIMP SHIoCompletionManager::InitializeHostOverlapped(
    /* [in] */ void* /*pvOverlapped*/) {
@@ -202,7 +276,7 @@ STDMETHODIMP SHIoCompletionManager::InitializeHostOverlapped(
 }
 
 STDMETHODIMP SHIoCompletionManager::GetHostOverlappedSize(/* [out] */ DWORD *pcbSize) {
-   // We do not use it, for now, so 
+   // We do not use it, for now, so
    *pcbSize = 0;
    return S_OK;
 }
@@ -211,32 +285,27 @@ HANDLE SHIoCompletionManager::GetDefaultCompletionPort() {
 
    // Double-checked locking optimization
    if (globalCompletionPort == NULL) {
-      CrstLock(this->pLock);
+      CrstLock lock(this->pLock);
       if (globalCompletionPort == NULL) {
-         HRESULT hr = CreateIoCompletionPort(&globalCompletionPort);
+         HANDLE hPort;
+         HRESULT hr = CreateIoCompletionPort(&hPort);
 
          if (!SUCCEEDED(hr)) {
             Logger::Critical("GetDefaultCompletionPort error: %d", hr);
          }
+         globalCompletionPort = hPort;
       }
    }
 
    return globalCompletionPort;
 }
 
-bool SHIoCompletionManager::HasCompletionPortThreadpool(HANDLE hPort) { 
-   int idx = IndexOf(hPort);
-   if (idx >= 0) {
-      DWORD* p = ports[idx].numThreads;
-      if (p && *p > 0)
-         return true;
-   }
-   return false;
-}
-
 // If we had only one port, maybe we could use BindIoCompletionCallback
 // http://msdn.microsoft.com/en-us/library/aa363484%28VS.85%29.aspx
-// But the CLR require an arbitrary number of ports, so we need to implement it ourselves
+// The CLR requires an arbitrary number of ports: we give it as many handles to the
+// same port as it wants, so we still have only one port to service.
+// The completion key is the snippet AppDomain of the thread binding the handle (0 for
+// host handles), so that we know who to charge for each completion.
 STDMETHODIMP SHIoCompletionManager::Bind(
    /* [in] */ HANDLE hPort,
    /* [in] */ HANDLE hHandle) {
@@ -246,22 +315,17 @@ STDMETHODIMP SHIoCompletionManager::Bind(
       // If this is null, the CLR mean the "default completion port".
       hPort = GetDefaultCompletionPort();
    }
-
-   // there could be a race here, but at worst we will have N threads starting up where N = number of CPUs
-
-   // Do we have at least a thread on this completion port?
-   if (!HasCompletionPortThreadpool(hPort)) {
-      CreateCompletionPortThread(hPort);
-   }
-   else {
-      GrowCompletionPortThreadpoolIfNeeded(hPort);
+   else if (!IsKnownPort(hPort)) {
+      Logger::Error("Bind: unknown port %p", hPort);
+      return E_INVALIDARG;
    }
 
+   DWORD appDomainId = hostContext->GetSnippetAppDomain(GetCurrentThreadId());
 
    // Use it in the "Associate an existing I/O completion port with a file handle" mode
    HANDLE hRet = ::CreateIoCompletionPort(hHandle, // The handle that will be used to complete the request
       hPort, // The existing completion port
-      0,  // Key 
+      appDomainId,  // Key
       0); // Ignored
 
    if (hRet == NULL) {
@@ -270,102 +334,233 @@ STDMETHODIMP SHIoCompletionManager::Bind(
       return HRESULT_FROM_WIN32(errorCode);
    }
 
+   EnsureWorkers();
    return S_OK;
 }
 
-struct ThreadArgs {
-   HANDLE hPort;
-   SHIoCompletionManager* pManager;
-   DWORD* pThreadsPerPort;
-};
+void SHIoCompletionManager::EnsureWorkers() {
+   if (numThreads == 0)
+      CreateCompletionPortThread();
+}
 
-void SHIoCompletionManager::CreateCompletionPortThread(HANDLE hPort) {
+void SHIoCompletionManager::CreateCompletionPortThread() {
+   LONG n = numThreads;
+   for (;;) {
+      if (n >= (LONG)maxThreads || isShuttingDown)
+         return;
+      if (InterlockedCompareExchange(&numThreads, n + 1, n) == n)
+         break;
+      n = numThreads;
+   }
 
-   ThreadArgs* threadArgs = new ThreadArgs;
-   threadArgs->hPort = hPort;
-   threadArgs->pManager = this;
-   threadArgs->pThreadsPerPort = ports[IndexOf(hPort)].numThreads;
+   // Each worker keeps us alive as long as it runs
+   AddRef();
+   HANDLE hThread = CreateThread(NULL, 0, CompletionPortThreadFunc, (LPVOID)this, 0, NULL);
 
-   HANDLE hThread = CreateThread(NULL, 0, CompletionPortThreadFunc, (LPVOID)threadArgs, 0, NULL);
-   
    if (hThread == NULL) {
       Logger::Error("CreateCompletionPortThread failed. Error: %d", GetLastError());
-      delete threadArgs;
+      InterlockedDecrement(&numThreads);
+      Release();
    }
    else {
       // We do not need the reference; close it so the thread can die when he decides to
-      CloseHandle(hThread);      
+      CloseHandle(hThread);
    }
 }
 
-DWORD __stdcall SHIoCompletionManager::CompletionPortThreadFunc(LPVOID lpArgs) {
+// Called by a worker that is about to run completions: if it was the last one
+// waiting on the port, and the completions block (or take long), nobody would be
+// there to pick up the next ones.
+void SHIoCompletionManager::GrowCompletionPortThreadpoolIfNeeded() {
+   if (numBusyThreads >= numThreads && numThreads < (LONG)maxThreads) {
+      CreateCompletionPortThread();
+   }
+}
 
-   const int iocpThreadWait = 1000;
+bool SHIoCompletionManager::ShouldRetire() {
+   // Do not leave if we started I/O that is still in flight
+   BOOL ioPending = TRUE;
+   GetThreadIOPendingFlag(GetCurrentThread(), &ioPending);
+   if (ioPending)
+      return false;
+
+   // Always keep at least one thread waiting on the port
+   LONG limit = (minThreads > 0) ? (LONG)minThreads : 1;
+   LONG n = numThreads;
+   while (n > limit) {
+      if (InterlockedCompareExchange(&numThreads, n - 1, n) == n)
+         return true;
+      n = numThreads;
+   }
+   return false;
+}
 
-   ThreadArgs* threadArgs = (ThreadArgs*) lpArgs;
-   SHIoCompletionManager* me = threadArgs->pManager;
+void SHIoCompletionManager::DispatchCompletion(const OVERLAPPED_ENTRY& entry) {
+   if (entry.lpCompletionKey == IOCP_BENCHMARK_KEY) {
+      if (InterlockedDecrement(&benchmarkRemaining) == 0)
+         SetEvent(hBenchmarkDone);
+      return;
+   }
 
-   InterlockedIncrement(&(me->numThreads));
-   InterlockedIncrement(threadArgs->pThreadsPerPort);
-   InterlockedIncrement(&(me->numBusyThreads));
+   if (entry.lpOverlapped == NULL) {
+      // Not an I/O completion (e.g. our shutdown wake-up)
+      return;
+   }
 
-   bool stayInPool = true;
+   DWORD dwError = ERROR_SUCCESS;
+   LONG status = (LONG)entry.lpOverlapped->Internal;
+   if (status != 0) {
+      dwError = pfnRtlNtStatusToDosError ? pfnRtlNtStatusToDosError(status) : ERROR_GEN_FAILURE;
+   }
 
-   while (stayInPool) {
-      DWORD numberOfBytes = 0;
-      ULONG completionKey = 0;
-      OVERLAPPED* pOverlapped;
+   if (entry.lpCompletionKey != 0 && hostContext) {
+      DWORD dwDelay = hostContext->OnIoCompleted((DWORD)entry.lpCompletionKey, entry.dwNumberOfBytesTransferred);
+#ifdef THROTTLE_DOMAIN_IO
+      if (dwDelay > 0) {
+         DeferCompletion(dwError, entry.dwNumberOfBytesTransferred, entry.lpOverlapped, dwDelay);
+         return;
+      }
+#else
+      UNREFERENCED_PARAMETER(dwDelay);
+#endif //THROTTLE_DOMAIN_IO
+   }
 
-      // We are going to wait, so we are not "busy" anymore
-      InterlockedDecrement(&(me->numBusyThreads));
-      BOOL success = GetQueuedCompletionStatus(threadArgs->hPort, &numberOfBytes, &completionKey, &pOverlapped, iocpThreadWait);
-      DWORD dwError = GetLastError();
+   clrIoCompletionManager->OnComplete(dwError, entry.dwNumberOfBytesTransferred, entry.lpOverlapped);
+}
 
-      // There is work to do
-      InterlockedIncrement(&(me->numBusyThreads));
+#ifdef THROTTLE_DOMAIN_IO
+void SHIoCompletionManager::DeferCompletion(DWORD dwError, DWORD dwBytes, LPOVERLAPPED pOverlapped, DWORD dwDelay) {
+   if (isShuttingDown) {
+      clrIoCompletionManager->OnComplete(dwError, dwBytes, pOverlapped);
+      return;
+   }
 
-      if (success && pOverlapped != NULL) {
-         me->clrIoCompletionManager->OnComplete(dwError, numberOfBytes, pOverlapped);
+   if (InterlockedCompareExchange(&isThrottleStarted, 1, 0) == 0) {
+      // The throttle thread keeps us alive as long as it runs
+      AddRef();
+      HANDLE hThread = CreateThread(NULL, 0, ThrottleThreadFunc, this, 0, NULL);
+      if (hThread == NULL) {
+         Logger::Error("Throttle thread creation failed. Error: %d", GetLastError());
+         InterlockedExchange(&isThrottleStarted, 0);
+         Release();
+         // Better late than never: we cannot hold it back, deliver it now
+         clrIoCompletionManager->OnComplete(dwError, dwBytes, pOverlapped);
+         return;
       }
+      CloseHandle(hThread);
+   }
 
-      if (!success && dwError == ERROR_ABANDONED_WAIT_0) {
-         // The port was closed, we need to exit this thread in any case
-         stayInPool = false;
-      }
-      else {
-         // Is there something to do?
-         BOOL ioPending = TRUE;
-         GetThreadIOPendingFlag(GetCurrentThread(), &ioPending);
-
-         if (!ioPending && // There is no IO pending
-            (me->numThreads > me->minThreads)) { // We have enough threads 
-
-            // Is there another thread on this port?
-            if (InterlockedDecrement(threadArgs->pThreadsPerPort) > 0) {
-               stayInPool = false;
-            }
-            else {
-               // Ops.. we hit 0
-               // Roll back our decision: we stay in pool
-               InterlockedIncrement(threadArgs->pThreadsPerPort);
-            }
+   DeferredCompletion deferred = { dwError, dwBytes, pOverlapped };
+   {
+      CrstLock lock(this->pLock);
+      deferredCompletions.insert(std::make_pair(GetTickCount64() + dwDelay, deferred));
+   }
+   SetEvent(hDeferredAvailable);
+}
+
+// Delivers deferred completions when they are due; everything still there
+// when we shut down is delivered at once
+DWORD __stdcall SHIoCompletionManager::ThrottleThreadFunc(LPVOID lpArgs) {
+   SHIoCompletionManager* me = (SHIoCompletionManager*)lpArgs;
+   std::vector<DeferredCompletion> due;
+
+   for (;;) {
+      DWORD dwWait = INFINITE;
+      bool shuttingDown = me->isShuttingDown != 0;
+      {
+         CrstLock lock(me->pLock);
+         ULONGLONG now = GetTickCount64();
+         auto it = me->deferredCompletions.begin();
+         while (it != me->deferredCompletions.end() && (shuttingDown || it->first <= now)) {
+            due.push_back(it->second);
+            it = me->deferredCompletions.erase(it);
          }
+         if (it != me->deferredCompletions.end())
+            dwWait = (DWORD)(it->first - now);
       }
-   }
 
-   InterlockedDecrement(&(me->numThreads));
-   // If we wanted to exit, we have already decremented threadArgs->threadsPerPort
-   InterlockedDecrement(&(me->numBusyThreads));
+      for (auto d = due.begin(); d != due.end(); ++d)
+         me->clrIoCompletionManager->OnComplete(d->dwError, d->dwBytes, d->pOverlapped);
+      due.clear();
+
+      if (shuttingDown)
+         break;
+
+      WaitForSingleObject(me->hDeferredAvailable, dwWait);
+   }
 
-   // Before exiting, clear args
-   delete threadArgs;
+   me->Release();
    return 0;
 }
+#endif //THROTTLE_DOMAIN_IO
+
+// A full batch means there is more waiting: take more next time. A batch less than
+// half full means we are ahead of the load: take less, so a slow completion does not
+// delay the others while other workers are idle.
+ULONG SHIoCompletionManager::NextBatchSize(ULONG batchSize, ULONG numEntries) {
+   if (numEntries == batchSize)
+      batchSize *= 2;
+   else if (numEntries < batchSize / 2)
+      batchSize /= 2;
+
+   if (batchSize > maxBatchSize)
+      batchSize = maxBatchSize;
+   if (batchSize < 1)
+      batchSize = 1;
+   return batchSize;
+}
+
+DWORD __stdcall SHIoCompletionManager::CompletionPortThreadFunc(LPVOID lpArgs) {
 
-void SHIoCompletionManager::GrowCompletionPortThreadpoolIfNeeded(HANDLE hPort) {
+   SHIoCompletionManager* me = (SHIoCompletionManager*) lpArgs;
+   OVERLAPPED_ENTRY entries[IOCP_MAX_BATCH_SIZE];
+   ULONG batchSize = IOCP_INITIAL_BATCH_SIZE;
+
+   bool retired = false;
+   while (!retired && !me->isShuttingDown) {
+      ULONG numEntries = 0;
+      if (batchSize > me->maxBatchSize)
+         batchSize = me->maxBatchSize;
+      BOOL success = GetQueuedCompletionStatusEx(me->enginePort, entries, batchSize, &numEntries, IOCP_THREAD_IDLE_TIMEOUT, FALSE);
+
+      if (!success) {
+         DWORD dwError = GetLastError();
+         if (dwError == WAIT_TIMEOUT) {
+            retired = me->ShouldRetire();
+            continue;
+         }
+
+         // The port is gone (ERROR_ABANDONED_WAIT_0), or something we cannot recover from
+         Logger::Error("GetQueuedCompletionStatusEx error: %d", dwError);
+         break;
+      }
 
-   if (numBusyThreads == numThreads && // all threads are busy
-      numBusyThreads < maxThreads) {
-      CreateCompletionPortThread(hPort);
+      // Busy accounting (and the decision to grow) once per batch, not per completion
+      InterlockedIncrement(&(me->numBusyThreads));
+      me->GrowCompletionPortThreadpoolIfNeeded();
+
+      LARGE_INTEGER start, end;
+      QueryPerformanceCounter(&start);
+
+      for (ULONG i = 0; i < numEntries; ++i) {
+         me->DispatchCompletion(entries[i]);
+      }
+
+      QueryPerformanceCounter(&end);
+      InterlockedDecrement(&(me->numBusyThreads));
+
+      InterlockedExchangeAdd64(&(me->numCompletions), numEntries);
+      InterlockedIncrement64(&(me->numBatches));
+      InterlockedExchangeAdd64(&(me->dispatchTicks), end.QuadPart - start.QuadPart);
+
+      batchSize = me->NextBatchSize(batchSize, numEntries);
+   }
+
+   if (!retired) {
+      // Shutting down
+      InterlockedDecrement(&(me->numThreads));
    }
+
+   me->Release();
+   return 0;
 }
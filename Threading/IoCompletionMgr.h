@@ -5,7 +5,26 @@
 #include "../Common.h"
 #include "../HostContext.h"
 
-const int MAX_COMPLETION_PORTS = 16;
+#include <set>
+#ifdef THROTTLE_DOMAIN_IO
+#include <map>
+#include <vector>
+#endif //THROTTLE_DOMAIN_IO
+
+// Completions we take from the engine port with a single call: each worker adapts
+// between 1 (light load, so one slow OnComplete does not hold back the others) and this
+const int IOCP_MAX_BATCH_SIZE = 64;
+const int IOCP_INITIAL_BATCH_SIZE = 4;
+
+// Completion key of the synthetic packets posted by RunBenchmark
+const ULONG_PTR IOCP_BENCHMARK_KEY = (ULONG_PTR)-1;
+
+struct IoCompletionStatistics {
+   LONGLONG completions;
+   LONGLONG batches;
+   // Time spent dispatching completions (OnComplete calls)
+   LONGLONG dispatchMicroseconds;
+};
 
 class SHIoCompletionManager : public IHostIoCompletionManager {
 private:
@@ -13,35 +32,70 @@ private:
    ICLRIoCompletionManager* clrIoCompletionManager;
    HostContext* hostContext;
 
+   // The one completion port we really wait on. Every port the CLR asks for is
+   // a duplicate handle of this one: handles bound to any of them complete here,
+   // and a single set of workers services all of them.
+   HANDLE enginePort;
    HANDLE globalCompletionPort;
    CRITICAL_SECTION* pLock;
 
-   HANDLE GetDefaultCompletionPort();
+   // The port handles we gave to the CLR
+   std::set<HANDLE> ports;
 
-   void GrowCompletionPortThreadpoolIfNeeded(HANDLE hPort);
-   void CreateCompletionPortThread(HANDLE hPort);
+   HANDLE GetDefaultCompletionPort();
+   bool IsKnownPort(HANDLE hPort);
+
+   void EnsureWorkers();
+   void GrowCompletionPortThreadpoolIfNeeded();
+   void CreateCompletionPortThread();
+   bool ShouldRetire();
+   void DispatchCompletion(const OVERLAPPED_ENTRY& entry);
+   ULONG NextBatchSize(ULONG batchSize, ULONG numEntries);
    static DWORD __stdcall CompletionPortThreadFunc(LPVOID lpArgs);
 
-   volatile DWORD numThreads;
-   volatile DWORD numBusyThreads;
+   volatile LONG numThreads;
+   volatile LONG numBusyThreads;
+   volatile LONG isShuttingDown;
    DWORD minThreads;
    DWORD maxThreads;
    DWORD numberOfProcessors;
+   ULONG maxBatchSize;
+
+   volatile LONGLONG numCompletions;
+   volatile LONGLONG numBatches;
+   volatile LONGLONG dispatchTicks;
+   LARGE_INTEGER performanceFrequency;
 
-   struct Port {
-      HANDLE hPort;
-      DWORD* numThreads;
+   volatile LONG benchmarkRemaining;
+   HANDLE hBenchmarkDone;
+
+#ifdef THROTTLE_DOMAIN_IO
+   struct DeferredCompletion {
+      DWORD dwError;
+      DWORD dwBytes;
+      LPOVERLAPPED pOverlapped;
    };
+   // Completions of domains over their I/O budget, by the time they are due
+   std::multimap<ULONGLONG, DeferredCompletion> deferredCompletions;
+   HANDLE hDeferredAvailable;
+   volatile LONG isThrottleStarted;
 
-   Port ports[MAX_COMPLETION_PORTS];
-   int numberOfPorts;
-   int IndexOf(HANDLE hPort);
-   bool HasCompletionPortThreadpool(HANDLE hPort);
+   void DeferCompletion(DWORD dwError, DWORD dwBytes, LPOVERLAPPED pOverlapped, DWORD dwDelay);
+   static DWORD __stdcall ThrottleThreadFunc(LPVOID lpArgs);
+#endif //THROTTLE_DOMAIN_IO
 
 public:
    SHIoCompletionManager(HostContext* context);
    ~SHIoCompletionManager();
 
+   void Shutdown();
+
+   void GetStatistics(IoCompletionStatistics* statistics);
+
+   // Posts count synthetic completions and waits for the workers to dispatch
+   // them; returns the elapsed time in microseconds. Does not need the CLR.
+   LONGLONG RunBenchmark(LONG count, ULONG batchSize);
+
    // IUnknown functions
    STDMETHODIMP_(DWORD) AddRef();
    STDMETHODIMP_(DWORD) Release();
@@ -280,3 +280,22 @@ bool SHTaskManager::IsSnippetThread(DWORD nativeThreadId) {
    Logger::Debug("In TaskManager::IsSnippetThread: %d", nativeThreadId);
    return hostContext->IsSnippetThread(nativeThreadId);
 }
+
+HRESULT SHTaskManager::AbortTask(DWORD nativeThreadId) {
+   ICLRTask* managedTask = NULL;
+   {
+      CrstLock managedMapLock(managedThreadMapCrst);
+      auto task = managedThreadMap.find(nativeThreadId);
+      if (task != managedThreadMap.end()) {
+         managedTask = task->second;
+         managedTask->AddRef();
+      }
+   }
+   if (managedTask == NULL)
+      return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+
+   // Outside the lock: the CLR may call back into us (e.g. RemoveTask)
+   HRESULT hr = managedTask->Abort();
+   managedTask->Release();
+   return hr;
+}
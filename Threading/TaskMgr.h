@@ -53,6 +53,8 @@ public:
    void AddManagedTask(IHostTask* hostTask, ICLRTask* managedTask, DWORD nativeThreadId);
    void RemoveTask(DWORD nativeThreadId);
    bool IsSnippetThread(DWORD nativeThreadId);
+   // Asks the CLR to abort the managed thread running on that native thread
+   HRESULT AbortTask(DWORD nativeThreadId);
 
 };
 
@@ -0,0 +1,153 @@
+
+#include "ThreadTree.h"
+#include "../CrstLock.h"
+#include "../Logger.h"
+
+ThreadTree::ThreadTree() {
+   crst = new CRITICAL_SECTION;
+   if (!crst)
+      Logger::Critical("Failed to allocate critical sections");
+   InitializeCriticalSection(crst);
+}
+
+ThreadTree::~ThreadTree() {
+   nodes.ForEach([](DWORD, ThreadTreeNode* node) { delete node; });
+
+   if (crst)
+      DeleteCriticalSection(crst);
+}
+
+ThreadTreeNode* ThreadTree::GetOrCreate(DWORD threadId) {
+   ThreadTreeNode** existing = nodes.Find(threadId);
+   if (existing != NULL)
+      return *existing;
+
+   ThreadTreeNode* node = new ThreadTreeNode;
+   ZeroMemory(node, sizeof(ThreadTreeNode));
+   node->threadId = threadId;
+   nodes.Insert(threadId, node);
+   return node;
+}
+
+void ThreadTree::Unlink(ThreadTreeNode* node) {
+   ThreadTreeNode* parent = node->parent;
+   if (parent == NULL)
+      return;
+
+   if (node->prevSibling)
+      node->prevSibling->nextSibling = node->nextSibling;
+   else
+      parent->firstChild = node->nextSibling;
+   if (node->nextSibling)
+      node->nextSibling->prevSibling = node->prevSibling;
+   else
+      parent->lastChild = node->prevSibling;
+
+   node->parent = NULL;
+   node->prevSibling = NULL;
+   node->nextSibling = NULL;
+}
+
+void ThreadTree::LinkChild(ThreadTreeNode* parent, ThreadTreeNode* child) {
+   child->parent = parent;
+   child->nextSibling = NULL;
+   child->prevSibling = parent->lastChild;
+   if (parent->lastChild)
+      parent->lastChild->nextSibling = child;
+   else
+      parent->firstChild = child;
+   parent->lastChild = child;
+}
+
+void ThreadTree::Add(DWORD parentThreadId, DWORD childThreadId) {
+   if (parentThreadId == 0 || childThreadId == 0 || parentThreadId == childThreadId)
+      return;
+
+   CrstLock lock(crst);
+   // Node pointers are stable: only the table slots move
+   ThreadTreeNode* parent = GetOrCreate(parentThreadId);
+   ThreadTreeNode* child = GetOrCreate(childThreadId);
+
+   // Never close a cycle: a thread cannot become a child of one of its descendants
+   for (ThreadTreeNode* ancestor = parent; ancestor != NULL; ancestor = ancestor->parent) {
+      if (ancestor == child) {
+         Logger::Error("Thread %d cannot be a child of its descendant %d", childThreadId, parentThreadId);
+         return;
+      }
+   }
+
+   Unlink(child);
+   LinkChild(parent, child);
+}
+
+void ThreadTree::Remove(DWORD threadId) {
+   CrstLock lock(crst);
+
+   ThreadTreeNode** found = nodes.Find(threadId);
+   if (found == NULL)
+      return;
+   ThreadTreeNode* node = *found;
+   ThreadTreeNode* parent = node->parent;
+   Unlink(node);
+
+   if (node->firstChild) {
+      for (ThreadTreeNode* child = node->firstChild; child != NULL; child = child->nextSibling)
+         child->parent = parent;
+
+      if (parent) {
+         // Splice the whole list at the end of the parent's children
+         node->firstChild->prevSibling = parent->lastChild;
+         if (parent->lastChild)
+            parent->lastChild->nextSibling = node->firstChild;
+         else
+            parent->firstChild = node->firstChild;
+         parent->lastChild = node->lastChild;
+      }
+      else {
+         // Orphans: each one is now a root
+         ThreadTreeNode* child = node->firstChild;
+         while (child != NULL) {
+            ThreadTreeNode* next = child->nextSibling;
+            child->prevSibling = NULL;
+            child->nextSibling = NULL;
+            child = next;
+         }
+      }
+   }
+
+   nodes.Erase(threadId);
+   delete node;
+}
+
+void ThreadTree::GetSubtree(DWORD threadId, std::vector<DWORD>& threads) {
+   CrstLock lock(crst);
+
+   ThreadTreeNode** found = nodes.Find(threadId);
+   if (found == NULL) {
+      threads.push_back(threadId);
+      return;
+   }
+
+   // Iterative pre-order walk: snippets control the depth of the tree
+   ThreadTreeNode* root = *found;
+   ThreadTreeNode* node = root;
+   while (node != NULL) {
+      threads.push_back(node->threadId);
+      if (node->firstChild) {
+         node = node->firstChild;
+         continue;
+      }
+      while (node != root && node->nextSibling == NULL)
+         node = node->parent;
+      node = (node == root) ? NULL : node->nextSibling;
+   }
+}
+
+DWORD ThreadTree::GetParent(DWORD threadId) {
+   CrstLock lock(crst);
+
+   ThreadTreeNode** found = nodes.Find(threadId);
+   if (found == NULL || (*found)->parent == NULL)
+      return 0;
+   return (*found)->parent->threadId;
+}
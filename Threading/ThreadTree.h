@@ -0,0 +1,48 @@
+#ifndef SH_THREAD_TREE_H_INCLUDED
+#define SH_THREAD_TREE_H_INCLUDED
+
+#include "../Common.h"
+#include "../FlatTable.h"
+
+#include <vector>
+
+struct ThreadTreeNode {
+   DWORD threadId;
+   ThreadTreeNode* parent;
+   ThreadTreeNode* firstChild;
+   ThreadTreeNode* lastChild;
+   ThreadTreeNode* prevSibling;
+   ThreadTreeNode* nextSibling;
+};
+
+// Who created whom, among the threads acquired by snippets: a parent pointer and a
+// doubly linked list of children per thread, indexed by native thread id.
+// When a thread exits, its children are handed over to its parent (or become roots)
+// by splicing its child list: the cost depends only on how many children it had,
+// not on the number of threads we are tracking.
+class ThreadTree {
+private:
+   LPCRITICAL_SECTION crst;
+   FlatTable<ThreadTreeNode*, ThreadIdHash> nodes;
+
+   ThreadTreeNode* GetOrCreate(DWORD threadId);
+   void Unlink(ThreadTreeNode* node);
+   void LinkChild(ThreadTreeNode* parent, ThreadTreeNode* child);
+
+public:
+   ThreadTree();
+   ~ThreadTree();
+
+   // Records that parentThreadId acquired childThreadId. A thread we already know (e.g.
+   // a thread reused by a pool) moves under its new parent, with its own children
+   void Add(DWORD parentThreadId, DWORD childThreadId);
+   // Forgets the thread; its children are adopted by its parent
+   void Remove(DWORD threadId);
+   // Appends threadId and all its descendants to threads (pre-order; threadId itself
+   // even if it is not tracked)
+   void GetSubtree(DWORD threadId, std::vector<DWORD>& threads);
+   // 0 for roots and for threads we do not know
+   DWORD GetParent(DWORD threadId);
+};
+
+#endif //SH_THREAD_TREE_H_INCLUDED
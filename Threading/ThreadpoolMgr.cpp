@@ -1,18 +1,166 @@
 
 #include "ThreadpoolMgr.h"
+#include "../CrstLock.h"
 #include "../Logger.h"
 
+// How long an idle worker waits for new work before considering to exit
+const DWORD WORKER_IDLE_TIMEOUT = 20 * 1000;
+// How often the hill climbing controller samples throughput
+const DWORD HILL_CLIMBING_INTERVAL = 500;
+// Throughput changes smaller than this (relative) are considered noise
+const double HILL_CLIMBING_THRESHOLD = 0.05;
 
+// The worker (if any) running on the current thread, and the AppDomain of the
+// work item it is executing. Items queued from inside a work item are attributed
+// to the same AppDomain.
+static __declspec(thread) LPVOID currentWorker = NULL;
+static __declspec(thread) DomainWorkQueue* currentDomain = NULL;
 
 SHThreadpoolManager::SHThreadpoolManager(HostContext* context) {
    m_cRef = 0;
    hostContext = context;
 
-   //Custom max number of threads
-   maxThreads = 0;
+   ZeroMemory((void*)workers, sizeof(workers));
+   numberOfSlots = 0;
+
+   numberOfQueuedItems = 0;
+   numIdleThreads = 0;
+   numThreads = 0;
+   numBusyThreads = 0;
+   numBlockedThreads = 0;
+   isStarted = 0;
+   isShuttingDown = 0;
+
+   minThreads = GetCpuCount();
+   // See http://msdn.microsoft.com/en-us/library/windows/desktop/ms684957%28v=vs.85%29.aspx
+   maxThreads = MAX_THREADPOOL_WORKERS;
+   targetThreads = minThreads;
+
+   completedSinceLastSample = 0;
+   lastThroughput = 0.0;
+   climbDirection = 1;
+
+   QueryPerformanceFrequency(&performanceFrequency);
+
+   hWorkAvailable = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+   if (!hWorkAvailable)
+      Logger::Critical("Failed to create semaphore: %d", GetLastError());
+
+   hShutdownEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+   if (!hShutdownEvent)
+      Logger::Critical("CreateEvent error: %d", GetLastError());
 }
 
 SHThreadpoolManager::~SHThreadpoolManager() {
+   // Workers and the controller hold a reference to us, so when we get here
+   // they are all gone. Items still in the global queue are freed by it.
+   for (int i = 0; i < MAX_THREADPOOL_WORKERS; ++i) {
+      if (workers[i]) {
+         WorkItem* item;
+         while ((item = workers[i]->localQueue.Pop()) != NULL)
+            delete item;
+         delete workers[i];
+      }
+   }
+
+   if (hWorkAvailable)
+      CloseHandle(hWorkAvailable);
+   if (hShutdownEvent)
+      CloseHandle(hShutdownEvent);
+}
+
+void SHThreadpoolManager::Shutdown() {
+   if (InterlockedExchange(&isShuttingDown, 1) == 1)
+      return;
+
+   SetEvent(hShutdownEvent);
+   LONG threads = numThreads;
+   if (threads > 0)
+      ReleaseSemaphore(hWorkAvailable, threads, NULL);
+}
+
+// Shared by the items of one RunBenchmark
+struct ThreadpoolBenchmark {
+   LONGLONG workTicks;
+   volatile LONG remaining;
+   HANDLE hDone;
+   LONGLONG* startedAt;
+};
+
+struct ThreadpoolBenchmarkItem {
+   ThreadpoolBenchmark* benchmark;
+   LONG index;
+};
+
+static DWORD __stdcall BenchmarkWorkItem(LPVOID lpArgs) {
+   ThreadpoolBenchmarkItem* item = (ThreadpoolBenchmarkItem*)lpArgs;
+   ThreadpoolBenchmark* benchmark = item->benchmark;
+
+   LARGE_INTEGER now;
+   QueryPerformanceCounter(&now);
+   benchmark->startedAt[item->index] = now.QuadPart;
+
+   // Spin instead of sleeping: the item holds its worker like a CPU-bound one would
+   LONGLONG until = now.QuadPart + benchmark->workTicks;
+   while (now.QuadPart < until)
+      QueryPerformanceCounter(&now);
+
+   if (InterlockedDecrement(&benchmark->remaining) == 0)
+      SetEvent(benchmark->hDone);
+   return 0;
+}
+
+LONGLONG SHThreadpoolManager::RunBenchmark(LONG count, LONG workMicroseconds, std::vector<LONG>& queueLatencies) {
+   queueLatencies.clear();
+   if (count <= 0)
+      return 0;
+
+   ThreadpoolBenchmark benchmark;
+   benchmark.workTicks = workMicroseconds * performanceFrequency.QuadPart / 1000000;
+   benchmark.remaining = count;
+   benchmark.hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+   if (benchmark.hDone == NULL) {
+      Logger::Error("CreateEvent error: %d", GetLastError());
+      return -1;
+   }
+
+   std::vector<LONGLONG> queuedAt(count);
+   std::vector<LONGLONG> startedAt(count);
+   std::vector<ThreadpoolBenchmarkItem> items(count);
+   benchmark.startedAt = &startedAt[0];
+
+   LARGE_INTEGER start, end, now;
+   QueryPerformanceCounter(&start);
+
+   LONG queued = 0;
+   for (; queued < count; ++queued) {
+      items[queued].benchmark = &benchmark;
+      items[queued].index = queued;
+      QueryPerformanceCounter(&now);
+      queuedAt[queued] = now.QuadPart;
+      HRESULT hr = QueueUserWorkItem(BenchmarkWorkItem, &items[queued], 0);
+      if (FAILED(hr)) {
+         Logger::Error("QueueUserWorkItem failed: HRESULT %x", hr);
+         break;
+      }
+   }
+   if (queued < count) {
+      // The items already queued use our state: wait for them anyway
+      LONG missing = count - queued;
+      if (InterlockedExchangeAdd(&benchmark.remaining, -missing) == missing)
+         SetEvent(benchmark.hDone);
+   }
+   WaitForSingleObject(benchmark.hDone, INFINITE);
+
+   QueryPerformanceCounter(&end);
+   CloseHandle(benchmark.hDone);
+   if (queued < count)
+      return -1;
+
+   queueLatencies.resize(count);
+   for (LONG i = 0; i < count; ++i)
+      queueLatencies[i] = (LONG)((startedAt[i] - queuedAt[i]) * 1000000 / performanceFrequency.QuadPart);
+   return (end.QuadPart - start.QuadPart) * 1000000 / performanceFrequency.QuadPart;
 }
 
 // IUnknown functions
@@ -45,11 +193,337 @@ STDMETHODIMP SHThreadpoolManager::QueryInterface(const IID &riid, void **ppvObje
    return E_NOINTERFACE;
 }
 
+// Pool internals
+
+void SHThreadpoolManager::EnsureStarted() {
+   if (isStarted)
+      return;
+
+   if (InterlockedCompareExchange(&isStarted, 1, 0) == 0) {
+      // The controller keeps us alive as long as it runs
+      AddRef();
+      HANDLE hThread = CreateThread(NULL, 0, ControllerThreadFunc, this, 0, NULL);
+      if (hThread == NULL) {
+         Logger::Error("Threadpool controller creation failed. Error: %d", GetLastError());
+         Release();
+      }
+      else {
+         CloseHandle(hThread);
+      }
+   }
+}
+
+SHThreadpoolManager::Worker* SHThreadpoolManager::ClaimWorkerSlot() {
+   for (int i = 0; i < MAX_THREADPOOL_WORKERS; ++i) {
+      Worker* worker = workers[i];
+      if (worker == NULL) {
+         Worker* newWorker = new Worker;
+         newWorker->pool = this;
+         newWorker->inUse = 1;
+         newWorker->index = i;
+         if (InterlockedCompareExchangePointer((PVOID volatile*)&workers[i], newWorker, NULL) == NULL) {
+            // Grow the range thieves look at
+            LONG slots = numberOfSlots;
+            while (slots < i + 1) {
+               if (InterlockedCompareExchange(&numberOfSlots, i + 1, slots) == slots)
+                  break;
+               slots = numberOfSlots;
+            }
+            return newWorker;
+         }
+         // Someone else got this slot first
+         delete newWorker;
+         worker = workers[i];
+      }
+
+      if (InterlockedCompareExchange(&worker->inUse, 1, 0) == 0)
+         return worker;
+   }
+   return NULL;
+}
+
+void SHThreadpoolManager::CreateWorkerThread() {
+   LONG n = numThreads;
+   for (;;) {
+      if (n >= (LONG)maxThreads || isShuttingDown)
+         return;
+      if (InterlockedCompareExchange(&numThreads, n + 1, n) == n)
+         break;
+      n = numThreads;
+   }
+
+   Worker* worker = ClaimWorkerSlot();
+   if (worker == NULL) {
+      Logger::Error("No free threadpool worker slot");
+      InterlockedDecrement(&numThreads);
+      return;
+   }
+
+   // Each worker keeps us alive as long as it runs
+   AddRef();
+   HANDLE hThread = CreateThread(NULL, 0, WorkerThreadFunc, (LPVOID)worker, 0, NULL);
+
+   if (hThread == NULL) {
+      Logger::Error("CreateWorkerThread failed. Error: %d", GetLastError());
+      InterlockedExchange(&worker->inUse, 0);
+      InterlockedDecrement(&numThreads);
+      Release();
+   }
+   else {
+      // We do not need the reference; close it so the thread can die when he decides to
+      CloseHandle(hThread);
+   }
+}
+
+void SHThreadpoolManager::WakeUpWorker() {
+   if (numIdleThreads > 0) {
+      ReleaseSemaphore(hWorkAvailable, 1, NULL);
+   }
+   else if (numThreads < targetThreads) {
+      CreateWorkerThread();
+   }
+}
+
+void SHThreadpoolManager::EnqueueGlobal(WorkItem* item) {
+   globalQueue.Enqueue(item);
+}
+
+WorkItem* SHThreadpoolManager::DequeueGlobal() {
+   return globalQueue.Dequeue();
+}
+
+// Items from the local deques bypass the fair queue: they still have to respect
+// their AppDomain cap. If they cannot run now, they wait in the global queue, where
+// ReleaseSlot will notice them.
+WorkItem* SHThreadpoolManager::AcquireOrRequeue(WorkItem* item) {
+   if (item == NULL || globalQueue.TryAcquireSlot(item))
+      return item;
+
+   EnqueueGlobal(item);
+   return NULL;
+}
+
+WorkItem* SHThreadpoolManager::StealWork(Worker* thief) {
+   LONG slots = numberOfSlots;
+   if (slots <= 1)
+      return NULL;
+
+   // Start from a different victim each time, so thieves do not all pile on the same one
+   LONG start = (LONG)((GetTickCount() + thief->index * 7) % (DWORD)slots);
+   for (LONG i = 0; i < slots; ++i) {
+      Worker* victim = workers[(start + i) % slots];
+      if (victim == NULL || victim == thief)
+         continue;
+
+      WorkItem* item = victim->localQueue.Steal();
+      if (item) {
+         item = AcquireOrRequeue(item);
+         if (item)
+            return item;
+      }
+   }
+   return NULL;
+}
+
+WorkItem* SHThreadpoolManager::FindWork(Worker* worker) {
+   // Our own work first (LIFO, it is hot in cache), then the fair global queue, then steal
+   WorkItem* item;
+   while ((item = worker->localQueue.Pop()) != NULL) {
+      item = AcquireOrRequeue(item);
+      if (item)
+         return item;
+   }
+
+   item = DequeueGlobal();
+   if (item == NULL)
+      item = StealWork(worker);
+   return item;
+}
+
+bool SHThreadpoolManager::ShouldRetire(bool idleTimeout) {
+   // An idle thread goes away if we have more than the minimum; a busy one if
+   // the hill climbing decided we have more threads than needed
+   LONG limit = idleTimeout ? (LONG)minThreads : targetThreads;
+   if (limit < (LONG)minThreads)
+      limit = minThreads;
+
+   LONG n = numThreads;
+   while (n > limit) {
+      if (InterlockedCompareExchange(&numThreads, n - 1, n) == n)
+         return true;
+      n = numThreads;
+   }
+   return false;
+}
+
+void SHThreadpoolManager::RunWorkItem(WorkItem* item) {
+   InterlockedIncrement(&numBusyThreads);
+   InterlockedDecrement(&numberOfQueuedItems);
+
+   LARGE_INTEGER start, end;
+   QueryPerformanceCounter(&start);
+
+   currentDomain = item->domain;
+   item->function(item->context);
+   currentDomain = NULL;
+
+   QueryPerformanceCounter(&end);
+   LONG elapsedMicroseconds = (LONG)((end.QuadPart - start.QuadPart) * 1000000 / performanceFrequency.QuadPart);
+
+   hostContext->OnWorkItemCompleted(item->appDomainId);
+   bool domainHasWaitingItems = globalQueue.ReleaseSlot(item, elapsedMicroseconds);
+   delete item;
+
+   if (domainHasWaitingItems)
+      WakeUpWorker();
+
+   InterlockedIncrement(&completedSinceLastSample);
+   InterlockedDecrement(&numBusyThreads);
+}
+
+void SHThreadpoolManager::OnWorkerBlocking() {
+   Worker* worker = (Worker*)currentWorker;
+   DomainWorkQueue* domain = currentDomain;
+   if (worker == NULL || domain == NULL)
+      return;
+
+   SHThreadpoolManager* pool = worker->pool;
+   InterlockedIncrement(&pool->numBlockedThreads);
+   pool->globalQueue.OnItemBlocked(domain);
+   if (pool->numberOfQueuedItems > 0)
+      pool->WakeUpWorker();
+}
+
+void SHThreadpoolManager::OnWorkerUnblocked() {
+   Worker* worker = (Worker*)currentWorker;
+   DomainWorkQueue* domain = currentDomain;
+   if (worker == NULL || domain == NULL)
+      return;
+
+   SHThreadpoolManager* pool = worker->pool;
+   pool->globalQueue.OnItemUnblocked(domain);
+   InterlockedDecrement(&pool->numBlockedThreads);
+}
+
+DWORD __stdcall SHThreadpoolManager::WorkerThreadFunc(LPVOID lpArgs) {
+   Worker* me = (Worker*)lpArgs;
+   SHThreadpoolManager* pool = me->pool;
+   currentWorker = me;
+
+   bool retired = false;
+   while (!retired) {
+      WorkItem* item = pool->FindWork(me);
+      if (item) {
+         pool->RunWorkItem(item);
+         retired = pool->ShouldRetire(false);
+         continue;
+      }
+
+      if (pool->isShuttingDown)
+         break;
+
+      InterlockedIncrement(&pool->numIdleThreads);
+      // Look again: something may have been queued after we looked, but before
+      // we were counted as idle (and therefore nobody signaled us)
+      item = pool->FindWork(me);
+      if (item) {
+         InterlockedDecrement(&pool->numIdleThreads);
+         pool->RunWorkItem(item);
+         retired = pool->ShouldRetire(false);
+         continue;
+      }
+
+      DWORD dwResult = WaitForSingleObject(pool->hWorkAvailable, WORKER_IDLE_TIMEOUT);
+      InterlockedDecrement(&pool->numIdleThreads);
+
+      if (dwResult == WAIT_TIMEOUT)
+         retired = pool->ShouldRetire(true);
+   }
+
+   if (!retired) {
+      // Shutting down
+      InterlockedDecrement(&pool->numThreads);
+   }
+
+   // Give away what is left in our queue, so it is not stranded until
+   // someone else claims this slot
+   WorkItem* item;
+   bool handedOver = false;
+   while ((item = me->localQueue.Pop()) != NULL) {
+      pool->EnqueueGlobal(item);
+      handedOver = true;
+   }
+   if (handedOver)
+      pool->WakeUpWorker();
+
+   currentWorker = NULL;
+   InterlockedExchange(&me->inUse, 0);
+   pool->Release();
+   return 0;
+}
+
+// Hill climbing, simplified: every interval we look at how many items were completed.
+// If the last move (adding or removing a thread) improved throughput, we keep moving
+// in that direction; if it made things worse, we go back. If there is work waiting
+// and nothing completed at all, or every busy thread is blocked in a host wait, we
+// inject a new one.
+void SHThreadpoolManager::AdjustThreadCount() {
+   LONG completed = InterlockedExchange(&completedSinceLastSample, 0);
+   double throughput = completed * 1000.0 / HILL_CLIMBING_INTERVAL;
+   LONG queued = numberOfQueuedItems;
+   LONG target = targetThreads;
+
+   if (queued > 0) {
+      if (numIdleThreads == 0 && (completed == 0 || numBlockedThreads >= numBusyThreads)) {
+         // Starvation (if some threads are idle, what is queued is waiting for
+         // its AppDomain cap: more threads would not help). Blocked items do not
+         // count against the cap, so what they wait for is never held back by it
+         ++target;
+         climbDirection = 1;
+      }
+      else if (throughput > lastThroughput * (1.0 + HILL_CLIMBING_THRESHOLD)) {
+         target += climbDirection;
+      }
+      else if (throughput < lastThroughput * (1.0 - HILL_CLIMBING_THRESHOLD)) {
+         climbDirection = -climbDirection;
+         target += climbDirection;
+      }
+   }
+   else {
+      // No backlog: slowly drift back to the minimum; idle threads will time out
+      --target;
+   }
+
+   if (target < (LONG)minThreads)
+      target = minThreads;
+   if (target > (LONG)maxThreads)
+      target = maxThreads;
+
+   lastThroughput = throughput;
+   InterlockedExchange(&targetThreads, target);
+
+   LONG missing = target - numThreads;
+   while (queued > 0 && missing-- > 0)
+      CreateWorkerThread();
+}
+
+DWORD __stdcall SHThreadpoolManager::ControllerThreadFunc(LPVOID lpArgs) {
+   SHThreadpoolManager* pool = (SHThreadpoolManager*)lpArgs;
+
+   while (WaitForSingleObject(pool->hShutdownEvent, HILL_CLIMBING_INTERVAL) == WAIT_TIMEOUT) {
+      pool->AdjustThreadCount();
+      pool->globalQueue.Collect();
+   }
+
+   pool->Release();
+   return 0;
+}
+
 // IHostThreadpoolManager functions
 
-// This implementation uses the standard threadpool.
-// Alternatively, it may be possible to use the NT6 custom thread pools
-// See http://msdn.microsoft.com/en-us/library/windows/desktop/ms686980%28v=vs.85%29.aspx
+// This implementation uses our own pool: each worker has a work-stealing deque; work
+// queued from outside the pool goes into a global queue, fair across AppDomains.
+// Work items are attributed to the AppDomain of the thread that queued them.
 
 STDMETHODIMP SHThreadpoolManager::QueueUserWorkItem(
    /* [in] */ LPTHREAD_START_ROUTINE Function,
@@ -58,18 +532,45 @@ STDMETHODIMP SHThreadpoolManager::QueueUserWorkItem(
 
    Logger::Info("In QueueUserWorkItem");
 
-   if (maxThreads > 0) {
-      WT_SET_MAX_THREADPOOL_THREADS(Flags, maxThreads);
+   if (isShuttingDown)
+      return E_UNEXPECTED;
+
+   EnsureStarted();
+
+   Worker* worker = (Worker*)currentWorker;
+   if (worker != NULL && worker->pool != this)
+      worker = NULL;
+
+   WorkItem* item = new WorkItem;
+   if (!item) {
+      Logger::Error("Failed to allocate work item");
+      return E_OUTOFMEMORY;
    }
+   item->function = Function;
+   item->context = Context;
+   DomainWorkQueue* domain = worker ? currentDomain : NULL;
+   item->appDomainId = hostContext->OnWorkItemQueued(GetCurrentThreadId(), domain ? domain->appDomainId : 0);
+   if (domain && domain->appDomainId == item->appDomainId)
+      globalQueue.AttachTo(item, domain);
+   else
+      globalQueue.Attach(item);
 
-   if (::QueueUserWorkItem(Function, Context, Flags)) {
-      return S_OK;
+   InterlockedIncrement(&numberOfQueuedItems);
+   if (worker) {
+      worker->localQueue.Push(item);
    }
    else {
-      DWORD errorCode = GetLastError();
-      Logger::Error("QueueUserWorkItem error: %d", errorCode);
-      return HRESULT_FROM_WIN32(errorCode);
+      EnqueueGlobal(item);
+   }
+
+   // A long function will hold a thread for a while: do not wait for the hill climbing
+   // to notice
+   if ((Flags & WT_EXECUTELONGFUNCTION) && numIdleThreads == 0) {
+      CreateWorkerThread();
    }
+
+   WakeUpWorker();
+   return S_OK;
 }
 
 STDMETHODIMP SHThreadpoolManager::SetMaxThreads(
@@ -77,7 +578,12 @@ STDMETHODIMP SHThreadpoolManager::SetMaxThreads(
 
    Logger::Info("SetMaxThreads: %d", dwMaxWorkerThreads);
 
+   if (dwMaxWorkerThreads < minThreads || dwMaxWorkerThreads > MAX_THREADPOOL_WORKERS)
+      return E_INVALIDARG;
+
    maxThreads = dwMaxWorkerThreads;
+   if (targetThreads > (LONG)maxThreads)
+      InterlockedExchange(&targetThreads, maxThreads);
    return S_OK;
 }
 
@@ -85,37 +591,44 @@ STDMETHODIMP SHThreadpoolManager::GetMaxThreads(
    /* [out] */ DWORD *pdwMaxWorkerThreads) {
 
    Logger::Info("In GetMaxThreads");
-   if (maxThreads > 0) {
-      // Return the supplied value
-      *pdwMaxWorkerThreads = maxThreads;
-   }
-   else {
-      // See http://msdn.microsoft.com/en-us/library/windows/desktop/ms684957%28v=vs.85%29.aspx
-      *pdwMaxWorkerThreads = 512;      
-   }
+   if (pdwMaxWorkerThreads == NULL)
+      return E_POINTER;
 
+   *pdwMaxWorkerThreads = maxThreads;
    return S_OK;
 }
 
-
-// We can choose to ignore the following requests 
-// (and we will, since the standard Win32 API gives no way of setting/getting this info)
 STDMETHODIMP SHThreadpoolManager::GetAvailableThreads(
-   /* [out] */ DWORD * /*pdwAvailableWorkerThreads*/) {
+   /* [out] */ DWORD *pdwAvailableWorkerThreads) {
    Logger::Info("In GetAvailableThreads");
-   return E_NOTIMPL;
+   if (pdwAvailableWorkerThreads == NULL)
+      return E_POINTER;
+
+   LONG busy = numBusyThreads;
+   *pdwAvailableWorkerThreads = (busy < (LONG)maxThreads) ? (maxThreads - busy) : 0;
+   return S_OK;
 }
 
 STDMETHODIMP SHThreadpoolManager::SetMinThreads(
-   /* [in] */ DWORD /*dwMinIOCompletionThreads*/) {
+   /* [in] */ DWORD dwMinWorkerThreads) {
 
-   Logger::Info("In SetMinThreads");   
-   return E_NOTIMPL;
+   Logger::Info("In SetMinThreads: %d", dwMinWorkerThreads);
+   if (dwMinWorkerThreads > maxThreads)
+      return E_INVALIDARG;
+
+   minThreads = dwMinWorkerThreads;
+   if (targetThreads < (LONG)minThreads)
+      InterlockedExchange(&targetThreads, minThreads);
+   return S_OK;
 }
 
 STDMETHODIMP SHThreadpoolManager::GetMinThreads(
-   /* [out] */ DWORD* /*pdwMinIOCompletionThreads*/) {
+   /* [out] */ DWORD* pdwMinWorkerThreads) {
 
    Logger::Info("In GetMinThreads");
-   return E_NOTIMPL;
+   if (pdwMinWorkerThreads == NULL)
+      return E_POINTER;
+
+   *pdwMinWorkerThreads = minThreads;
+   return S_OK;
 }
@@ -1,22 +1,97 @@
 
-
 #ifndef SH_THREADPOOL_MANAGER_H_INCLUDED
 #define SH_THREADPOOL_MANAGER_H_INCLUDED
 
 #include "../Common.h"
 #include "../HostContext.h"
 
+#include "WorkStealingQueue.h"
+#include "FairWorkQueue.h"
+
+#include <vector>
+
+const int MAX_THREADPOOL_WORKERS = 512;
+
 class SHThreadpoolManager : public IHostThreadpoolManager {
 
 private:
    volatile LONG m_cRef;
-   DWORD maxThreads;
    HostContext* hostContext;
 
+   struct Worker {
+      SHThreadpoolManager* pool;
+      WorkStealingQueue localQueue;
+      // 0 = free slot, 1 = owned by a running thread
+      volatile LONG inUse;
+      int index;
+   };
+
+   // Worker slots are allocated lazily and never freed while the pool is alive:
+   // a thief may be stealing from the deque of a worker that is just retiring
+   Worker* volatile workers[MAX_THREADPOOL_WORKERS];
+   volatile LONG numberOfSlots;
+
+   // Items queued from threads that are not pool workers, or that could not run
+   // because their AppDomain was at its cap
+   FairWorkQueue globalQueue;
+   // Items queued (anywhere) but not yet started
+   volatile LONG numberOfQueuedItems;
+
+   HANDLE hWorkAvailable;
+   HANDLE hShutdownEvent;
+   volatile LONG isStarted;
+   volatile LONG numIdleThreads;
+
+   volatile LONG numThreads;
+   volatile LONG numBusyThreads;
+   // Busy threads blocked in a host wait (see OnWorkerBlocking)
+   volatile LONG numBlockedThreads;
+   volatile LONG targetThreads;
+   DWORD minThreads;
+   DWORD maxThreads;
+   volatile LONG isShuttingDown;
+
+   LARGE_INTEGER performanceFrequency;
+
+   // Hill climbing state
+   volatile LONG completedSinceLastSample;
+   double lastThroughput;
+   LONG climbDirection;
+
+   void EnsureStarted();
+   Worker* ClaimWorkerSlot();
+   void CreateWorkerThread();
+   void WakeUpWorker();
+   void EnqueueGlobal(WorkItem* item);
+   WorkItem* DequeueGlobal();
+   WorkItem* AcquireOrRequeue(WorkItem* item);
+   WorkItem* FindWork(Worker* worker);
+   WorkItem* StealWork(Worker* thief);
+   bool ShouldRetire(bool idleTimeout);
+   void RunWorkItem(WorkItem* item);
+   void AdjustThreadCount();
+
+   static DWORD __stdcall WorkerThreadFunc(LPVOID lpArgs);
+   static DWORD __stdcall ControllerThreadFunc(LPVOID lpArgs);
+
 public:
    SHThreadpoolManager(HostContext* context);
    ~SHThreadpoolManager();
 
+   void Shutdown();
+
+   // Called by HostWait and Sleep around a blocking wait. If the thread is a pool worker,
+   // its work item stops counting against the cap of its AppDomain while it is blocked,
+   // and someone else picks up the work queued meanwhile (which it may be waiting for)
+   static void OnWorkerBlocking();
+   static void OnWorkerUnblocked();
+
+   // Queues count synthetic work items from the calling thread (each one keeps the CPU busy
+   // for workMicroseconds) and waits for all of them. Returns the elapsed time in
+   // microseconds, or -1. queueLatencies gets, for each item, the microseconds between
+   // its QueueUserWorkItem and the start of its execution
+   LONGLONG RunBenchmark(LONG count, LONG workMicroseconds, std::vector<LONG>& queueLatencies);
+
    // IUnknown functions
    STDMETHODIMP_(DWORD) AddRef();
    STDMETHODIMP_(DWORD) Release();
@@ -38,10 +113,10 @@ public:
       /* [out] */ DWORD *pdwAvailableWorkerThreads);
 
    STDMETHODIMP SetMinThreads(
-      /* [in] */ DWORD dwMinIOCompletionThreads);
+      /* [in] */ DWORD dwMinWorkerThreads);
 
    STDMETHODIMP GetMinThreads(
-      /* [out] */ DWORD *pdwMinIOCompletionThreads);
+      /* [out] */ DWORD *pdwMinWorkerThreads);
 
 
 };
@@ -0,0 +1,169 @@
+
+#include "TimerWheel.h"
+#include "../CrstLock.h"
+#include "../Logger.h"
+
+TimerWheel::TimerWheel(TimerWheelCallback callback, LPVOID context) {
+   this->callback = callback;
+   this->context = context;
+
+   ZeroMemory(slots, sizeof(slots));
+   currentTick = GetTickCount64();
+
+   hThread = NULL;
+   isExiting = 0;
+
+   hWakeUp = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+   if (hWakeUp == NULL)
+      Logger::Critical("CreateEvent error: %d", GetLastError());
+
+   crst = new CRITICAL_SECTION;
+   if (!crst)
+      Logger::Critical("Failed to allocate critical sections");
+   InitializeCriticalSection(crst);
+}
+
+TimerWheel::~TimerWheel() {
+   Stop();
+
+   for (auto it = timers.begin(); it != timers.end(); ++it)
+      delete it->second;
+
+   if (crst)
+      DeleteCriticalSection(crst);
+   if (hWakeUp)
+      CloseHandle(hWakeUp);
+}
+
+bool TimerWheel::Start() {
+   hThread = CreateThread(NULL, 0, TimerThreadFunc, this, 0, NULL);
+   if (hThread == NULL) {
+      Logger::Error("Timer thread creation failed. Error: %d", GetLastError());
+      return false;
+   }
+   return true;
+}
+
+void TimerWheel::Stop() {
+   if (hThread == NULL)
+      return;
+
+   InterlockedExchange(&isExiting, 1);
+   SetEvent(hWakeUp);
+   WaitForSingleObject(hThread, INFINITE);
+   CloseHandle(hThread);
+   hThread = NULL;
+}
+
+void TimerWheel::Link(TimerWheelEntry* entry) {
+   TimerWheelEntry** slot = &slots[entry->deadline & (TIMER_WHEEL_SLOTS - 1)];
+   entry->prev = NULL;
+   entry->next = *slot;
+   if (*slot)
+      (*slot)->prev = entry;
+   *slot = entry;
+}
+
+void TimerWheel::Unlink(TimerWheelEntry* entry) {
+   if (entry->prev)
+      entry->prev->next = entry->next;
+   else
+      slots[entry->deadline & (TIMER_WHEEL_SLOTS - 1)] = entry->next;
+   if (entry->next)
+      entry->next->prev = entry->prev;
+}
+
+void TimerWheel::Arm(DWORD key, DWORD dwMilliseconds, LONG cookie) {
+   {
+      CrstLock lock(crst);
+
+      TimerWheelEntry* entry;
+      auto it = timers.find(key);
+      if (it != timers.end()) {
+         entry = it->second;
+         Unlink(entry);
+      }
+      else {
+         entry = new TimerWheelEntry;
+         entry->key = key;
+         timers.insert(std::make_pair(key, entry));
+      }
+
+      entry->cookie = cookie;
+      // Never in the past: the slot for currentTick has been processed already
+      entry->deadline = GetTickCount64() + dwMilliseconds;
+      if (entry->deadline <= currentTick)
+         entry->deadline = currentTick + 1;
+      Link(entry);
+   }
+   // The thread may be sleeping past our deadline
+   SetEvent(hWakeUp);
+}
+
+bool TimerWheel::Cancel(DWORD key) {
+   CrstLock lock(crst);
+
+   auto it = timers.find(key);
+   if (it == timers.end())
+      return false;
+
+   Unlink(it->second);
+   delete it->second;
+   timers.erase(it);
+   // No need to wake the thread up: at worst, it wakes up for an empty slot
+   return true;
+}
+
+DWORD TimerWheel::Advance(ULONGLONG now, std::vector<std::pair<DWORD, LONG> >& expired) {
+   CrstLock lock(crst);
+
+   if (now > currentTick) {
+      // Visit each slot between the last tick and now (at most once)
+      ULONGLONG ticks = now - currentTick;
+      if (ticks > TIMER_WHEEL_SLOTS)
+         ticks = TIMER_WHEEL_SLOTS;
+
+      for (ULONGLONG tick = now - ticks + 1; tick <= now; ++tick) {
+         TimerWheelEntry* entry = slots[tick & (TIMER_WHEEL_SLOTS - 1)];
+         while (entry) {
+            TimerWheelEntry* next = entry->next;
+            if (entry->deadline <= now) {
+               expired.push_back(std::make_pair(entry->key, entry->cookie));
+               Unlink(entry);
+               timers.erase(entry->key);
+               delete entry;
+            }
+            entry = next;
+         }
+      }
+      currentTick = now;
+   }
+
+   if (timers.empty())
+      return INFINITE;
+
+   // Sleep until the first occupied slot with a timer due in this revolution
+   for (ULONGLONG tick = now + 1; tick < now + TIMER_WHEEL_SLOTS; ++tick) {
+      for (TimerWheelEntry* entry = slots[tick & (TIMER_WHEEL_SLOTS - 1)]; entry; entry = entry->next) {
+         if (entry->deadline <= tick)
+            return (DWORD)(tick - now);
+      }
+   }
+   return TIMER_WHEEL_SLOTS;
+}
+
+DWORD __stdcall TimerWheel::TimerThreadFunc(LPVOID lpArgs) {
+   TimerWheel* me = (TimerWheel*)lpArgs;
+   std::vector<std::pair<DWORD, LONG> > expired;
+
+   while (!me->isExiting) {
+      DWORD dwWait = me->Advance(GetTickCount64(), expired);
+
+      for (auto it = expired.begin(); it != expired.end(); ++it)
+         me->callback(it->first, it->second, me->context);
+      expired.clear();
+
+      WaitForSingleObject(me->hWakeUp, dwWait);
+   }
+   return 0;
+}
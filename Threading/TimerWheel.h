@@ -0,0 +1,73 @@
+#ifndef SH_TIMER_WHEEL_H_INCLUDED
+#define SH_TIMER_WHEEL_H_INCLUDED
+
+#include "../Common.h"
+
+#include <unordered_map>
+#include <vector>
+
+// Must be a power of 2. With 1 ms slots, one revolution is ~1 s; longer deadlines
+// just stay in their slot for more revolutions
+const int TIMER_WHEEL_SLOTS = 1024;
+
+// cookie is the value given to Arm: it lets the callback tell which arming expired
+typedef void (*TimerWheelCallback)(DWORD key, LONG cookie, LPVOID context);
+
+struct TimerWheelEntry {
+   DWORD key;
+   LONG cookie;
+   ULONGLONG deadline; // GetTickCount64 milliseconds
+   TimerWheelEntry* next;
+   TimerWheelEntry* prev;
+};
+
+// A hashed timing wheel (Varghese and Lauck, "Hashed and Hierarchical Timing Wheels"):
+// one slot per millisecond, holding the timers that expire at that millisecond,
+// modulo the wheel size. Arm and Cancel are O(1); the timer thread sleeps until the
+// next occupied slot (or forever, when nothing is armed) and invokes the callback
+// for each expired key, outside the wheel lock: an expiry can therefore be delivered
+// after the key has been cancelled or armed again, and the callback must use the cookie
+// to recognize stale expiries.
+// One timer per key: arming a key again moves its deadline (and replaces its cookie).
+// Slots are 1 ms wide, but the clock is not: GetTickCount64, and the timeout of the
+// wait the thread sleeps on, advance with the system timer interrupt (15.6 ms by default,
+// finer only while some process holds a timeBeginPeriod request). A timer fires up to one
+// clock tick before or after its due time; good enough for snippet deadlines (seconds),
+// not for anything that needs millisecond precision.
+class TimerWheel {
+private:
+   LPCRITICAL_SECTION crst;
+   TimerWheelEntry* slots[TIMER_WHEEL_SLOTS];
+   std::unordered_map<DWORD, TimerWheelEntry*> timers;
+   // Everything up to this tick has been expired already
+   ULONGLONG currentTick;
+
+   TimerWheelCallback callback;
+   LPVOID context;
+
+   HANDLE hWakeUp;
+   HANDLE hThread;
+   volatile LONG isExiting;
+
+   void Link(TimerWheelEntry* entry);
+   void Unlink(TimerWheelEntry* entry);
+   // Removes the timers due at "now" and returns their keys; returns how long we can sleep
+   DWORD Advance(ULONGLONG now, std::vector<std::pair<DWORD, LONG> >& expired);
+
+   static DWORD __stdcall TimerThreadFunc(LPVOID lpArgs);
+
+public:
+   TimerWheel(TimerWheelCallback callback, LPVOID context);
+   ~TimerWheel();
+
+   // Starts the timer thread
+   bool Start();
+   // Stops the timer thread; timers still armed never fire
+   void Stop();
+
+   void Arm(DWORD key, DWORD dwMilliseconds, LONG cookie);
+   // Returns true if the timer was armed and had not fired yet
+   bool Cancel(DWORD key);
+};
+
+#endif //SH_TIMER_WHEEL_H_INCLUDED
@@ -0,0 +1,139 @@
+
+#ifndef SH_WORK_STEALING_QUEUE_H_INCLUDED
+#define SH_WORK_STEALING_QUEUE_H_INCLUDED
+
+#include "../Common.h"
+
+struct DomainWorkQueue;
+
+struct WorkItem {
+   LPTHREAD_START_ROUTINE function;
+   PVOID context;
+   // The AppDomain that submitted this item (0 if we do not know it)
+   DWORD appDomainId;
+   // Scheduling state of that AppDomain (see FairWorkQueue)
+   DomainWorkQueue* domain;
+};
+
+// A Chase-Lev work-stealing deque.
+// See "Dynamic Circular Work-Stealing Deque", Chase and Lev, SPAA 2005
+// The owner (a pool worker) pushes and pops at the bottom, without locks and (almost always)
+// without interlocked operations; other workers steal from the top, with a CAS.
+// Indexes are free-running and wrap around: we only ever look at their difference.
+class WorkStealingQueue {
+private:
+   struct Buffer {
+      LONG mask;
+      WorkItem** items;
+      // Buffers are never freed while the queue is alive: a thief may still be reading
+      // from an old one after the owner has grown the queue
+      Buffer* previous;
+   };
+
+   volatile LONG top;
+   volatile LONG bottom;
+   Buffer* volatile buffer;
+
+   static const LONG INITIAL_SIZE = 64;
+
+   static LONG Distance(LONG from, LONG to) {
+      return (LONG)((ULONG)to - (ULONG)from);
+   }
+
+   static Buffer* NewBuffer(LONG size, Buffer* previous) {
+      Buffer* b = new Buffer;
+      b->mask = size - 1;
+      b->items = new WorkItem*[size];
+      b->previous = previous;
+      return b;
+   }
+
+   Buffer* Grow(Buffer* old, LONG t, LONG b) {
+      Buffer* bigger = NewBuffer((old->mask + 1) * 2, old);
+      for (LONG i = t; i != b; ++i)
+         bigger->items[i & bigger->mask] = old->items[i & old->mask];
+      buffer = bigger;
+      return bigger;
+   }
+
+public:
+   WorkStealingQueue() {
+      top = 0;
+      bottom = 0;
+      buffer = NewBuffer(INITIAL_SIZE, NULL);
+   }
+
+   ~WorkStealingQueue() {
+      Buffer* b = buffer;
+      while (b) {
+         Buffer* previous = b->previous;
+         delete [] b->items;
+         delete b;
+         b = previous;
+      }
+   }
+
+   // Owner only
+   void Push(WorkItem* item) {
+      LONG b = bottom;
+      LONG t = top;
+      Buffer* a = buffer;
+      if (Distance(t, b) > a->mask) {
+         a = Grow(a, t, b);
+      }
+      a->items[b & a->mask] = item;
+      // Publish the item before the new bottom
+      MemoryBarrier();
+      bottom = b + 1;
+   }
+
+   // Owner only
+   WorkItem* Pop() {
+      LONG b = bottom - 1;
+      Buffer* a = buffer;
+      bottom = b;
+      // bottom must be visible to thieves before we read top
+      MemoryBarrier();
+      LONG t = top;
+
+      if (Distance(t, b) < 0) {
+         // Empty
+         bottom = b + 1;
+         return NULL;
+      }
+
+      WorkItem* item = a->items[b & a->mask];
+      if (t == b) {
+         // Last item: race against thieves for it
+         if (InterlockedCompareExchange(&top, t + 1, t) != t)
+            item = NULL;
+         bottom = t + 1;
+      }
+      return item;
+   }
+
+   // Any thread
+   WorkItem* Steal() {
+      LONG t = top;
+      MemoryBarrier();
+      LONG b = bottom;
+
+      if (Distance(t, b) <= 0)
+         return NULL;
+
+      Buffer* a = buffer;
+      WorkItem* item = a->items[t & a->mask];
+      if (InterlockedCompareExchange(&top, t + 1, t) != t) {
+         // Lost the race with the owner or another thief
+         return NULL;
+      }
+      return item;
+   }
+
+   // Approximate; good enough for heuristics
+   bool IsEmpty() const {
+      return Distance(top, bottom) <= 0;
+   }
+};
+
+#endif //SH_WORK_STEALING_QUEUE_H_INCLUDED
@@ -3,6 +3,11 @@
 #include "Logger.h"
 
 #include "HostCtrl.h"
+#include "HostContext.h"
+#include "Threading\IoCompletionMgr.h"
+#include "Threading\ThreadpoolMgr.h"
+#include "Assembly\AssemblyScanner.h"
+#include "Assembly\FileStream.h"
 
 #include "tclap/CmdLine.h"
 #include "tclap/ValueArg.h"
@@ -11,13 +16,284 @@
 
 #include <string>
 #include <iostream>
+#include <vector>
+#include <algorithm>
 
 using namespace TCLAP;
 using namespace std;
 
+// Measures the completion engine alone (no CLR): one completion per dequeue, then
+// adaptive batches
+static int RunIoCompletionBenchmark(int numCompletions) {
+   SHIoCompletionManager* iocpManager = new SHIoCompletionManager(NULL);
+   iocpManager->AddRef();
+
+   ULONG batchSizes[] = { 1, IOCP_MAX_BATCH_SIZE };
+   for (int i = 0; i < 2; ++i) {
+      IoCompletionStatistics before, after;
+      iocpManager->GetStatistics(&before);
+      LONGLONG elapsed = iocpManager->RunBenchmark(numCompletions, batchSizes[i]);
+      iocpManager->GetStatistics(&after);
+      if (elapsed < 0) {
+         iocpManager->Shutdown();
+         iocpManager->Release();
+         return -1;
+      }
+
+      LONGLONG batches = after.batches - before.batches;
+      cout << "Max batch size " << batchSizes[i] << ": "
+         << numCompletions << " completions in " << elapsed << " us, "
+         << (elapsed > 0 ? (numCompletions * 1000000LL / elapsed) : 0) << " completions/sec, "
+         << ((double)elapsed * 1000.0 / numCompletions) << " ns/completion, "
+         << (batches > 0 ? ((double)numCompletions / batches) : 0.0) << " completions/batch" << endl;
+   }
+
+   iocpManager->Shutdown();
+   iocpManager->Release();
+   return 0;
+}
+
+// Measures the HostContext bookkeeping alone (no CLR), with a growing number of live domains
+static int RunHostContextBenchmark(int iterations) {
+   // Thread callbacks log at Debug level: keep the console out of the measure
+   LogLevel::Level previousLevel = Logger::SetLevel(LogLevel::Error);
+
+   LONG domainCounts[] = { 10, 100, 1000 };
+   for (int i = 0; i < 3; ++i) {
+      HostContext* hostContext = new HostContext(NULL);
+      hostContext->AddRef();
+      LONGLONG elapsed = hostContext->RunCallbackBenchmark(domainCounts[i], iterations);
+      hostContext->Release();
+
+      cout << domainCounts[i] << " domains: "
+         << iterations << " callback mixes in " << elapsed << " us, "
+         << ((double)elapsed * 1000.0 / iterations) << " ns/mix" << endl;
+   }
+
+   Logger::SetLevel(previousLevel);
+   return 0;
+}
+
+// The value under which percent% of the (sorted) samples fall
+static LONG Percentile(const vector<LONG>& sortedSamples, int percent) {
+   return sortedSamples[(sortedSamples.size() - 1) * percent / 100];
+}
+
+// Measures the host thread pool alone (no CLR): items queued from outside the pool, first
+// empty (scheduling overhead only), then with some CPU work each
+static int RunThreadpoolBenchmark(int numItems) {
+   // QueueUserWorkItem logs at Info level: keep the console out of the measure
+   LogLevel::Level previousLevel = Logger::SetLevel(LogLevel::Error);
+
+   HostContext* hostContext = new HostContext(NULL);
+   hostContext->AddRef();
+   SHThreadpoolManager* threadpoolManager = new SHThreadpoolManager(hostContext);
+   threadpoolManager->AddRef();
+
+   int result = 0;
+   LONG workMicroseconds[] = { 0, 50 };
+   for (int i = 0; i < 2; ++i) {
+      vector<LONG> latencies;
+      LONGLONG elapsed = threadpoolManager->RunBenchmark(numItems, workMicroseconds[i], latencies);
+      if (elapsed < 0) {
+         result = -1;
+         break;
+      }
+
+      sort(latencies.begin(), latencies.end());
+      cout << workMicroseconds[i] << " us of work per item: "
+         << numItems << " items in " << elapsed << " us, "
+         << (elapsed > 0 ? (numItems * 1000000LL / elapsed) : 0) << " items/sec, "
+         << "queue latency p50 " << Percentile(latencies, 50) << " us, p90 " << Percentile(latencies, 90)
+         << " us, p99 " << Percentile(latencies, 99) << " us, max " << latencies.back() << " us" << endl;
+   }
+
+   threadpoolManager->Shutdown();
+   threadpoolManager->Release();
+   hostContext->Release();
+   Logger::SetLevel(previousLevel);
+   return result;
+}
+
+
+
+static bool ReadWholeFile(const wstring& fileName, vector<BYTE>& contents) {
+   HANDLE hFile = ::CreateFile(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (hFile == INVALID_HANDLE_VALUE)
+      return false;
+   LARGE_INTEGER size;
+   DWORD cbRead = 0;
+   bool ok = ::GetFileSizeEx(hFile, &size) && size.QuadPart < MAXLONG;
+   if (ok) {
+      contents.resize((size_t)size.QuadPart);
+      ok = contents.empty() || (::ReadFile(hFile, &contents[0], (DWORD)contents.size(), &cbRead, NULL) && cbRead == contents.size());
+   }
+   ::CloseHandle(hFile);
+   return ok;
+}
+
+// Reads the whole stream, from its current position, in chunks of chunkSize bytes
+static bool ReadAndCompare(IStream* stream, const vector<BYTE>& expected, ULONGLONG from, ULONG chunkSize) {
+   vector<BYTE> buffer(chunkSize);
+   ULONGLONG position = from;
+   for (;;) {
+      ULONG cbRead = 0;
+      if (FAILED(stream->Read(&buffer[0], chunkSize, &cbRead)))
+         return false;
+      if (cbRead == 0)
+         return position == expected.size();
+      if (position + cbRead > expected.size() || memcmp(&buffer[0], &expected[(size_t)position], cbRead) != 0)
+         return false;
+      position += cbRead;
+   }
+}
+
+struct StreamTestThreadData {
+   IStream* stream;
+   const vector<BYTE>* expected;
+   bool passed;
+};
+
+static DWORD WINAPI StreamTestThreadFunc(LPVOID param) {
+   StreamTestThreadData* data = (StreamTestThreadData*)param;
+   const vector<BYTE>& expected = *data->expected;
+   data->passed = true;
+
+   // Random seeks and reads on our own clone, while the other threads do the same
+   srand(::GetCurrentThreadId());
+   for (int i = 0; i < 1000 && data->passed; ++i) {
+      ULONGLONG offset = expected.empty() ? 0 : ((ULONGLONG)rand() * RAND_MAX + rand()) % expected.size();
+      ULONG length = (ULONG)(rand() % 8192) + 1;
+      LARGE_INTEGER move;
+      move.QuadPart = (LONGLONG)offset;
+      vector<BYTE> buffer(length);
+      ULONG cbRead = 0;
+      if (FAILED(data->stream->Seek(move, STREAM_SEEK_SET, NULL)) || FAILED(data->stream->Read(&buffer[0], length, &cbRead))) {
+         data->passed = false;
+         break;
+      }
+      ULONG expectedLength = (ULONG)min((ULONGLONG)length, expected.size() - offset);
+      data->passed = (cbRead == expectedLength) && (cbRead == 0 || memcmp(&buffer[0], &expected[(size_t)offset], cbRead) == 0);
+   }
+   return 0;
+}
+
+// Conformance (reads, seeks, clones, concurrent readers, stat) and read throughput of
+// SHFileStream over an existing file
+static int RunFileStreamTest(const wstring& fileName) {
+   vector<BYTE> expected;
+   if (!ReadWholeFile(fileName, expected)) {
+      cerr << "Cannot read the test file" << endl;
+      return -1;
+   }
 
+   SHFileStream* fileStream = new SHFileStream(fileName.c_str());
+   fileStream->AddRef();
+   if (FAILED(fileStream->OpenRead())) {
+      cerr << "Cannot open the test file" << endl;
+      fileStream->Release();
+      return -1;
+   }
+   IStream* stream = fileStream;
+
+   int failures = 0;
+   LARGE_INTEGER zero;
+   zero.QuadPart = 0;
+   ULARGE_INTEGER newPosition;
+
+   // Sequential reads, with chunks smaller and larger than the read-ahead buffer
+   ULONG chunkSizes[] = { 1, 7, 4096, FILE_STREAM_BUFFER_SIZE - 1, FILE_STREAM_BUFFER_SIZE + 1, 1024 * 1024 };
+   for (int i = 0; i < _countof(chunkSizes); ++i) {
+      stream->Seek(zero, STREAM_SEEK_SET, NULL);
+      bool passed = ReadAndCompare(stream, expected, 0, chunkSizes[i]);
+      cout << "Sequential read, " << chunkSizes[i] << " bytes at a time: " << (passed ? "passed" : "FAILED") << endl;
+      failures += passed ? 0 : 1;
+   }
 
+   // Seeks
+   LARGE_INTEGER move;
+   move.QuadPart = -1;
+   bool passed = (stream->Seek(move, STREAM_SEEK_SET, NULL) == STG_E_INVALIDFUNCTION) &&
+      SUCCEEDED(stream->Seek(zero, STREAM_SEEK_END, &newPosition)) && newPosition.QuadPart == expected.size();
+   move.QuadPart = -(LONGLONG)(expected.size() / 2);
+   passed = passed && SUCCEEDED(stream->Seek(move, STREAM_SEEK_CUR, &newPosition)) &&
+      newPosition.QuadPart == expected.size() - expected.size() / 2 &&
+      ReadAndCompare(stream, expected, newPosition.QuadPart, 4096);
+   move.QuadPart = 0x100000000LL; // Past 4GB: the high part must not be lost
+   passed = passed && SUCCEEDED(stream->Seek(move, STREAM_SEEK_SET, &newPosition)) && newPosition.QuadPart == 0x100000000ULL;
+   cout << "Seek: " << (passed ? "passed" : "FAILED") << endl;
+   failures += passed ? 0 : 1;
+
+   // Clones have their own position
+   move.QuadPart = (LONGLONG)(expected.size() / 3);
+   stream->Seek(move, STREAM_SEEK_SET, NULL);
+   IStream* clone = NULL;
+   passed = SUCCEEDED(stream->Clone(&clone));
+   if (passed) {
+      stream->Seek(zero, STREAM_SEEK_SET, NULL);
+      passed = ReadAndCompare(clone, expected, expected.size() / 3, 4096) && ReadAndCompare(stream, expected, 0, 4096);
+   }
+   cout << "Clone: " << (passed ? "passed" : "FAILED") << endl;
+   failures += passed ? 0 : 1;
+   if (clone)
+      clone->Release();
+
+   // Concurrent readers, each on its own clone
+   const int numThreads = 4;
+   StreamTestThreadData threadData[numThreads];
+   HANDLE threads[numThreads];
+   for (int i = 0; i < numThreads; ++i) {
+      threadData[i].expected = &expected;
+      threadData[i].passed = false;
+      threadData[i].stream = NULL;
+      stream->Clone(&threadData[i].stream);
+      threads[i] = ::CreateThread(NULL, 0, StreamTestThreadFunc, &threadData[i], 0, NULL);
+   }
+   ::WaitForMultipleObjects(numThreads, threads, TRUE, INFINITE);
+   passed = true;
+   for (int i = 0; i < numThreads; ++i) {
+      ::CloseHandle(threads[i]);
+      passed = passed && threadData[i].passed;
+      if (threadData[i].stream)
+         threadData[i].stream->Release();
+   }
+   cout << "Concurrent readers: " << (passed ? "passed" : "FAILED") << endl;
+   failures += passed ? 0 : 1;
+
+   // Stat
+   STATSTG statstg;
+   passed = SUCCEEDED(stream->Stat(&statstg, STATFLAG_DEFAULT)) && statstg.cbSize.QuadPart == expected.size() &&
+      statstg.pwcsName != NULL && fileName == statstg.pwcsName;
+   if (statstg.pwcsName)
+      CoTaskMemFree(statstg.pwcsName);
+   cout << "Stat: " << (passed ? "passed" : "FAILED") << endl;
+   failures += passed ? 0 : 1;
+
+   // Throughput
+   LARGE_INTEGER frequency;
+   ::QueryPerformanceFrequency(&frequency);
+   ULONG throughputChunkSizes[] = { 512, 4096, 1024 * 1024 };
+   vector<BYTE> buffer(1024 * 1024);
+   for (int i = 0; i < _countof(throughputChunkSizes); ++i) {
+      const int repetitions = 10;
+      LARGE_INTEGER start, end;
+      ::QueryPerformanceCounter(&start);
+      for (int r = 0; r < repetitions; ++r) {
+         stream->Seek(zero, STREAM_SEEK_SET, NULL);
+         ULONG cbRead;
+         do {
+            stream->Read(&buffer[0], throughputChunkSizes[i], &cbRead);
+         } while (cbRead > 0);
+      }
+      ::QueryPerformanceCounter(&end);
+      double seconds = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+      cout << "Read throughput, " << throughputChunkSizes[i] << " bytes at a time: "
+         << (seconds > 0 ? (repetitions * (double)expected.size() / (1024 * 1024) / seconds) : 0.0) << " MB/s" << endl;
+   }
 
+   stream->Release();
+   return (failures == 0) ? 0 : -1;
+}
 
 int main(int argc, char* argv [])
 {
@@ -30,6 +306,14 @@ int main(int argc, char* argv [])
    bool useSandbox = true;
    bool testMode = false;
    int serverPort = 4321;
+   int iocpBenchmarkCompletions = 0;
+   int hostContextBenchmarkIterations = 0;
+   int threadpoolBenchmarkItems = 0;
+   string streamTestFileName;
+   string loaderOptimization;
+   string privateLibDirectory;
+   bool prefetchHostAssemblies = false;
+   bool hostIoCompletion = false;
 
    CmdLine cmd("Simple CLR Host", ' ', "1.0");
    try {     
@@ -54,6 +338,35 @@ int main(int argc, char* argv [])
       ValueArg<int> serverPortArg("p", "port", "The port on which this Host will listen for snippet execution requests", false, 4321, "int");
       cmd.add(serverPortArg);
 
+      ValueArg<int> iocpBenchmarkArg("", "iocp-benchmark", "Post this many synthetic completions to the I/O completion manager, print completions/sec and exit", false, 0, "int");
+      cmd.add(iocpBenchmarkArg);
+
+      ValueArg<int> hostContextBenchmarkArg("", "host-context-benchmark", "Replay this many thread/memory/threadpool callback mixes on the host bookkeeping with 10, 100 and 1000 live domains, print the time per mix and exit", false, 0, "int");
+      cmd.add(hostContextBenchmarkArg);
+
+      ValueArg<int> threadpoolBenchmarkArg("", "threadpool-benchmark", "Queue this many synthetic work items (empty, then 50 us of CPU each) to the host thread pool, print items/sec and queue latency percentiles and exit", false, 0, "int");
+      cmd.add(threadpoolBenchmarkArg);
+
+      ValueArg<string> streamTestArg("", "stream-test", "Run the file stream conformance and throughput tests over this file and exit", false, "", "string");
+      cmd.add(streamTestArg);
+
+      vector<string> loaderOptimizations;
+      loaderOptimizations.push_back("single");
+      loaderOptimizations.push_back("multi");
+      loaderOptimizations.push_back("multihost");
+      ValuesConstraint<string> loaderOptimizationConstraint(loaderOptimizations);
+      ValueArg<string> loaderOptimizationArg("", "loader-optimization", "Loader optimization for the CLR: 'multi' loads host assemblies domain-neutral, so their JITted code is shared by all the pooled domains (default: CLR default)", false, "", &loaderOptimizationConstraint);
+      cmd.add(loaderOptimizationArg);
+
+      ValueArg<string> privateLibArg("", "private-lib", "The directory holding the assemblies the host provides to snippets (default: PrivateLib in the current directory)", false, "", "string");
+      cmd.add(privateLibArg);
+
+      SwitchArg prefetchArg("", "prefetch", "Map and load in memory all the host assemblies in the background while the CLR starts");
+      cmd.add(prefetchArg);
+
+      SwitchArg hostIocpArg("", "host-iocp", "Let the host manage I/O completion ports (bind, completion threads, per-domain I/O accounting). Off by default until it is validated with SnippetTest25 and --iocp-benchmark");
+      cmd.add(hostIocpArg);
+
       cmd.parse(argc, argv);
 
       testMode = testModeArg.getValue();
@@ -69,7 +382,7 @@ int main(int argc, char* argv [])
             }
          }
       }
-      else {
+      else if (!iocpBenchmarkArg.isSet() && !hostContextBenchmarkArg.isSet() && !threadpoolBenchmarkArg.isSet() && !streamTestArg.isSet()) {
          if (!snippetDataBaseArg.isSet()) {
             CmdLineParseException error("You should specify a valid DB file name");
             try {
@@ -88,12 +401,36 @@ int main(int argc, char* argv [])
       methodName = methodNameArg.getValue();
       snippetDataBase = snippetDataBaseArg.getValue();
       serverPort = serverPortArg.getValue();
+      iocpBenchmarkCompletions = iocpBenchmarkArg.getValue();
+      hostContextBenchmarkIterations = hostContextBenchmarkArg.getValue();
+      threadpoolBenchmarkItems = threadpoolBenchmarkArg.getValue();
+      streamTestFileName = streamTestArg.getValue();
+      loaderOptimization = loaderOptimizationArg.getValue();
+      privateLibDirectory = privateLibArg.getValue();
+      prefetchHostAssemblies = prefetchArg.getValue();
+      hostIoCompletion = hostIocpArg.getValue();
    }
    catch (ArgException &e) {
       cerr << "Error: " << e.error() << " for arg " << e.argId() << endl;      
       return 1;
    }
 
+   if (iocpBenchmarkCompletions > 0) {
+      return RunIoCompletionBenchmark(iocpBenchmarkCompletions);
+   }
+
+   if (hostContextBenchmarkIterations > 0) {
+      return RunHostContextBenchmark(hostContextBenchmarkIterations);
+   }
+
+   if (threadpoolBenchmarkItems > 0) {
+      return RunThreadpoolBenchmark(threadpoolBenchmarkItems);
+   }
+
+   if (!streamTestFileName.empty()) {
+      return RunFileStreamTest(toWstring(streamTestFileName));
+   }
+
    HRESULT hr;
 
    ICLRMetaHost* metaHost = NULL;
@@ -145,6 +482,32 @@ int main(int argc, char* argv [])
       return -1;
    }
 
+   // Domain-neutral loading: with MULTI_DOMAIN, host assemblies (strong named, and with the same grant in
+   // every sandbox) are loaded once and their code JITted once for all the pooled domains.
+   // Must be set before the runtime is started.
+   DWORD loaderOptimizationFlag = 0;
+   if (loaderOptimization == "single")
+      loaderOptimizationFlag = STARTUP_LOADER_OPTIMIZATION_SINGLE_DOMAIN;
+   else if (loaderOptimization == "multi")
+      loaderOptimizationFlag = STARTUP_LOADER_OPTIMIZATION_MULTI_DOMAIN;
+   else if (loaderOptimization == "multihost")
+      loaderOptimizationFlag = STARTUP_LOADER_OPTIMIZATION_MULTI_DOMAIN_HOST;
+
+   if (loaderOptimizationFlag != 0) {
+      DWORD startupFlags = 0;
+      WCHAR hostConfigFile[MAX_PATH];
+      DWORD hostConfigFileLength = MAX_PATH;
+      hr = runtimeInfo->GetDefaultStartupFlags(&startupFlags, hostConfigFile, &hostConfigFileLength);
+      if (SUCCEEDED(hr)) {
+         startupFlags = (startupFlags & ~STARTUP_LOADER_OPTIMIZATION_MASK) | loaderOptimizationFlag;
+         hr = runtimeInfo->SetDefaultStartupFlags(startupFlags, (hostConfigFileLength > 1) ? hostConfigFile : NULL);
+      }
+      if (FAILED(hr))
+         Logger::Error("Cannot set the loader optimization: 0x%x", hr);
+      else
+         Logger::Info("Loader optimization: %s", loaderOptimization.c_str());
+   }
+
    // Load the CLR into the current process and return a runtime interface 
    // pointer. ICorRuntimeHost and ICLRRuntimeHost are the two CLR hosting  
    // interfaces supported by CLR 4.0. 
@@ -209,22 +572,46 @@ int main(int argc, char* argv [])
       clrHostProtectionManager->Release();
    }
 
+   // The assembly store uses it to read the identity of host assemblies, and of assemblies registered at runtime
+   typedef HRESULT (STDAPICALLTYPE *GetCLRIdentityManagerFn)(REFIID riid, IUnknown** ppManager);
+   GetCLRIdentityManagerFn getCLRIdentityManager = NULL;
+   ICLRAssemblyIdentityManager* identityManager = NULL;
+   hr = runtimeInfo->GetProcAddress("GetCLRIdentityManager", (LPVOID*)&getCLRIdentityManager);
+   if (SUCCEEDED(hr))
+      hr = getCLRIdentityManager(IID_ICLRAssemblyIdentityManager, (IUnknown**)&identityManager);
+   if (FAILED(hr))
+      Logger::Error("Cannot obtain the CLR assembly identity manager: 0x%x", hr);
+
+   // All the assemblies in PrivateLib are host assemblies: adding a library is a file drop
    std::list<AssemblyInfo> hostAssemblies;
-   std::wstring currentDir = CurrentDirectory();
-
-   // TODO: DB table or configuration file?
-   // Or automatically all assemblies in PrivateLib
-   AssemblyInfo appDomainManager(L"SimpleHostRuntime, Version=1.0.0.0, Culture=neutral, PublicKeyToken=9abf81284e6824ad, processorarchitecture=MSIL", currentDir + L"\\PrivateLib\\SimpleHostRuntime.dll", L"");
-   AssemblyInfo pumpkinData(L"Pumpkin.Data, Version=1.0.0.0, Culture=neutral, PublicKeyToken=9abf81284e6824ad, processorarchitecture=msil", currentDir + L"\\PrivateLib\\Pumpkin.Data.dll", L"");
-   AssemblyInfo pumpkinMonitor(L"Pumpkin.Monitor, Version=1.0.0.0, Culture=neutral, PublicKeyToken=9abf81284e6824ad, processorarchitecture=MSIL", currentDir + L"\\PrivateLib\\Pumpkin.Monitor.dll", L"");  
-   AssemblyInfo newtonsoftJson(L"newtonsoft.json, version=6.0.0.0, culture=neutral, publickeytoken=30ad4fe6b2a6aeed, processorarchitecture=MSIL", currentDir + L"\\PrivateLib\\Newtonsoft.Json.dll", L"");
-   hostAssemblies.push_back(appDomainManager);
-   hostAssemblies.push_back(pumpkinData);
-   hostAssemblies.push_back(pumpkinMonitor);
-   hostAssemblies.push_back(newtonsoftJson);
+   std::wstring hostAssembliesDir = privateLibDirectory.empty() ? (CurrentDirectory() + L"\\PrivateLib") : toWstring(privateLibDirectory);
+   int numHostAssemblies = ScanAssemblyDirectory(hostAssembliesDir, identityManager, hostAssemblies);
+   Logger::Info(L"%d host assemblies found in %s", numHostAssemblies, hostAssembliesDir.c_str());
+
+   // We need at least our AppDomainManager
+   AssemblyInfo appDomainManager(L"SimpleHostRuntime, Version=1.0.0.0, Culture=neutral, PublicKeyToken=9abf81284e6824ad, processorarchitecture=MSIL", hostAssembliesDir + L"\\SimpleHostRuntime.dll", L"");
+   bool appDomainManagerFound = false;
+   for (auto it = hostAssemblies.begin(); it != hostAssemblies.end(); ++it) {
+      if (it->Identity == appDomainManager.Identity)
+         appDomainManagerFound = true;
+   }
+   if (!appDomainManagerFound) {
+      Logger::Error(L"SimpleHostRuntime not found in %s", hostAssembliesDir.c_str());
+      hostAssemblies.push_back(appDomainManager);
+   }
 
    // Construct our host control object.
-   DHHostControl* hostControl = new DHHostControl(clr, hostAssemblies);
+   DHHostControl* hostControl = new DHHostControl(clr, hostAssemblies, identityManager);
+   if (identityManager)
+      identityManager->Release();
+
+   // Snippet assemblies must never become domain-neutral: they would stay loaded until the process exits
+   hostControl->SetDomainNeutralLoading(loaderOptimizationFlag == STARTUP_LOADER_OPTIMIZATION_MULTI_DOMAIN);
+   hostControl->SetHostIoCompletion(hostIoCompletion);
+
+   // Load the images while the CLR starts: they will be there for the first snippets
+   if (prefetchHostAssemblies)
+      hostControl->PrefetchHostAssemblies();
 
    // Associate our domain manager
    clrControl->SetAppDomainManagerType(appDomainManager.FullName.c_str(), L"SimpleHostRuntime.SimpleHostAppDomainManager");